@@ -4,17 +4,47 @@
 
 #ifdef __x86_64__
 
+#include "include/architecture/arch_timer.h"
 #include "include/architecture/x86_64/pit.h"
 #include "stdint.h"
 #include "include/architecture/x86_64/hpet.h"
+#include "include/architecture/arch_cpu.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/architecture/arch_local_interrupt_controller.h"
+#include "include/architecture/x86_64/tsc.h"
+#include "include/definitions/definitions.h"
+#include "include/scheduling/process.h"
+#include "include/scheduling/sched.h"
 
 /*
  *  We can use function pointers instead of branches but this is okay for now.
  */
-uint16_t timer_get_current_count() {
+uint64_t timer_get_current_count() {
     return timer_ticks;
 }
 
+/*
+ * Nanoseconds since the TSC was calibrated. Until tsc_init has run all we have is the PIT's millisecond count so that is used
+ * instead, it is only boot code that could ask that early anyway.
+ */
+uint64_t clock_monotonic_ns() {
+    if (tsc_clock.mult == 0) {
+        return timer_ticks * (NANOSECONDS_PER_SECOND / 1000);
+    }
+    return tsc_read_ns();
+}
+
+int64_t clock_gettime(const uint64_t clock_id, struct kernel_timespec *ts) {
+    if (clock_id != CLOCK_MONOTONIC || ts == NULL) {
+        return KERN_INVALID_ARG;
+    }
+
+    const uint64_t now = clock_monotonic_ns();
+    ts->tv_sec = (int64_t) (now / NANOSECONDS_PER_SECOND);
+    ts->tv_nsec = (int64_t) (now % NANOSECONDS_PER_SECOND);
+    return KERN_SUCCESS;
+}
+
 void timer_set_frequency_hz(uint64_t freq) {
     if (use_pit) {
         pit_set_freq(freq);
@@ -42,10 +72,48 @@ void timer_set_reload_value(uint16_t value) {
 
 }
 
+/*
+ * A process that is running with no locks held is put to sleep on the timer wheel so the CPU can run something else, anything
+ * earlier than that (boot, driver init, the scheduler itself) still has to spin on the PIT clock.
+ */
 void timer_sleep(uint16_t millis) {
+    const struct process *process = current_process();
+    if (process != NULL && process->current_state == PROCESS_RUNNING && my_cpu()->lock_depth == 0) {
+        sched_sleep_timeout(NULL, millis);
+        return;
+    }
+
     uint64_t start = timer_ticks;
     while ((timer_ticks - start) < millis);
 }
 
 
+/*
+ * Tickless idle. The periodic tick is swapped for a one shot that goes off after max_millis at the latest and the CPU halts
+ * until either that or timer_wake_cpu clears cpu->idle. Anything else that comes in (the PIT clock on the BSP, a TLB shootdown)
+ * is handled and we go straight back to sleep. The periodic tick is put back before returning.
+ *
+ * sti only takes effect after the instruction that follows it, so an interrupt that is already pending when we get to the
+ * sti; hlt pair wakes the hlt instead of being taken before it and leaving us asleep.
+ */
+void timer_idle(struct cpu *cpu, const uint64_t max_millis) {
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+
+    lapic_timer_oneshot(lapic_timer_vector + 32, max_millis);
+    while (__atomic_load_n(&cpu->idle, __ATOMIC_SEQ_CST)) {
+        asm volatile("sti; hlt; cli" ::: "memory");
+    }
+    lapic_timer_periodic(lapic_timer_vector + 32, LAPIC_TIMER_PERIOD_MS);
+
+    if (interrupts) {
+        enable_interrupts();
+    }
+}
+
+void timer_wake_cpu(struct cpu *cpu) {
+    lapic_send_int(cpu->cpu_id, lapic_wakeup_vector + 32);
+}
+
+
 #endif
\ No newline at end of file
@@ -46,14 +46,18 @@ void *find_acpi_table(const char *name) {
         }
     }
 
-    panic("ACPI Table not found");
+    return NULL;
 }
 
 /*
- * Use the rsdp to find the r/xsdt and also find the mcfg table for setting up PCIe by taking the base address out of the table.
- * Finally parse the MADT to find information about ISOs, apics, NMI
+ * Use the rsdp to find the r/xsdt. This is split out of acpi_init because the SRAT has to be read before the physical memory manager
+ * is set up, which is well before acpi_init runs. Nothing here allocates so it is safe to call that early, and calling it twice is harmless.
  */
-void acpi_init() {
+void acpi_root_init() {
+    if (acpi_root_sdt != NULL) {
+        return;
+    }
+
     void *addr = (void *) rsdp_request.response->address;
     struct acpi_rsdp *rsdp = (struct acpi_rsdp *) addr;
 
@@ -82,6 +86,14 @@ void acpi_init() {
             panic("acpi init failed\n");
         }
     }
+}
+
+/*
+ * Find the mcfg table for setting up PCIe by taking the base address out of the table.
+ * Finally parse the MADT to find information about ISOs, apics, NMI
+ */
+void acpi_init() {
+    acpi_root_init();
 
     struct mcfg_header *mcfg_header = (struct mcfg_header *) find_acpi_table("MCFG");
 
@@ -0,0 +1,71 @@
+//
+// Created by dustyn on 10/17/26.
+//
+
+
+#include "include/architecture/x86_64/acpi.h"
+#include "include/architecture/x86_64/srat.h"
+#include "include/drivers/serial/uart.h"
+#include "include/memory/numa.h"
+
+/*
+ * The SRAT (System Resource Affinity Table) tells us which proximity domain each CPU and each chunk of memory belongs to.
+ * This runs before phys_init so the physical allocator can build a pool per node, so nothing in here can allocate.
+ * Plenty of machines (and QEMU without -numa) don't have one at all which just leaves everything on node 0.
+ */
+void srat_init() {
+    acpi_root_init();
+    struct acpi_srat *srat = (struct acpi_srat *) find_acpi_table("SRAT");
+
+    if (srat == NULL) {
+        serial_printf("No SRAT, assuming a single NUMA node\n");
+        return;
+    }
+
+    uint64_t offset = 0;
+    const uint64_t table_length = srat->header.len - sizeof(struct acpi_srat);
+
+    while (offset + sizeof(struct srat_header) <= table_length) {
+        struct srat_header *header = (struct srat_header *) (srat->table + offset);
+        // same guard as madt_init, a zero length entry would loop forever
+        if (header->len == 0) {
+            break;
+        }
+
+        switch (header->type) {
+            case SRAT_TYPE_LAPIC_AFFINITY: {
+                struct srat_lapic_affinity *lapic = (struct srat_lapic_affinity *) header;
+                if (lapic->flags & SRAT_ENABLED) {
+                    const uint32_t domain = lapic->proximity_domain_low |
+                                            (uint32_t) lapic->proximity_domain_high[0] << 8 |
+                                            (uint32_t) lapic->proximity_domain_high[1] << 16 |
+                                            (uint32_t) lapic->proximity_domain_high[2] << 24;
+                    numa_add_cpu(domain, lapic->apic_id);
+                }
+                break;
+            }
+            case SRAT_TYPE_MEMORY_AFFINITY: {
+                struct srat_memory_affinity *memory = (struct srat_memory_affinity *) header;
+                if (memory->flags & SRAT_ENABLED && memory->length != 0) {
+                    const uint8_t node = numa_add_memory_range(memory->proximity_domain, memory->base_address,
+                                                               memory->length);
+                    serial_printf("SRAT: memory %x.64 - %x.64 on node %i\n", memory->base_address,
+                                  memory->base_address + memory->length, node);
+                }
+                break;
+            }
+            case SRAT_TYPE_X2APIC_AFFINITY: {
+                struct srat_x2apic_affinity *x2apic = (struct srat_x2apic_affinity *) header;
+                if (x2apic->flags & SRAT_ENABLED) {
+                    numa_add_cpu(x2apic->proximity_domain, x2apic->x2apic_id);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        offset += header->len;
+    }
+
+    info_printf("SRAT: %i NUMA node(s) found\n", numa_node_count);
+}
@@ -5,6 +5,7 @@
 #include "include/architecture//arch_atomic_operations.h"
 #include "include/architecture/x86_64/asm_functions.h"
 #include "include/architecture/x86_64/pit.h"
+#include "include/architecture/arch_tlb.h"
 
 #define DEADLOCK_DETECTION_THRESHOLD 1000000000
 bool arch_atomic_swap(uint64_t *field, uint64_t new_value){
@@ -12,6 +13,11 @@ bool arch_atomic_swap(uint64_t *field, uint64_t new_value){
     uint64_t loops = 0;
     // The xchg is atomic.
     while(xchg(field, new_value) != 0) {
+        /*
+         * We are spinning with interrupts off, if whoever holds this lock is waiting on us to take a TLB shootdown it would
+         * never finish and never let go, so take any that are waiting on us by hand
+         */
+        tlb_shootdown_poll();
         loops++;
         if (loops == DEADLOCK_DETECTION_THRESHOLD) {
 
@@ -45,4 +51,20 @@ bool arch_atomic_swap_or_return(uint64_t *field, uint64_t new_value){
     // references to happen after the lock is acquired.
     __sync_synchronize(); /* for x86 this is just an mfence instruction , you can also put an empty inline asm function and declare it as changing memory */
     return true;
-}
\ No newline at end of file
+}
+
+/*
+ * Unconditionally swap in new_value and hand back what was there. Unlike the two above there is no spinning and no
+ * barrier, xchg with a memory operand is already a full barrier on x86.
+ */
+uint64_t arch_atomic_exchange(uint64_t *field, uint64_t new_value) {
+    return xchg(field, new_value);
+}
+
+/*
+ * Only store new_value if the field still holds expected, returns whether it did. This is the building block for the
+ * lock-free lists (see heap_remote_free), lock cmpxchg is a full barrier as well.
+ */
+bool arch_atomic_cas(uint64_t *field, uint64_t expected, uint64_t new_value) {
+    return cmpxchg(field, expected, new_value) == expected;
+}
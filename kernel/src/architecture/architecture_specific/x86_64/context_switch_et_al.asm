@@ -10,8 +10,8 @@ context_switch
         mov [rdi + 32], rdi       ; register_state.rdi = rdi
         mov [rdi + 40], rsi       ; register_state.rsi = rsi
         mov [rdi + 48], rbp       ; register_state.rbp = rbp
-        mov [rdi + 56], rsp       ; register_state.rsp = rsp
         pop rax                   ; pop the return address off the stack
+        mov [rdi + 56], rsp       ; register_state.rsp = rsp, after the pop so we come back with the stack the caller expects
         mov [rdi + 64], rax       ; register_state.rip = the start of the stack frame (interrupt only)
         mov [rdi + 72], r8        ; register_state.r8 = r8
         mov [rdi + 80], r9        ; register_state.r9 = r9
@@ -19,21 +19,27 @@ context_switch
         mov [rdi + 96], r11       ; register_state.r11 = r11
         mov [rdi + 104], r12      ; register_state.r12 = r12
         mov [rdi + 112], r13      ; register_state.r13 = r13
+        mov [rdi + 120], r14      ; register_state.r14 = r14
+        mov [rdi + 128], r15      ; register_state.r15 = r15
 
                                   ; save the interrupt flag
         pushfq                    ;push flag onto stack
         pop rax                   ; pop flags into rax
-        shl rax, 9                ; bring flag bit over
+        shr rax, 9                ; bring IF (bit 9) down to bit 0
         and rax, 1                ; isolate flag bit
-        mov [rdi + 136], rax      ; move the flag bit into the struct
+        mov [rdi + 144], al       ; interrupts_enabled is a bool, only write the one byte
 
-        mov cr3, rcx                  ;load the new page table
-        mov r15, rdx
+        test rcx, rcx             ; 0 means the page table is already loaded, see tlb_switch_page_map
+        jz keep_page_table
+        mov cr3, rcx                  ;load the new page table (PCID and no flush bit included)
+        keep_page_table:
+        test dl, dl               ; user_proc, a process going out to user mode for the first time takes the sysret path
+        jnz user
 
         mov rbx, [rsi + 8]        ; rbx = register_state.rbx
         mov rcx, [rsi + 16]       ; rcx = register_state.rcx
         mov rdx, [rsi + 24]       ; rdx = register_state.rdx
-        mov rdi, [rsi + 32]       ; rsi = register_state.rsi
+        mov rdi, [rsi + 32]       ; rdi = register_state.rdi
         mov rbp, [rsi + 48]       ; rbp = register_state.rbp
         mov rsp, [rsi + 56]       ; rsp = register_state.rsp
         mov rax, [rsi + 64]       ; it is fine to overwrite this below because
@@ -44,13 +50,15 @@ context_switch
         mov r11, [rsi + 96]       ; r11 = register_state.r11
         mov r12, [rsi + 104]      ; r12 = register_state.r12
         mov r13, [rsi + 112]      ; r13 = register_state.r13
+        mov r14, [rsi + 120]      ; r14 = register_state.r14
+        mov r15, [rsi + 128]      ; r15 = register_state.r15
 
                                   ; restore the interrupt flag
         pushfq
         pop rax
-        shl rax, 9                ; bring flag bit over
+        shr rax, 9                ; bring IF (bit 9) down to bit 0
         and rax, 1                ; isolate flag bit
-        cmp rax, [rsi + 136]      ; check if current flag bit matches
+        cmp al, byte [rsi + 144]  ; check if current flag bit matches, a byte compare since the bool is one byte
         je done                   ;if so jmp to done and finish context save by writing over rsi
         jg off                    ; if rax is greater, jump to turn interrupts off
         jmp on                    ; else turn them on
@@ -69,16 +77,26 @@ context_switch
         done:
         mov rax, [rsi + 0]        ; rax = register_state.rax; since we use rax for IF shenanigans above,restore it after
         mov rsi, [rsi + 40]       ; rsi = register_state.rsi this has to be done last to preserve the pointer argument for flag restoration
+        ret
 
-        cmp r15, 1
-        jne kernel
-
-        pop rcx
-        mov r11, 0x202
-        mov rsp, rbp
+                                  ; straight out to user mode, every register comes from the state and the stack is user_rsp
+        user:
+        cli                       ; sysret turns them back on through r11, nothing can come in while rsp is the user stack
+        mov rcx, [rsi + 64]       ; sysret jumps to rcx = register_state.rip
+        mov r11, 0x202            ; and loads rflags from r11, IF set
+        mov rax, [rsi + 0]        ; rax = register_state.rax, the return value for a forked child
+        mov rbx, [rsi + 8]        ; rbx = register_state.rbx
+        mov rdx, [rsi + 24]       ; rdx = register_state.rdx
+        mov rdi, [rsi + 32]       ; rdi = register_state.rdi
+        mov rbp, [rsi + 48]       ; rbp = register_state.rbp
+        mov r8, [rsi + 72]        ; r8 = register_state.r8
+        mov r9, [rsi + 80]        ; r9 = register_state.r9
+        mov r10, [rsi + 88]       ; r10 = register_state.r10
+        mov r12, [rsi + 104]      ; r12 = register_state.r12
+        mov r13, [rsi + 112]      ; r13 = register_state.r13
+        mov r14, [rsi + 120]      ; r14 = register_state.r14
+        mov r15, [rsi + 128]      ; r15 = register_state.r15
+        mov rsp, [rsi + 136]      ; rsp = register_state.user_rsp
+        mov rsi, [rsi + 40]       ; rsi = register_state.rsi, last since it is the pointer we are reading from
         o64 sysret
-
-
-        kernel:
-        ret
         
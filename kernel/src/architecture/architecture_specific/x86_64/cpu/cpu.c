@@ -8,6 +8,7 @@
 #include <include/architecture/arch_smp.h>
 #include <include/architecture/arch_timer.h>
 #include <include/architecture/arch_vmm.h>
+#include <include/architecture/arch_tlb.h>
 
 #include <include/data_structures/spinlock.h>
 #include <include/definitions/string.h>
@@ -70,6 +71,7 @@ void arch_initialise_cpu( struct limine_smp_info *smp_info) {
     gdt_reload();
     idt_reload();
     load_vmm();
+    tlb_cpu_init();
     lapic_init();
     serial_printf("CPU %x.8  online, LAPIC ID %x.8 \n",smp_info->processor_id,get_lapid_id());
     void *kernel_syscall_stack = kzmalloc(DEFAULT_STACK_SIZE) + DEFAULT_STACK_SIZE;
@@ -89,6 +91,7 @@ void arch_initialise_cpu( struct limine_smp_info *smp_info) {
     release_spinlock(&bootstrap_lock);
     cpus_online++;
     while (!ready){}/* Just to make entry print message cleaner and grouped together */
+    lapic_timer_start();
     kthread_init();
     scheduler_main();
 }
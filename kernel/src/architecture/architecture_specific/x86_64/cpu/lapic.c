@@ -11,9 +11,19 @@
 #include <include/architecture/arch_smp.h>
 #include <include/architecture/x86_64/msr.h>
 #include <include/architecture/x86_64/asm_functions.h>
+#include <include/architecture/x86_64/idt.h>
+#include <include/architecture/x86_64/pit.h>
+#include "include/scheduling/sched.h"
+#include "include/scheduling/timer_wheel.h"
 
-uint64_t apic_ticks = 0;
+uint64_t apic_ticks = 0; /* LAPIC timer ticks per millisecond at the divider we use, the same on every CPU */
 uint64_t lapic_base = 0;
+uint8_t lapic_timer_vector = 0;
+uint8_t lapic_wakeup_vector = 0;
+uint64_t lapic_timer_interrupts[MAX_CPUS];
+
+static void lapic_timer_interrupt();
+static void lapic_wakeup_interrupt();
 
 void lapic_init() {
     pic_disable();
@@ -27,6 +37,17 @@ void lapic_init() {
     if(my_cpu()->cpu_id == 0) {
         my_cpu()->tss = &tss[0];
     }
+
+    /*
+     * The timer vector only ever fires on the CPU whose timer it is so it goes straight into the IDT like the shootdown vector.
+     * The BSP gets here before any AP is started so they all find it set.
+     */
+    if (lapic_timer_vector == 0) {
+        lapic_timer_vector = idt_get_irq_vector();
+        irq_register_local(lapic_timer_vector, lapic_timer_interrupt);
+        lapic_wakeup_vector = idt_get_irq_vector();
+        irq_register_local(lapic_wakeup_vector, lapic_wakeup_interrupt);
+    }
 }
 
 
@@ -58,19 +79,81 @@ void lapic_timer_oneshot(uint8_t vec, uint64_t ms) {
     lapic_timer_stop();
     lapic_write(LAPIC_TIMER_DIV, 0);
     lapic_write(LAPIC_TIMER_LVT, vec);
+    /* The count is only 32 bits, anything longer just fires early */
+    lapic_write(LAPIC_TIMER_INITCNT, apic_ticks * ms > 0xFFFFFFFF ? 0xFFFFFFFF : apic_ticks * ms);
+}
+
+/*
+ * Fire vec every ms milliseconds on this CPU until stopped
+ */
+void lapic_timer_periodic(uint8_t vec, uint64_t ms) {
+    lapic_timer_stop();
+    lapic_write(LAPIC_TIMER_DIV, 0);
+    lapic_write(LAPIC_TIMER_LVT, vec | LAPIC_TIMER_PERIODIC);
     lapic_write(LAPIC_TIMER_INITCNT, apic_ticks * ms);
 }
 
+/*
+ * Work out how fast the LAPIC timer counts by letting it run for LAPIC_CALIBRATE_MS against PIT channel 2 (see
+ * pit_channel2_start).
+ *
+ * Every LAPIC timer runs off the same clock so this is only done once, on the BSP, and the APs use the same figure.
+ */
 void lapic_calibrate_timer() {
+    if (apic_ticks != 0) {
+        return;
+    }
+
+    pit_channel2_start(LAPIC_CALIBRATE_MS);
+
     lapic_timer_stop();
     lapic_write(LAPIC_TIMER_DIV, 0);
-    lapic_write(LAPIC_TIMER_LVT, BIT(16) | 0xff);
-    lapic_write(LAPIC_TIMER_INITCNT, 0xFFFFFFFF);
     lapic_write(LAPIC_TIMER_LVT, LAPIC_TIMER_DISABLE);
-    uint32_t ticks = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURCNT);
-    apic_ticks = ticks;
-    serial_printf("LAPIC ticks %x.64\n", apic_ticks);
+    lapic_write(LAPIC_TIMER_INITCNT, 0xFFFFFFFF);
+
+    while (!pit_channel2_expired()) {
+        asm volatile("pause");
+    }
+
+    const uint32_t ticks = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURCNT);
     lapic_timer_stop();
+    apic_ticks = ticks / LAPIC_CALIBRATE_MS;
+    serial_printf("LAPIC ticks per ms %i\n", apic_ticks);
+}
+
+/*
+ * Start this CPU's scheduling tick. Each CPU runs its own so none of them has to be poked by another every tick, and they do
+ * not all tick at the same moment either.
+ */
+void lapic_timer_start() {
+    lapic_timer_periodic(lapic_timer_vector + 32, LAPIC_TIMER_PERIOD_MS);
+    serial_printf("LAPIC timer started on CPU %i\n", my_cpu()->cpu_id);
+}
+
+static void lapic_timer_interrupt() {
+    if (panicked) {
+        for (;;) {
+            cli();
+            asm volatile("hlt");
+        }
+    }
+
+    struct cpu *cpu = my_cpu();
+    lapic_timer_interrupts[cpu->cpu_id]++;
+
+    /* If we were idle this is the one shot timer_idle set, time to go and look for work again */
+    __atomic_store_n(&cpu->idle, false, __ATOMIC_SEQ_CST);
+
+    lapic_eoi(); /* Before sched_tick, it may not come back until this process is scheduled again */
+    timer_wheel_tick();
+    sched_tick();
+}
+
+/*
+ * Somebody gave an idle CPU work, they have already cleared its idle flag so all this has to do is get it out of hlt
+ */
+static void lapic_wakeup_interrupt() {
+    lapic_eoi();
 }
 
 void lapic_eoi() {
@@ -11,6 +11,11 @@
 #include "include/definitions/types.h"
 #include "include/architecture/arch_cpu.h"
 #include "include/drivers/serial/uart.h"
+#include "include/memory/vmm.h"
+#include "include/definitions/definitions.h"
+
+#define PAGE_FAULT_PRESENT BIT(0) /* Set in the error code if the page was there and this is a protection fault */
+#define PAGE_FAULT_WRITE BIT(1)
 
 //Exception 0
 void divide_by_zero() {
@@ -87,8 +92,29 @@ void general_protection_fault(int32_t error_code) {
 }
 
 // Exception 14: Page Fault
-void page_fault() {
+void page_fault(uint64_t error_code) {
     uint64_t faulting_address = rcr2();
+    struct process *process = my_cpu()->running_process;
+
+    /*
+     * A page that is not present may just be part of a region that gets filled in on first touch (ELF segments), that only
+     * works if the page map of the process it belongs to is the one loaded
+     */
+    if (!(error_code & PAGE_FAULT_PRESENT) && process != NULL && process->page_map != NULL &&
+        PTE_ADDR(rcr3()) == (uint64_t) process->page_map->top_level &&
+        handle_region_fault(process->page_map, faulting_address) == KERN_SUCCESS) {
+        return;
+    }
+
+    /*
+     * A write to a page that is there but read only may be to a page fork shared with another process, which gets copied now
+     */
+    if ((error_code & PAGE_FAULT_PRESENT) && (error_code & PAGE_FAULT_WRITE) && process != NULL &&
+        process->page_map != NULL && PTE_ADDR(rcr3()) == (uint64_t) process->page_map->top_level &&
+        handle_cow_fault(process->page_map, faulting_address) == KERN_SUCCESS) {
+        return;
+    }
+
     uint64_t page_map = rcr3();
     uint64_t cpu_no = my_cpu()->cpu_number;
     err_printf("Page Fault Occurred With Access %x.64 within page map %x.64 on CPU %i\n", faulting_address,page_map,cpu_no);
@@ -38,6 +38,28 @@ void hpet_init() {
     hpet_write(general_config, config);
 }
 
+/*
+ * Just get the main counter running so it can be used as a clock, none of the timers or the legacy routing are touched so
+ * the PIT keeps its interrupt. Returns false if there is no HPET.
+ */
+bool hpet_enable_counter() {
+    if (hpet.address.address == 0) {
+        return false;
+    }
+
+    address = (uint64_t) Phys2Virt(hpet.address.address);
+    period = hpet_read(capabilities_id) >> 32;
+    hpet_write(general_config, hpet_read(general_config) | HPET_ENABLE_CNF_MASK);
+    return period != 0;
+}
+
+/*
+ * How long one tick of the main counter is, in femtoseconds
+ */
+uint64_t hpet_get_period() {
+    return period;
+}
+
 uint64_t hpet_get_main_counter() {
     return hpet_read(main_counter_value);
 }
@@ -706,6 +706,14 @@ void irq_register(uint8_t vec, void* handler) {
 }
 
 
+/*
+ * For vectors that only ever arrive as IPIs from other CPUs, there is no IOAPIC pin behind them so all we do is hook the handler
+ */
+void irq_register_local(uint8_t vec, void* handler) {
+    irq_routines[vec] = handler;
+    serial_printf("IRQ %x.8  loaded (local)\n", vec);
+}
+
 void irq_unregister(uint8_t vec) {
     irq_routines[vec] = (void *)no_irq_handler;
 }
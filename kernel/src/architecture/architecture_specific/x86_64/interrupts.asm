@@ -154,8 +154,10 @@ isr_wrapper_13:
 global isr_wrapper_14
 isr_wrapper_14:
   pushaq
+  mov rdi, [rsp + 120]  ; the error code the CPU pushed before our 15 registers
   call page_fault
   popaq
+  add rsp, 8            ; page faults can return now so the error code has to come off before iretq
   iretq
 
 global isr_wrapper_16
@@ -0,0 +1,337 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef __x86_64__
+#include "include/architecture/arch_tlb.h"
+#include "include/architecture/arch_cpu.h"
+#include "include/architecture/arch_smp.h"
+#include "include/architecture/arch_vmm.h"
+#include "include/architecture/arch_local_interrupt_controller.h"
+#include "include/architecture/x86_64/asm_functions.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/architecture/x86_64/idt.h"
+#include "include/definitions/definitions.h"
+#include "include/drivers/serial/uart.h"
+#include "include/memory/vmm.h"
+
+static struct tlb_flush_queue tlb_flush_queues[MAX_CPUS];
+static bool tlb_polling[MAX_CPUS]; /* Draining from tlb_shootdown_poll, the drain takes a spinlock which would poll again */
+static uint8_t tlb_shootdown_vector = 0;
+
+uint64_t tlb_shootdowns = 0;
+uint64_t tlb_ipis_sent = 0;
+bool tlb_pcid_enabled = false;
+struct tlb_pcid_cache tlb_pcid_caches[MAX_CPUS];
+
+static void tlb_shootdown_interrupt();
+
+/*
+ * The shootdown vector is only ever sent as an IPI so it goes straight into the IDT, there is nothing to route on the IOAPIC
+ */
+void tlb_shootdown_init() {
+    for (uint64_t i = 0; i < MAX_CPUS; i++) {
+        initlock(&tlb_flush_queues[i].lock, TLB_LOCK);
+    }
+
+    tlb_shootdown_vector = idt_get_irq_vector();
+    irq_register_local(tlb_shootdown_vector, tlb_shootdown_interrupt);
+    serial_printf("TLB shootdown vector %x.8\n", tlb_shootdown_vector + 32);
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    tlb_pcid_enabled = ecx & CPUID_PCID;
+    tlb_cpu_init();
+    serial_printf("PCID %s\n", tlb_pcid_enabled ? "enabled" : "not supported");
+}
+
+/*
+ * Run on every CPU before it first switches page maps. CR4.PCIDE can only be turned on while the current PCID is 0, which it
+ * is until tlb_switch_page_map hands out the first slot.
+ */
+void tlb_cpu_init() {
+    if (tlb_pcid_enabled) {
+        lcr4(rcr4() | CR4_PCIDE);
+    }
+}
+
+/*
+ * Record that cpu is about to load page_map and work out what to put in cr3. The page map has to be recorded before cr3 is
+ * written, anyone who changes a mapping in page_map after this is seen will send us a shootdown and anyone who changed one
+ * before it finished the change before we loaded cr3, so we can never be left holding a stale translation that nobody told us
+ * about. The same goes for the stale flag on our PCID slot, which is why it is checked only after page_map is stored.
+ *
+ * Returns 0 if page_map is already what is loaded (kernel threads and the scheduler share the kernel top level), in which
+ * case context_switch leaves cr3 alone.
+ */
+uint64_t tlb_switch_page_map(struct cpu *cpu, struct virt_map *page_map) {
+    const uint64_t top_level = (uint64_t) page_map->top_level;
+    struct tlb_pcid_cache *cache = &tlb_pcid_caches[cpu->cpu_id];
+
+    __atomic_store_n(&cpu->page_map, page_map, __ATOMIC_SEQ_CST);
+
+    if (PTE_ADDR(rcr3()) == top_level) {
+        cache->skipped++;
+        return 0;
+    }
+
+    if (!tlb_pcid_enabled) {
+        return top_level;
+    }
+
+    for (uint64_t i = 0; i < TLB_PCID_SLOTS; i++) {
+        struct tlb_pcid_slot *slot = &cache->slots[i];
+        if (slot->top_level != top_level) {
+            continue;
+        }
+
+        if (__atomic_exchange_n(&slot->stale, 0, __ATOMIC_SEQ_CST) == 0) {
+            cache->hits++;
+            return top_level | (i + 1) | CR3_NOFLUSH;
+        }
+
+        cache->misses++;
+        return top_level | (i + 1);
+    }
+
+    const uint64_t victim = cache->next_victim;
+    cache->next_victim = (victim + 1) % TLB_PCID_SLOTS;
+    cache->slots[victim].top_level = top_level;
+    __atomic_store_n(&cache->slots[victim].stale, 0, __ATOMIC_SEQ_CST);
+    cache->misses++;
+
+    return top_level | (victim + 1);
+}
+
+/*
+ * Whatever any CPU has cached under pgdir can no longer be trusted the next time it is loaded, skip_cpu is a CPU that has just
+ * flushed it itself (or MAX_CPUS for none)
+ */
+static void tlb_pcid_mark_stale(const p4d_t *pgdir, const uint64_t skip_cpu) {
+    if (!tlb_pcid_enabled) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < MAX_CPUS; i++) {
+        if (i == skip_cpu) {
+            continue;
+        }
+
+        for (uint64_t slot = 0; slot < TLB_PCID_SLOTS; slot++) {
+            if (tlb_pcid_caches[i].slots[slot].top_level == (uint64_t) pgdir) {
+                __atomic_store_n(&tlb_pcid_caches[i].slots[slot].stale, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+}
+
+/*
+ * Called when a top level page table is freed. The page can come straight back as somebody else's top level and any slot still
+ * holding its address would hand the new owner the old owner's translations.
+ */
+void tlb_page_map_freed(p4d_t *pgdir) {
+    tlb_pcid_mark_stale(pgdir, MAX_CPUS);
+}
+
+void tlb_batch_init(struct tlb_batch *batch, p4d_t *pgdir) {
+    batch->pgdir = pgdir;
+    batch->count = 0;
+    batch->full_flush = false;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, const uint64_t address) {
+    if (batch->full_flush) {
+        return;
+    }
+
+    if (batch->count == TLB_BATCH_MAX) {
+        batch->full_flush = true;
+        return;
+    }
+
+    batch->addresses[batch->count++] = address;
+}
+
+static void tlb_flush_local(const uint64_t *addresses, const uint64_t count, const bool full_flush) {
+    if (full_flush) {
+        lcr3(rcr3());
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        native_flush_tlb_single(addresses[i]);
+    }
+}
+
+/*
+ * Empty this CPU's queue. The addresses are copied out so senders are not held up behind our invlpgs, and completed is only
+ * moved once they are actually flushed.
+ */
+static void tlb_flush_queue_drain(struct tlb_flush_queue *queue) {
+    uint64_t addresses[TLB_QUEUE_MAX];
+
+    acquire_spinlock(&queue->lock);
+    const uint64_t ticket = queue->requested;
+    const uint64_t count = queue->count;
+    const bool full_flush = queue->full_flush;
+
+    if (ticket == __atomic_load_n(&queue->completed, __ATOMIC_ACQUIRE)) {
+        release_spinlock(&queue->lock);
+        return;
+    }
+
+    for (uint64_t i = 0; i < count && !full_flush; i++) {
+        addresses[i] = queue->addresses[i];
+    }
+    queue->count = 0;
+    queue->full_flush = false;
+    release_spinlock(&queue->lock);
+
+    if (full_flush) {
+        queue->full_flushes++;
+    }
+    tlb_flush_local(addresses, count, full_flush);
+    __atomic_store_n(&queue->completed, ticket, __ATOMIC_RELEASE);
+}
+
+/*
+ * Called from the spinlock spin loop. A CPU spinning with interrupts off can't take the shootdown IPI, and the CPU it is
+ * waiting on may be sitting in tlb_batch_flush holding that very lock until we do, so we take it here instead.
+ */
+void tlb_shootdown_poll() {
+    if (bsp || tlb_shootdown_vector == 0) {
+        return;
+    }
+
+    const uint64_t cpu_id = my_cpu()->cpu_id;
+    struct tlb_flush_queue *queue = &tlb_flush_queues[cpu_id];
+    if (tlb_polling[cpu_id] ||
+        __atomic_load_n(&queue->requested, __ATOMIC_ACQUIRE) == __atomic_load_n(&queue->completed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    tlb_polling[cpu_id] = true;
+    tlb_flush_queue_drain(queue);
+    tlb_polling[cpu_id] = false;
+}
+
+static void tlb_shootdown_interrupt() {
+    struct tlb_flush_queue *queue = &tlb_flush_queues[my_cpu()->cpu_id];
+    queue->ipis_received++;
+    tlb_flush_queue_drain(queue);
+    lapic_eoi();
+}
+
+/*
+ * Put a batch on another CPU's queue, returns the ticket to wait on
+ */
+static uint64_t tlb_flush_queue_push(struct tlb_flush_queue *queue, const struct tlb_batch *batch) {
+    acquire_spinlock(&queue->lock);
+
+    if (batch->full_flush || queue->full_flush || queue->count + batch->count > TLB_QUEUE_MAX) {
+        queue->full_flush = true;
+    } else {
+        for (uint64_t i = 0; i < batch->count; i++) {
+            queue->addresses[queue->count++] = batch->addresses[i];
+        }
+    }
+
+    const uint64_t ticket = ++queue->requested;
+    release_spinlock(&queue->lock);
+    return ticket;
+}
+
+/*
+ * Flush a batch here and on every other CPU that has batch->pgdir loaded, and do not come back until they all have. Kernel
+ * threads have their own virt_map pointing at the kernel top level so it is the top level that is compared, not the map.
+ *
+ * The IPIs are sent with interrupts off so we can't move CPUs halfway through. If they were on when we were called (so no
+ * spinlock is held) they go back on while we wait for the acks and any shootdown aimed at us comes in through the IPI like
+ * normal. If they were off we are probably holding a spinlock, so we keep emptying our own queue by hand while we wait since
+ * somebody may be shooting us down at the same time. The other side of that is a target spinning on a lock we hold, it can't
+ * take our IPI either, which is what tlb_shootdown_poll in the spinlock spin loop is for.
+ */
+void tlb_batch_flush(struct tlb_batch *batch) {
+    uint64_t tickets[MAX_CPUS];
+    uint64_t targets = 0;
+
+    if (batch->count == 0 && !batch->full_flush) {
+        return;
+    }
+
+    const p4d_t *current = (p4d_t *) PTE_ADDR(rcr3());
+
+    if (bsp || smp_enabled == 0 || tlb_shootdown_vector == 0) {
+        tlb_pcid_mark_stale(batch->pgdir, MAX_CPUS);
+        tlb_flush_local(batch->addresses, batch->count, batch->full_flush);
+        batch->count = 0;
+        batch->full_flush = false;
+        return;
+    }
+
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+
+    struct cpu *cpu = my_cpu();
+
+    /*
+     * Slots are marked stale before looking at who has the map loaded, and tlb_switch_page_map stores page_map before it looks
+     * at its slot. So a CPU switching to the map right now either sees the stale flag or is seen here and gets the IPI. CPUs
+     * that do have it loaded get marked as well, they might have switched away by the time the IPI lands (invlpg only touches
+     * the current PCID) and otherwise it just costs them a flush the next time they come back to it.
+     */
+    tlb_pcid_mark_stale(batch->pgdir, current == batch->pgdir ? cpu->cpu_id : MAX_CPUS);
+
+    /* The entries were changed before we got here, make sure nobody can see cpu_list before they see those changes */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (uint64_t i = 0; i < cpu_count && i < MAX_CPUS; i++) {
+        const struct virt_map *page_map = __atomic_load_n(&cpu_list[i].page_map, __ATOMIC_SEQ_CST);
+        if (i == cpu->cpu_id || cpu_list[i].cpu_id != i || page_map == NULL || page_map->top_level != batch->pgdir) {
+            continue;
+        }
+
+        tickets[i] = tlb_flush_queue_push(&tlb_flush_queues[i], batch);
+        lapic_send_int(i, tlb_shootdown_vector + 32);
+        targets |= BIT(i);
+        tlb_ipis_sent++;
+    }
+
+    if (current == batch->pgdir) {
+        tlb_flush_local(batch->addresses, batch->count, batch->full_flush);
+    }
+
+    if (targets != 0) {
+        tlb_shootdowns++;
+    }
+
+    if (interrupts) {
+        enable_interrupts();
+    }
+
+    while (targets != 0) {
+        if (!interrupts) {
+            tlb_flush_queue_drain(&tlb_flush_queues[cpu->cpu_id]);
+        }
+
+        for (uint64_t i = 0; i < cpu_count && i < MAX_CPUS; i++) {
+            if ((targets & BIT(i)) && __atomic_load_n(&tlb_flush_queues[i].completed, __ATOMIC_ACQUIRE) >= tickets[i]) {
+                targets &= ~BIT(i);
+            }
+        }
+        asm volatile("pause");
+    }
+
+    batch->count = 0;
+    batch->full_flush = false;
+}
+
+/*
+ * Single address version for the places that only ever change one entry
+ */
+void tlb_shootdown(p4d_t *pgdir, const uint64_t address) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, pgdir);
+    tlb_batch_add(&batch, address);
+    tlb_batch_flush(&batch);
+}
+#endif
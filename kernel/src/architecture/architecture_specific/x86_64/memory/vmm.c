@@ -22,13 +22,82 @@
 #include "include/drivers/serial/uart.h"
 #include "include/architecture//arch_vmm.h"
 #include "include/architecture/x86_64/asm_functions.h"
+#include "include/architecture/arch_asm_functions.h"
 #include "include/architecture/x86_64/msr.h"
+#include "include/architecture/arch_tlb.h"
 
 #define FOUR_GB 0x100000000
+#define ONE_MB 0x100000
+#define UNMAP_BATCH_PAGES 64 /* Pages unmap_range unmaps before it shoots them down and frees them */
 
 
 p4d_t* global_pg_dir = 0;
 
+/*
+ * CPUID 0x80000001 EDX bit 26, set in init_vmm. Without it only 2MiB leaves are used.
+ */
+static bool gigabyte_pages = false;
+
+/*
+ * How many leaves of each size map_pages has put in, printed when the kernel address space is built
+ */
+static uint64_t gigabyte_pages_mapped = 0;
+static uint64_t huge_pages_mapped = 0;
+static uint64_t small_pages_mapped = 0;
+
+/*
+ * The variable range MTRRs as firmware left them, read once in init_vmm so map_huge_page can tell whether a huge leaf would
+ * straddle two memory types. A leaf that does is undefined behaviour as far as the SDM is concerned, in practice the CPU may
+ * pick either type for the whole leaf (or split it up in the TLB, which is what the leaf was supposed to avoid).
+ */
+struct mtrr_range {
+    uint64_t base;
+    uint64_t size;
+    uint8_t type;
+};
+
+static struct mtrr_range mtrr_ranges[MTRR_MAX_VARIABLE];
+static uint64_t mtrr_range_count = 0;
+static bool mtrr_enabled = false;
+static bool mtrr_fixed_enabled = false;
+
+/*
+ * Range walks. Instead of going down from the root for every page, a cursor remembers the last 4KiB entry it found and just
+ * steps to the next one in the same leaf table, only walking from the root again when the address crosses into a new table
+ * (every 2MiB) or jumps somewhere else. Mapping or unmapping n pages is then n entry writes plus n / 512 walks instead of
+ * n walks of four levels each.
+ *
+ * A lookup can land on a huge page leaf instead of a 4KiB entry (see walk_page_directory_level), leaf_size says which, and the
+ * cursor never steps past a huge leaf since the entry after it in the directory is not the next page.
+ */
+struct pte_cursor {
+    p4d_t* pgdir;
+    int flags;
+    uint64_t address; /* The address pte is the entry for */
+    pte_t* pte;
+    uint64_t leaf_size;
+};
+
+enum unmap_mode {
+    UNMAP_KERNEL, /* The pages came from the kernel heap, kfree them */
+    UNMAP_USER, /* The pages came from the user pool, ufree them */
+    UNMAP_FOREIGN /* Somebody else owns the pages, just drop the mapping */
+};
+
+static void split_huge_page(uint64_t* entry, uint64_t va, uint64_t child_size);
+
+static void unmap_range(p4d_t* pgdir, uint64_t address, uint64_t size, enum unmap_mode mode);
+
+static void unmap_free_pages(const uint64_t* pages, uint64_t count, enum unmap_mode mode);
+
+static bool map_huge_page(p4d_t* pgdir, uint64_t physaddr, uint64_t address, uint64_t perms, uint64_t remaining,
+                          uint64_t* leaf_size);
+
+static void release_user_page(void* page);
+
+static void read_mtrrs();
+
+static bool mtrr_uniform(uint64_t physaddr, uint64_t size);
 
 void switch_page_table(p4d_t* page_dir) {
     lcr3((uint64_t)(page_dir));
@@ -49,14 +118,28 @@ void toggle_smep(bool on) {
 }
 
 void init_vmm() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    gigabyte_pages = edx & BIT(26);
+    read_mtrrs();
+
     kernel_pg_map = kmalloc(PAGE_SIZE);
-    kernel_pg_map->top_level = Virt2Phys(kzmalloc(PAGE_SIZE));
+    kernel_pg_map->top_level = Virt2Phys(page_table_alloc());
     kernel_pg_map->vm_regions = NULL;
 
     /*
      * Map symbols in the linker script
+     *
+     * Timed and counted so the effect of huge pages on boot can be seen.
      */
+    const uint64_t tables_before = page_table_pages;
+    const uint64_t start = read_cycle_counter();
     map_kernel_address_space(kernel_pg_map->top_level);
+    const uint64_t cycles = read_cycle_counter() - start;
+
+    serial_printf("Kernel address space mapped in %i cycles using %i page tables, leaves: %i 1GiB %i 2MiB %i 4KiB\n",
+                  cycles, page_table_pages - tables_before, gigabyte_pages_mapped, huge_pages_mapped,
+                  small_pages_mapped);
 
 
     serial_printf("Kernel page table built in table located at %x.64\n", kernel_pg_map->top_level);
@@ -106,70 +189,102 @@ void map_kernel_address_space(p4d_t* pgdir) {
 
 /*
  * Walk a page directory to find a physical address, or allocate all the way down if the alloc flag is set
+ *
+ * The walk stops at level (PAGE_LEVEL_1G, PAGE_LEVEL_2M or PAGE_LEVEL_4K) and hands back a pointer to the entry there. If a
+ * huge page leaf is in the way on the way down, a plain lookup just returns that leaf and sets leaf_size to how much it covers.
+ * Anything that wants to change the mapping (ALLOC or SPLIT) gets the huge page broken up into the next size down first so that
+ * it always ends up with an entry of exactly the size it asked for and the rest of the huge page stays mapped as it was.
  */
-
-pte_t* walk_page_directory(p4d_t* pgdir, const void* va, const int flags) {
+pte_t* walk_page_directory_level(p4d_t* pgdir, const void* va, const int flags, const int level, uint64_t* leaf_size) {
     if (pgdir == 0) {
         panic("page dir zero");
     }
 
-    p4d_t p4d_idx = P4DX(va);
-    pud_t pud_idx = PUDX(va);
-    pmd_t pmd_idx = PMDX(va);
-    pte_t pte_idx = PTX(va);
-
-    pud_t* pud = Phys2Virt(pgdir);
-    pud += p4d_idx;
+    uint64_t* table = Phys2Virt(pgdir);
 
-    if (!(*pud & PTE_P)) {
-        if (flags & ALLOC) {
-            *pud = (pud_t)Virt2Phys(kzmalloc(PAGE_SIZE));
-            *pud |= PTE_P | PTE_RW;
-            if (flags & USER_ALLOC) {
-                *pud |= PTE_U;
-            }
+    for (int current = PAGE_LEVEL_512G; ; current--) {
+        const uint64_t shift = PTXSHIFT + ((current - 1) * 9);
+        uint64_t* entry = &table[((uint64_t)va >> shift) & PAGE_DIR_MASK];
 
+        if (current == level) {
+            *leaf_size = 1UL << shift;
+            return entry;
         }
-        else {
-            return 0;
-        }
-    }
 
-    pmd_t* pmd = Phys2Virt(PTE_ADDR(*pud));
-    pmd += pud_idx;
-    if (!(*pmd & PTE_P)) {
-        if (flags & ALLOC) {
-            *pmd = (pmd_t)Virt2Phys(kzmalloc(PAGE_SIZE));
-            *pmd |= PTE_P | PTE_RW;
+        if (!(*entry & PTE_P)) {
+            if (!(flags & ALLOC)) {
+                return 0;
+            }
+
+            *entry = (uint64_t)Virt2Phys(page_table_alloc()) | PTE_P | PTE_RW;
             if (flags & USER_ALLOC) {
-                *pmd |= PTE_U;
+                *entry |= PTE_U;
             }
         }
-        else {
-            return 0;
+        else if (current <= PAGE_LEVEL_1G && (*entry & PTE_PS)) {
+            if (!(flags & (ALLOC | SPLIT))) {
+                *leaf_size = 1UL << shift;
+                return entry;
+            }
+            split_huge_page(entry, (uint64_t)va & ~((1UL << shift) - 1), 1UL << (shift - 9));
         }
+
+        table = Phys2Virt(PTE_ADDR(*entry));
     }
+}
 
-    pte_t* pte = Phys2Virt(PTE_ADDR(*pmd));
-    pte += pmd_idx;
+pte_t* walk_page_directory(p4d_t* pgdir, const void* va, const int flags) {
+    uint64_t leaf_size;
+    return walk_page_directory_level(pgdir, va, flags, PAGE_LEVEL_4K, &leaf_size);
+}
 
-    if (!(*pte & PTE_P)) {
-        if (flags & ALLOC) {
-            *pte = (pte_t)Virt2Phys(kzmalloc(PAGE_SIZE));
-            *pte |= PTE_P | PTE_RW;
+static void pte_cursor_init(struct pte_cursor* cursor, p4d_t* pgdir, const int flags) {
+    cursor->pgdir = pgdir;
+    cursor->flags = flags;
+    cursor->address = 0;
+    cursor->pte = 0;
+    cursor->leaf_size = 0;
+}
 
-            if (flags & USER_ALLOC) {
-                *pte |= PTE_U;
-            }
-        }
-        else {
-            return 0;
-        }
+/*
+ * The entry for address, or 0 if there is no table for it (and ALLOC was not passed)
+ */
+static pte_t* pte_cursor_seek(struct pte_cursor* cursor, const uint64_t address) {
+    if (cursor->pte != 0 && cursor->leaf_size == PAGE_SIZE && address == cursor->address + PAGE_SIZE &&
+        (address & ((1UL << PMDXSHIFT) - 1)) != 0) {
+        cursor->pte++;
+    }
+    else {
+        cursor->pte = walk_page_directory_level(cursor->pgdir, (void*)address, cursor->flags, PAGE_LEVEL_4K,
+                                                &cursor->leaf_size);
     }
 
-    pte_t* entry = Phys2Virt(PTE_ADDR(*pte));
-    entry += pte_idx;
-    return entry;
+    cursor->address = address;
+    return cursor->pte;
+}
+
+/*
+ * Replace a huge page leaf with a table of 512 entries of the next size down that map exactly the same memory with the same
+ * permissions. Bit 7 means page size in a directory entry but PAT in a 4KiB entry, so it is only kept when the new entries are
+ * still huge. The old translation and the new ones agree so there is nothing stale to worry about, but the TLB entry for the
+ * huge page is dropped anyway.
+ */
+static void split_huge_page(uint64_t* entry, uint64_t va, uint64_t child_size) {
+    uint64_t* table = page_table_alloc();
+    const uint64_t base = PTE_ADDR(*entry) & ~((child_size * 512) - 1);
+    uint64_t perms = PTE_FLAGS(*entry) & ~PTE_PS;
+
+    if (child_size != PAGE_SIZE) {
+        perms |= PTE_PS;
+    }
+
+    for (uint64_t i = 0; i < 512; i++) {
+        table[i] = (base + (i * child_size)) | perms;
+    }
+
+    *entry = (uint64_t)Virt2Phys(table) | PTE_P | PTE_RW | (perms & PTE_U);
+    native_flush_tlb_single(va);
+    DEBUG_PRINT("Huge page at %x.64 split into %i byte pages\n", va, child_size);
 }
 
 /*
@@ -211,20 +326,59 @@ int map_single_page(p4d_t* pgdir, uint64_t physaddr, const uint64_t* va, const u
     return KERN_SUCCESS;
 }
 
+/*
+ * Change the permissions of a page that is already mapped, for pages that have to be writable while the kernel fills them in
+ * but not after
+ */
+int protect_page(p4d_t* pgdir, const uint64_t va, const uint64_t perms) {
+    const uint64_t aligned_address = ALIGN_DOWN(va, PAGE_SIZE);
+    pte_t* entry = walk_page_directory(pgdir, (void*)aligned_address, SPLIT);
+
+    if (entry == 0 || !(*entry & PTE_P)) {
+        return KERN_NOT_FOUND;
+    }
+
+    *entry = PTE_ADDR(*entry) | perms | PTE_P;
+    tlb_shootdown(pgdir, aligned_address);
+    return KERN_SUCCESS;
+}
+
 /*
  * Maps pages from VA/PA to size in page size increments.
+ *
+ * Kernel mappings use 1GiB leaves (where the CPU has them) and 2MiB leaves wherever the virtual address, the physical address
+ * and what is left to map all line up and nothing is mapped there already, and fall back to 4KiB pages for the ragged edges.
+ * This is what keeps the HHDM from costing a page table per 2MiB. Below 4GiB, where firmware puts MMIO, the LAPIC, the HPET
+ * and friends, 1GiB leaves are never used and a 2MiB leaf only goes in where the MTRRs give all of it the same memory type.
+ * User mappings always get 4KiB pages since everything that
+ * tears down user address spaces (free_page_tables, dealloc_user_va) frees them a page at a time.
+ *
+ * PTE_PAT is the same bit as PTE_PS so anything asking for it gets 4KiB pages as well.
  */
 int map_pages(p4d_t* pgdir, uint64_t physaddr, const uint64_t* va, const uint64_t perms, const uint64_t size) {
     pte_t* pte;
     uint64_t address = PGROUNDDOWN((uint64_t) va);
-    uint64_t last = PGROUNDUP(((uint64_t) va) + size - 1);
+    const uint64_t end = PGROUNDUP(((uint64_t) va) + size - 1) + PAGE_SIZE;
+    const bool huge = !(perms & (PTE_U | PTE_PAT));
+    struct pte_cursor cursor;
     uint64_t flags = ALLOC;
 
     if (perms & PTE_U) {
         flags |= USER_ALLOC;
     }
-    for (;;) {
-        if ((pte = walk_page_directory(pgdir, (void*)address, flags)) == 0) {
+
+    pte_cursor_init(&cursor, pgdir, flags);
+
+    while (address < end) {
+        uint64_t leaf_size = PAGE_SIZE;
+
+        if (huge && map_huge_page(pgdir, physaddr, address, perms, end - address, &leaf_size)) {
+            address += leaf_size;
+            physaddr += leaf_size;
+            continue;
+        }
+
+        if ((pte = pte_cursor_seek(&cursor, address)) == 0) {
             return -1;
         }
 
@@ -235,10 +389,7 @@ int map_pages(p4d_t* pgdir, uint64_t physaddr, const uint64_t* va, const uint64_
         }
 
         *pte = physaddr | perms | PTE_P;
-
-        if (address == last) {
-            break;
-        }
+        small_pages_mapped++;
 
         address += PAGE_SIZE;
         physaddr += PAGE_SIZE;
@@ -247,18 +398,56 @@ int map_pages(p4d_t* pgdir, uint64_t physaddr, const uint64_t* va, const uint64_
     return 0;
 }
 
+/*
+ * Try to map the biggest leaf that fits at address, 1GiB first and then 2MiB. The slot has to be empty (or already a leaf,
+ * which we just overwrite) since replacing a table would throw away whatever smaller mappings hang off of it.
+ */
+static bool map_huge_page(p4d_t* pgdir, uint64_t physaddr, uint64_t address, uint64_t perms, uint64_t remaining,
+                          uint64_t* leaf_size) {
+    static const int levels[] = {PAGE_LEVEL_1G, PAGE_LEVEL_2M};
+
+    for (uint64_t i = 0; i < 2; i++) {
+        const uint64_t size = 1UL << (PTXSHIFT + ((levels[i] - 1) * 9));
+
+        if ((levels[i] == PAGE_LEVEL_1G && (!gigabyte_pages || physaddr < FOUR_GB)) || remaining < size ||
+            (address & (size - 1)) || (physaddr & (size - 1)) || !mtrr_uniform(physaddr, size)) {
+            continue;
+        }
+
+        uint64_t* entry = walk_page_directory_level(pgdir, (void*)address, ALLOC, levels[i], leaf_size);
+        if (entry == 0 || ((*entry & PTE_P) && !(*entry & PTE_PS))) {
+            continue;
+        }
+
+        const bool remap = *entry & PTE_P;
+        *entry = physaddr | perms | PTE_P | PTE_PS;
+        if (remap) {
+            tlb_shootdown(pgdir, address);
+        }
+        if (levels[i] == PAGE_LEVEL_1G) {
+            gigabyte_pages_mapped++;
+        } else {
+            huge_pages_mapped++;
+        }
+        return true;
+    }
+
+    return false;
+}
+
 
 uint64_t dealloc_va(p4d_t* pgdir, const uint64_t address) {
     uint64_t aligned_address = ALIGN_DOWN(address, PAGE_SIZE);
-    pte_t* entry = walk_page_directory(pgdir, (void*)aligned_address, 0);
+    pte_t* entry = walk_page_directory(pgdir, (void*)aligned_address, SPLIT);
 
     if (entry == 0) {
         return 0;
     }
     if (*entry & PTE_P) {
-        kfree(Phys2Virt((void *) PTE_ADDR(*entry)));
+        void* page = Phys2Virt((void *) PTE_ADDR(*entry));
         *entry = 0;
-        native_flush_tlb_single(aligned_address);
+        tlb_shootdown(pgdir, aligned_address);
+        kfree(page);
         return 1;
     }
 
@@ -267,14 +456,14 @@ uint64_t dealloc_va(p4d_t* pgdir, const uint64_t address) {
 
 uint64_t dealloc_va_foreign(p4d_t* pgdir, const uint64_t address) {
     uint64_t aligned_address = ALIGN_DOWN(address, PAGE_SIZE);
-    pte_t* entry = walk_page_directory(pgdir, (void*)aligned_address, 0);
+    pte_t* entry = walk_page_directory(pgdir, (void*)aligned_address, SPLIT);
 
     if (entry == 0) {
         return 0;
     }
     if (*entry & PTE_P) {
         *entry = 0;
-        native_flush_tlb_single(aligned_address);
+        tlb_shootdown(pgdir, aligned_address);
         return 1;
     }
 
@@ -282,20 +471,99 @@ uint64_t dealloc_va_foreign(p4d_t* pgdir, const uint64_t address) {
 }
 
 void dealloc_va_range_foreign(p4d_t* pgdir, const uint64_t address, const uint64_t size) {
-    uint64_t aligned_size = ALIGN_UP(size, PAGE_SIZE);
-    DEBUG_PRINT("dealloc_va_range: aligned size %i size %i\n", aligned_size, size);
-    serial_printf("Aligned size %x.64\n", aligned_size);
-    for (uint64_t i = 0; i <= aligned_size; i += PAGE_SIZE) {
-        dealloc_va_foreign(pgdir, address + i);
-    }
+    unmap_range(pgdir, address, size, UNMAP_FOREIGN);
 }
 
 void dealloc_va_range(p4d_t* pgdir, const uint64_t address, const uint64_t size) {
-    uint64_t aligned_size = ALIGN_UP(size, PAGE_SIZE);
-    DEBUG_PRINT("dealloc_va_range: aligned size %i size %i\n", aligned_size, size);
-    serial_printf("Aligned size %x.64\n", aligned_size);
-    for (uint64_t i = 0; i <= aligned_size; i += PAGE_SIZE) {
-        dealloc_va(pgdir, address + i);
+    unmap_range(pgdir, address, size, UNMAP_KERNEL);
+}
+
+/*
+ * Unmap everything from address through address + size rounded up to a page (that last page included, same as the single page
+ * versions always did) and free the pages behind it depending on mode. Huge pages in the range are split so only the
+ * range itself is touched, and a missing table means there is nothing mapped in the rest of its 2MiB so we skip straight
+ * past it.
+ *
+ * Pages are not freed the moment their entry is cleared since another CPU could still have the old translation cached and
+ * scribble on the page after somebody else has been handed it. Every UNMAP_BATCH_PAGES pages (and at the end) the addresses
+ * are shot down in one go and only then are the pages behind them freed.
+ */
+static void unmap_range(p4d_t* pgdir, uint64_t address, const uint64_t size, const enum unmap_mode mode) {
+    const uint64_t end = ALIGN_DOWN(address, PAGE_SIZE) + ALIGN_UP(size, PAGE_SIZE) + PAGE_SIZE;
+    uint64_t pages[UNMAP_BATCH_PAGES];
+    uint64_t page_count = 0;
+    struct pte_cursor cursor;
+    struct tlb_batch batch;
+
+    DEBUG_PRINT("unmap_range: address %x.64 size %i\n", address, size);
+    pte_cursor_init(&cursor, pgdir, SPLIT);
+    tlb_batch_init(&batch, pgdir);
+    address = ALIGN_DOWN(address, PAGE_SIZE);
+
+    while (address < end) {
+        pte_t* entry = pte_cursor_seek(&cursor, address);
+
+        if (entry == 0) {
+            address = ALIGN_DOWN(address, 1UL << PMDXSHIFT) + (1UL << PMDXSHIFT);
+            continue;
+        }
+
+        if (*entry & PTE_P) {
+            pages[page_count++] = PTE_ADDR(*entry);
+            *entry = 0;
+            tlb_batch_add(&batch, address);
+        }
+
+        if (page_count == UNMAP_BATCH_PAGES) {
+            tlb_batch_flush(&batch);
+            unmap_free_pages(pages, page_count, mode);
+            page_count = 0;
+        }
+
+        address += PAGE_SIZE;
+    }
+
+    tlb_batch_flush(&batch);
+    unmap_free_pages(pages, page_count, mode);
+}
+
+static void unmap_free_pages(const uint64_t* pages, const uint64_t count, const enum unmap_mode mode) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (mode == UNMAP_KERNEL) {
+            kfree(Phys2Virt((void *) pages[i]));
+        }
+        else if (mode == UNMAP_USER) {
+            release_user_page((void*)pages[i]);
+        }
+    }
+}
+
+/*
+ * Map the pages backing [source_va, source_va + pages) in source into pgdir starting at va. Both sides are walked with a
+ * cursor so this is one walk per 2MiB on each side rather than two full walks per page.
+ */
+void map_foreign_range(p4d_t* pgdir, uint64_t va, p4d_t* source, uint64_t source_va, const uint64_t pages,
+                       const uint64_t perms) {
+    struct pte_cursor source_cursor;
+    struct pte_cursor cursor;
+    pte_cursor_init(&source_cursor, source, 0);
+    pte_cursor_init(&cursor, pgdir, ALLOC);
+
+    for (uint64_t i = 0; i < pages; i++, va += PAGE_SIZE, source_va += PAGE_SIZE) {
+        const pte_t* source_entry = pte_cursor_seek(&source_cursor, source_va);
+        if (source_entry == 0 || !(*source_entry & PTE_P)) {
+            panic("map_foreign_range: source page not mapped");
+            return;
+        }
+
+        const uint64_t leaf_size = source_cursor.leaf_size;
+        const uint64_t physaddr = (PTE_ADDR(*source_entry) & ~(leaf_size - 1)) + (source_va & (leaf_size - 1) & ~(PAGE_SIZE - 1));
+        pte_t* entry = pte_cursor_seek(&cursor, va);
+        if (entry == 0) {
+            panic("map_foreign_range: cannot map foreign page");
+            return;
+        }
+        *entry = physaddr | perms | PTE_P;
     }
 }
 
@@ -333,7 +601,7 @@ void free_page_tables(p4d_t* pgdir) {
                         void* page_phys = (void*)(PTE_ADDR(virt_pte[pte_idx]));
                         // Check if page is in user space
                         if (virt_pte[pte_idx] & PTE_U) {
-                            ufree((page_phys));
+                            release_user_page(page_phys);
                         } else {
 
                         }
@@ -343,18 +611,191 @@ void free_page_tables(p4d_t* pgdir) {
 
                 pmd_t *virt_pmd = Phys2Virt(pmd);
                 virt_pmd[pmd_idx] = 0;
-                kfree(virt_pte);
+                page_table_free(virt_pte);
             }
             pud_t *virt_pud = Phys2Virt(pud);
             virt_pud[pud_idx] = 0;
-            kfree(Phys2Virt(pmd));
+            page_table_free(Phys2Virt(pmd));
         }
         p4d_t *virt_p4d = Phys2Virt(pgdir);
         virt_p4d[p4d_idx] = 0;
-        kfree(Phys2Virt(pud));
+        page_table_free(Phys2Virt(pud));
+    }
+}
+
+/*
+ * A user page can be mapped by more than one address space after a fork, it only goes back to the pool once the last of them
+ * lets go of it
+ */
+static void release_user_page(void* page) {
+    if (!phys_page_unshare(page)) {
+        ufree(page);
+    }
+}
+
+/*
+ * Fork. Every user page mapped in source is mapped at the same address in destination instead of being copied. Writable pages
+ * are made read only and marked PTE_COW in both, and the first write to one from either side lands in copy_on_write_page which
+ * gives the writer its own copy. Read only pages (text, rodata) never need copying and are just shared.
+ *
+ * Nothing is copied here but every mapped page still costs an entry write on each side and a reference, so this is linear in
+ * the number of mapped pages, just with a much smaller constant than copying them. Missing tables are skipped whole.
+ *
+ * Source loses write access to its pages so the batch is flushed on every CPU that has it loaded before we return.
+ */
+void share_user_pages(p4d_t* source, p4d_t* destination) {
+    struct pte_cursor cursor;
+    struct tlb_batch batch;
+    pte_cursor_init(&cursor, destination, ALLOC | USER_ALLOC);
+    tlb_batch_init(&batch, source);
+
+    for (size_t p4d_idx = 0; p4d_idx < ENTRIES_PER_TABLE; p4d_idx++) {
+        const uintptr_t p4d_base = (uintptr_t)p4d_idx << 39;
+        if (p4d_base > USER_STACK_TOP) break;
+        pud_t* pud = get_next_level(source, p4d_idx);
+        if (!pud) continue;
+        for (size_t pud_idx = 0; pud_idx < ENTRIES_PER_TABLE; pud_idx++) {
+            const uintptr_t pud_base = p4d_base | ((uintptr_t)pud_idx << 30);
+            if (pud_base > USER_STACK_TOP) break;
+            pmd_t* pmd = get_next_level(pud, pud_idx);
+            if (!pmd) continue;
+            for (size_t pmd_idx = 0; pmd_idx < ENTRIES_PER_TABLE; pmd_idx++) {
+                const uintptr_t pmd_base = pud_base | ((uintptr_t)pmd_idx << 21);
+                if (pmd_base > USER_STACK_TOP) break;
+                pte_t* pte = get_next_level(pmd, pmd_idx);
+                if (!pte) continue;
+                pte_t* virt_pte = Phys2Virt(pte);
+                for (size_t pte_idx = 0; pte_idx < ENTRIES_PER_TABLE; pte_idx++) {
+                    if (!(virt_pte[pte_idx] & PTE_P) || !(virt_pte[pte_idx] & PTE_U)) {
+                        continue;
+                    }
+
+                    const uint64_t address = pmd_base | ((uintptr_t)pte_idx << PTXSHIFT);
+                    if (virt_pte[pte_idx] & (PTE_RW | PTE_COW)) {
+                        virt_pte[pte_idx] = (virt_pte[pte_idx] & ~PTE_RW) | PTE_COW;
+                        tlb_batch_add(&batch, address);
+                    }
+
+                    pte_t* entry = pte_cursor_seek(&cursor, address);
+                    if (entry == 0) {
+                        panic("share_user_pages: cannot map page in child");
+                        return;
+                    }
+                    *entry = virt_pte[pte_idx];
+                    phys_page_share((void*)PTE_ADDR(virt_pte[pte_idx]));
+                }
+            }
+        }
+    }
+
+    tlb_batch_flush(&batch);
+}
+
+/*
+ * A write to a PTE_COW page. If nobody else maps the page any more (the other side already took its own copy, or exited) it
+ * is just made writable again, otherwise the writer gets a fresh page with the same contents.
+ *
+ * pgdir has to be what is loaded. User pages are not in the HHDM so the old contents are read out through va into a bounce
+ * buffer and written back through va once it points at the new page. The old page is only let go of after that, if it was
+ * unshared the other way in the meantime we end up as its last owner and free it.
+ *
+ * Returns KERN_NOT_FOUND if this is not a copy on write page at all, which means it is a real protection fault.
+ */
+int copy_on_write_page(p4d_t* pgdir, const uint64_t va) {
+    const uint64_t aligned_address = ALIGN_DOWN(va, PAGE_SIZE);
+    pte_t* entry = walk_page_directory(pgdir, (void*)aligned_address, 0);
+
+    if (entry == 0 || !(*entry & PTE_P) || !(*entry & PTE_COW)) {
+        return KERN_NOT_FOUND;
+    }
+
+    void* page = (void*)PTE_ADDR(*entry);
+    const uint64_t flags = (PTE_FLAGS(*entry) & ~PTE_COW) | PTE_RW;
+
+    if (phys_page_shares(page) == 0) {
+        *entry = (uint64_t)page | flags;
+        tlb_shootdown(pgdir, aligned_address);
+        return KERN_SUCCESS;
+    }
+
+    void* bounce = kmalloc(PAGE_SIZE);
+    memcpy(bounce, (void*)aligned_address, PAGE_SIZE);
+
+    void* copy = umalloc(1);
+    *entry = (uint64_t)copy | flags;
+    tlb_shootdown(pgdir, aligned_address);
+    memcpy((void*)aligned_address, bounce, PAGE_SIZE);
+    kfree(bounce);
+
+    release_user_page(page);
+    return KERN_SUCCESS;
+}
+
+
+/*
+ * Read the variable range MTRRs. Only contiguous masks are handled (the SDM discourages anything else and no firmware I know
+ * of does it), so each one is just an aligned power of two sized range given by the lowest set bit in its mask.
+ */
+static void read_mtrrs() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & BIT(12))) {
+        return;
+    }
+
+    const uint64_t def_type = rdmsr(MTRR_DEF_TYPE_MSR);
+    mtrr_enabled = def_type & MTRR_ENABLE;
+    mtrr_fixed_enabled = mtrr_enabled && (def_type & MTRR_FIXED_ENABLE);
+    if (!mtrr_enabled) {
+        return;
+    }
+
+    uint64_t count = rdmsr(MTRR_CAP_MSR) & 0xFF;
+    if (count > MTRR_MAX_VARIABLE) {
+        count = MTRR_MAX_VARIABLE;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        const uint64_t mask = rdmsr(MTRR_PHYS_MASK_MSR(i));
+        if (!(mask & MTRR_MASK_VALID)) {
+            continue;
+        }
+
+        const uint64_t base = rdmsr(MTRR_PHYS_BASE_MSR(i));
+        const uint64_t size = 1ULL << __builtin_ctzll(mask & ~(PAGE_SIZE - 1));
+        mtrr_ranges[mtrr_range_count].base = base & ~(PAGE_SIZE - 1) & ~(size - 1);
+        mtrr_ranges[mtrr_range_count].size = size;
+        mtrr_ranges[mtrr_range_count].type = MTRR_TYPE(base);
+        mtrr_range_count++;
     }
 }
 
+/*
+ * True if every byte of physaddr through physaddr + size gets the same memory type from the MTRRs. That is the case when no
+ * variable range starts or ends somewhere inside it, and the fixed ranges (which carve the first 1MiB up into 4KiB-64KiB
+ * pieces) are not in play.
+ */
+static bool mtrr_uniform(const uint64_t physaddr, const uint64_t size) {
+    if (!mtrr_enabled) {
+        return true;
+    }
+
+    if (mtrr_fixed_enabled && physaddr < ONE_MB) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < mtrr_range_count; i++) {
+        const uint64_t start = mtrr_ranges[i].base;
+        const uint64_t end = start + mtrr_ranges[i].size;
+
+        if (physaddr < end && physaddr + size > start && (physaddr < start || physaddr + size > end)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void setup_pat() {
     uint64_t pat =
         (0ULL << 0) | (1ULL << 8) | (2ULL << 16) | (3ULL << 24) | (4ULL << 32) | (5ULL << 40) | (6ULL << 48) |
@@ -365,16 +806,17 @@ void setup_pat() {
 
 uint64_t dealloc_user_va(p4d_t* pgdir, const uint64_t address) {
     uint64_t aligned_address = ALIGN_DOWN(address, PAGE_SIZE);
-    pte_t* entry = walk_page_directory(pgdir, (void*)aligned_address, 0);
+    pte_t* entry = walk_page_directory(pgdir, (void*)aligned_address, SPLIT);
 
     if (entry == 0) {
         panic("dealloc_va");
         return 0;
     }
     if (*entry & PTE_P) {
-        ufree(((void*)PTE_ADDR(*entry)));
+        void* page = (void*)PTE_ADDR(*entry);
         *entry = 0;
-        native_flush_tlb_single(aligned_address);
+        tlb_shootdown(pgdir, aligned_address);
+        release_user_page(page);
         return 1;
     }
 
@@ -382,11 +824,7 @@ uint64_t dealloc_user_va(p4d_t* pgdir, const uint64_t address) {
 }
 
 void dealloc_user_va_range(p4d_t* pgdir, const uint64_t address, const uint64_t size) {
-    uint64_t aligned_size = ALIGN_UP(size, PAGE_SIZE);
-    serial_printf("Aligned size %x.64\n", aligned_size);
-    for (uint64_t i = 0; i <= aligned_size; i += PAGE_SIZE) {
-        dealloc_user_va(pgdir, address + i);
-    }
+    unmap_range(pgdir, address, size, UNMAP_USER);
 }
 
 #endif
@@ -12,16 +12,15 @@
 volatile uint64_t timer_ticks = 0;
 bool use_pit = true;
 /*
- * The timer interrupt for the x86 PIT timer.
- * Only the BSP will be interrupted, after which it will invoke a broadcast interrupt after incrementing the tick counter.
- * After the broadcast, every CPU will be interrupted and do a panic check and then ack the interrupt.
- * Later this will also do scheduler preemption and the like.
+ * The timer interrupt for the x86 PIT timer (or the HPET when that is in use).
+ * Only the BSP takes it, and all it does now is keep the global tick count. Scheduling ticks come from each CPU's own LAPIC
+ * timer (see lapic_timer_start) so nobody has to send IPIs every tick any more.
+ * The other CPUs still land here when panic broadcasts this vector, so the panic check stays.
  */
 
 void x86_timer_interrupt() {
     if(my_cpu()->cpu_id == 0) {
         timer_ticks++;
-        lapic_broadcast_interrupt(32 + 0 /* Broadcast IPI to all other processes so they can do their own preemption checks or panic checks */);
     }
 
     if(panicked) {
@@ -31,9 +30,7 @@ void x86_timer_interrupt() {
         }
     }
 
-    //Do preemption stuff, only count ticks on processor 0
     lapic_eoi();
-
 }
 /*
  * Get the current internal PIT ticks, you need to read the low and high byte and concat to a short and return
@@ -68,6 +65,29 @@ void pit_set_reload_value(uint16_t new_reload_value) {
  	write_port(CHANNEL0_DATA,(uint8_t)new_reload_value & 0xFF);
  	write_port(CHANNEL0_DATA,(uint8_t)new_reload_value >> 8);
 }
+/*
+ * PIT channel 2 as a one shot reference for calibrating other clocks. Channel 2 is gated from port 0x61 and its output can be
+ * read back from there, so this is just polling and does not touch channel 0 (which may already be the system clock) or need
+ * any interrupts. Start it, then poll pit_channel2_expired.
+ */
+void pit_channel2_start(const uint64_t ms) {
+    const uint16_t count = (PIT_FREQ * ms) / 1000;
+
+    write_port(PIT_GATE_PORT, (read_port(PIT_GATE_PORT) & ~PIT_GATE_SPEAKER) | PIT_GATE_CHANNEL2);
+    write_port(CMD, 0xB0); /* Channel 2, low byte then high byte, mode 0 (interrupt on terminal count) */
+    write_port(CHANNEL2_DATA, count & 0xFF);
+    write_port(CHANNEL2_DATA, count >> 8);
+
+    /* Drop the gate and raise it again to start the count */
+    const uint8_t gate = read_port(PIT_GATE_PORT) & ~PIT_GATE_CHANNEL2;
+    write_port(PIT_GATE_PORT, gate);
+    write_port(PIT_GATE_PORT, gate | PIT_GATE_CHANNEL2);
+}
+
+bool pit_channel2_expired() {
+    return read_port(PIT_GATE_PORT) & PIT_GATE_OUTPUT2;
+}
+
 /*
  * Init the PIT timer to 18HZ, and register it at IRQ 0, passing a pointer to the pit_intterupt function to be called on interrupt
  */
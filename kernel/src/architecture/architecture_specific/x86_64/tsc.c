@@ -0,0 +1,71 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef __x86_64__
+#include "include/architecture/x86_64/tsc.h"
+#include "include/architecture/x86_64/asm_functions.h"
+#include "include/architecture/x86_64/hpet.h"
+#include "include/architecture/x86_64/pit.h"
+#include "include/definitions/definitions.h"
+#include "include/drivers/serial/uart.h"
+
+struct tsc_clock tsc_clock;
+
+/*
+ * Count TSC ticks across TSC_CALIBRATE_MS of HPET time, the HPET period is in femtoseconds so everything is done in 128 bits
+ */
+static uint64_t tsc_calibrate_hpet() {
+    const uint64_t period = hpet_get_period();
+    const uint64_t wait = ((FEMTOSECONDS_PER_SECOND / 1000) * TSC_CALIBRATE_MS) / period;
+
+    const uint64_t hpet_start = hpet_get_main_counter();
+    const uint64_t tsc_start = rdtsc();
+    uint64_t hpet_end;
+
+    do {
+        asm volatile("pause");
+        hpet_end = hpet_get_main_counter();
+    } while (hpet_end - hpet_start < wait);
+
+    const uint64_t tsc_end = rdtsc();
+    return (uint64_t) (((unsigned __int128) (tsc_end - tsc_start) * FEMTOSECONDS_PER_SECOND) /
+                       ((unsigned __int128) (hpet_end - hpet_start) * period));
+}
+
+static uint64_t tsc_calibrate_pit() {
+    pit_channel2_start(TSC_CALIBRATE_MS);
+    const uint64_t tsc_start = rdtsc();
+
+    while (!pit_channel2_expired()) {
+        asm volatile("pause");
+    }
+
+    return ((rdtsc() - tsc_start) * 1000) / TSC_CALIBRATE_MS;
+}
+
+/*
+ * Run once on the BSP after the ACPI tables have been parsed (that is where the HPET is found)
+ */
+void tsc_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+    tsc_clock.invariant = edx & CPUID_INVARIANT_TSC;
+
+    const bool hpet_present = hpet_enable_counter();
+    tsc_clock.hz = hpet_present ? tsc_calibrate_hpet() : tsc_calibrate_pit();
+    if (tsc_clock.hz == 0) {
+        panic("tsc_init: TSC did not move during calibration");
+        return;
+    }
+
+    tsc_clock.mult = (uint64_t) (((unsigned __int128) NANOSECONDS_PER_SECOND << TSC_SHIFT) / tsc_clock.hz);
+    tsc_clock.base = rdtsc();
+
+    serial_printf("TSC %i Hz calibrated against the %s%s\n", tsc_clock.hz, hpet_present ? "HPET" : "PIT",
+                  tsc_clock.invariant ? "" : ", not invariant so time may not agree exactly between CPUs");
+}
+
+uint64_t tsc_read_ns() {
+    return (uint64_t) (((unsigned __int128) (rdtsc() - tsc_clock.base) * tsc_clock.mult) >> TSC_SHIFT);
+}
+#endif
@@ -12,6 +12,7 @@
 #include <include/data_structures/spinlock.h>
 #include <include/drivers/display/framebuffer.h>
 #include <include/scheduling/sched.h>
+#include <include/memory/numa.h>
 
 uint64_t bootstrap_cpu_id;
 uint64_t cpu_count;
@@ -60,6 +61,7 @@ void smp_init() {
         cpu_list[smp_info[i]->lapic_id].cpu_number = smp_info[i]->processor_id;
         cpu_list[smp_info[i]->lapic_id].cpu_id = smp_info[i]->lapic_id;
         cpu_list[smp_info[i]->lapic_id].scheduler_state = kmalloc(sizeof(struct register_state));
+        cpu_list[smp_info[i]->lapic_id].numa_node = numa_node_of_cpu(smp_info[i]->lapic_id);
 #endif
         //puts rest of CPUs online, works so will leave this commented out for now since I need to create or refactor functions for this
         smp_info[i]->goto_address = arch_initialise_cpu;
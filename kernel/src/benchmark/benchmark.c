@@ -0,0 +1,22 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _BENCHMARK_
+#include "include/benchmark/benchmark.h"
+#include "include/drivers/serial/uart.h"
+
+/*
+ * Each benchmark prints its own results, this just runs them back to back
+ */
+void run_benchmarks() {
+    serial_printf("Running benchmarks...\n");
+    benchmark_kmalloc();
+    benchmark_mem();
+    benchmark_contig();
+    benchmark_context_switch();
+    benchmark_fork();
+    benchmark_timer();
+    benchmark_timer_wheel();
+    serial_printf("Benchmarks complete\n");
+}
+#endif
@@ -0,0 +1,128 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _BENCHMARK_
+#include "include/benchmark/benchmark.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/architecture/arch_cpu.h"
+#include "include/architecture/arch_tlb.h"
+#include "include/architecture/arch_vmm.h"
+#include "include/definitions/string.h"
+#include "include/drivers/serial/uart.h"
+#include "include/memory/kmalloc.h"
+#include "include/memory/vmm.h"
+#include "include/scheduling/process.h"
+
+#define SWITCH_BENCHMARK_ROUNDS 20000
+#define SWITCH_BENCHMARK_TOUCH_PAGES 64 /* Pages each side reads after every switch, so losing the TLB actually costs something */
+
+extern void context_switch(struct register_state *old, struct register_state *new, bool user_process, void *memory_map);
+
+/*
+ * Two register states that bounce back and forth on one CPU, the peer lives on its own stack and never returns
+ */
+static struct register_state switch_main;
+static struct register_state switch_peer;
+static struct cpu *switch_cpu;
+static struct virt_map *switch_main_map;
+static struct virt_map *switch_peer_map;
+static uint64_t switch_main_cr3;
+static bool switch_pcid;
+static volatile uint8_t *switch_touch;
+
+/*
+ * context_switch does not save r14 or r15 (r15 is where it keeps the user flag), so anything the compiler had in them has
+ * to be saved around the call
+ */
+static __attribute__((noinline)) void switch_benchmark_switch(struct register_state *old, struct register_state *new,
+                                                              const uint64_t cr3) {
+    context_switch(old, new, false, (void *) cr3);
+    asm volatile("" ::: "r14", "r15", "memory");
+}
+
+static void switch_benchmark_touch() {
+    for (uint64_t i = 0; i < SWITCH_BENCHMARK_TOUCH_PAGES; i++) {
+        (void) switch_touch[i * PAGE_SIZE];
+    }
+}
+
+static void switch_benchmark_peer() {
+    for (;;) {
+        switch_benchmark_touch();
+        switch_benchmark_switch(&switch_peer, &switch_main,
+                                switch_pcid ? tlb_switch_page_map(switch_cpu, switch_main_map) : switch_main_cr3);
+    }
+}
+
+/*
+ * Time SWITCH_BENCHMARK_ROUNDS round trips to the peer and back. to_peer / to_main are what goes in cr3 each way when PCIDs
+ * are not being used (0 to leave it alone), with pcid set tlb_switch_page_map decides like the scheduler does.
+ */
+static void switch_benchmark_run(const char *name, uint64_t *stack, const uint64_t to_peer, const uint64_t to_main,
+                                 const bool pcid) {
+    const struct tlb_pcid_cache *cache = &tlb_pcid_caches[switch_cpu->cpu_id];
+    const uint64_t hits = cache->hits;
+    const uint64_t misses = cache->misses;
+
+    memset(&switch_peer, 0, sizeof(struct register_state));
+    switch_peer.rsp = (uint64_t) stack + DEFAULT_STACK_SIZE - sizeof(uint64_t);
+    switch_peer.rip = (uint64_t) switch_benchmark_peer;
+    switch_main_cr3 = to_main;
+    switch_pcid = pcid;
+
+    const uint64_t start = read_cycle_counter();
+    for (uint64_t round = 0; round < SWITCH_BENCHMARK_ROUNDS; round++) {
+        switch_benchmark_switch(&switch_main, &switch_peer,
+                                pcid ? tlb_switch_page_map(switch_cpu, switch_peer_map) : to_peer);
+        switch_benchmark_touch();
+    }
+    const uint64_t cycles = read_cycle_counter() - start;
+
+    serial_printf("context switch benchmark: %s %i cycles per round trip, pcid hits %i misses %i\n", name,
+                  cycles / SWITCH_BENCHMARK_ROUNDS, cache->hits - hits, cache->misses - misses);
+}
+
+/*
+ * Round trips between two register states on this CPU, first within the kernel address space (the way every switch between
+ * the scheduler and a kernel thread went, reloading cr3 each time, against leaving it alone) and then between the kernel and a
+ * second address space built the way a process's is (flushing every time against keeping the TLB with PCIDs).
+ */
+void benchmark_context_switch() {
+    uint64_t *stack = kzmalloc(DEFAULT_STACK_SIZE);
+    struct virt_map peer_map = {.top_level = alloc_virtual_map(), .vm_regions = NULL};
+    const uint64_t kernel_top_level = (uint64_t) kernel_pg_map->top_level;
+    const uint64_t interrupts = are_interrupts_enabled();
+
+    map_kernel_address_space(peer_map.top_level);
+    switch_touch = kmalloc(SWITCH_BENCHMARK_TOUCH_PAGES * PAGE_SIZE);
+    switch_main_map = kernel_pg_map;
+    switch_peer_map = &peer_map;
+
+    disable_interrupts();
+    switch_cpu = my_cpu();
+    tlb_switch_page_map(switch_cpu, kernel_pg_map);
+
+    switch_benchmark_run("same address space, cr3 reloaded", stack, kernel_top_level, kernel_top_level, false);
+    switch_benchmark_run("same address space, cr3 left alone", stack, 0, 0, false);
+    switch_benchmark_run("two address spaces, flushed", stack, (uint64_t) peer_map.top_level, kernel_top_level, false);
+
+    if (tlb_pcid_enabled) {
+        switch_benchmark_run("two address spaces, pcid", stack, 0, 0, true);
+    } else {
+        serial_printf("context switch benchmark: no PCID on this CPU, skipping the PCID run\n");
+    }
+
+    /* The plain runs loaded the kernel top level behind tlb_switch_page_map's back, make sure we are on it properly */
+    switch_page_table(kernel_pg_map->top_level);
+    tlb_switch_page_map(switch_cpu, kernel_pg_map);
+
+    if (interrupts) {
+        enable_interrupts();
+    }
+
+    arch_dealloc_page_table(peer_map.top_level);
+    free_virtual_map(peer_map.top_level);
+    kfree((void *) switch_touch);
+    kfree(stack);
+}
+#endif
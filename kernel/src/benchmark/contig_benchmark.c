@@ -0,0 +1,150 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _BENCHMARK_
+#include "include/benchmark/benchmark.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/drivers/serial/uart.h"
+#include "include/memory/kmalloc.h"
+#include "include/memory/numa.h"
+#include "include/memory/pmm.h"
+
+#define CONTIG_BENCHMARK_ROUNDS 4000
+#define CONTIG_BENCHMARK_SLOTS 32
+#define CONTIG_BENCHMARK_MAGIC 0xC0A71CC0FFEE1234UL
+
+/*
+ * Huge sizes are all over a MAX_ORDER block (4MiB) and mostly not a multiple of one so the tail trimming gets exercised,
+ * small sizes stay above a single page so they skip the per-CPU caches and land in the buddy allocator like the huge ones do.
+ */
+static const uint64_t huge_sizes[] = {1025, 1536, 2048, 2071, 3000, 4096};
+static const uint64_t small_sizes[] = {2, 3, 8, 17, 64, 255};
+
+struct contig_allocation {
+    uint64_t *address;
+    uint64_t pages;
+};
+
+static uint64_t contig_seed = 0x2545F4914F6CDD1DUL;
+
+static uint64_t contig_random() {
+    contig_seed = contig_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return contig_seed >> 33;
+}
+
+/*
+ * Stamp the first and last page of an allocation with where it lives so that two allocations ever overlapping shows up
+ * when the first of them is freed
+ */
+static void contig_stamp(const struct contig_allocation *allocation) {
+    allocation->address[0] = CONTIG_BENCHMARK_MAGIC ^ (uint64_t) allocation->address;
+    allocation->address[((allocation->pages - 1) * PAGE_SIZE) / sizeof(uint64_t)] = CONTIG_BENCHMARK_MAGIC ^ allocation->pages;
+}
+
+static bool contig_check(const struct contig_allocation *allocation) {
+    return allocation->address[0] == (CONTIG_BENCHMARK_MAGIC ^ (uint64_t) allocation->address) &&
+           allocation->address[((allocation->pages - 1) * PAGE_SIZE) / sizeof(uint64_t)] == (
+               CONTIG_BENCHMARK_MAGIC ^ allocation->pages);
+}
+
+/*
+ * Stress the contiguous allocator with a random mix of huge and small allocations and frees. At most a quarter of the free kernel
+ * pool is held at once so this can run on small VMs without starving everything else.
+ *
+ * The worst case is what matters for the range path so the slowest huge allocation is reported along with the average, and the
+ * longest bitmap scan any pool has done is printed so it can be compared against the bound described in buddy_alloc_range.
+ * Allocated pages are compared before and after, if nothing else was allocating while this ran they should match exactly.
+ */
+void benchmark_contig() {
+    struct contig_allocation live[CONTIG_BENCHMARK_SLOTS] = {};
+    uint64_t budget = 0;
+    uint64_t live_pages = 0;
+    uint64_t huge_count = 0;
+    uint64_t huge_cycles = 0;
+    uint64_t huge_worst = 0;
+    uint64_t small_count = 0;
+    uint64_t small_cycles = 0;
+    uint64_t free_count = 0;
+    uint64_t free_cycles = 0;
+    uint64_t failures = 0;
+    uint64_t corrupted = 0;
+
+    for (uint64_t node = 0; node < numa_node_count; node++) {
+        budget += numa_nodes[node].pools[KERNEL_POOL].free_pages;
+    }
+    budget /= 4;
+
+    const uint64_t allocated_before = total_allocated;
+
+    for (uint64_t round = 0; round < CONTIG_BENCHMARK_ROUNDS; round++) {
+        struct contig_allocation *slot = &live[contig_random() % CONTIG_BENCHMARK_SLOTS];
+
+        if (slot->address != NULL) {
+            if (!contig_check(slot)) {
+                corrupted++;
+            }
+            const uint64_t start = read_cycle_counter();
+            phys_dealloc(Virt2Phys(slot->address));
+            free_cycles += read_cycle_counter() - start;
+            free_count++;
+            live_pages -= slot->pages;
+            slot->address = NULL;
+            continue;
+        }
+
+        const bool huge = contig_random() % 4 == 0;
+        const uint64_t pages = huge
+                                   ? huge_sizes[contig_random() % (sizeof(huge_sizes) / sizeof(huge_sizes[0]))]
+                                   : small_sizes[contig_random() % (sizeof(small_sizes) / sizeof(small_sizes[0]))];
+
+        if (live_pages + pages > budget) {
+            continue;
+        }
+
+        const uint64_t start = read_cycle_counter();
+        void *address = phys_alloc_contiguous(pages, KERNEL_POOL);
+        const uint64_t cycles = read_cycle_counter() - start;
+
+        if (address == NULL) {
+            failures++;
+            continue;
+        }
+
+        if (huge) {
+            huge_count++;
+            huge_cycles += cycles;
+            huge_worst = cycles > huge_worst ? cycles : huge_worst;
+        } else {
+            small_count++;
+            small_cycles += cycles;
+        }
+
+        slot->address = Phys2Virt(address);
+        slot->pages = pages;
+        live_pages += pages;
+        contig_stamp(slot);
+    }
+
+    for (uint64_t i = 0; i < CONTIG_BENCHMARK_SLOTS; i++) {
+        if (live[i].address == NULL) {
+            continue;
+        }
+        if (!contig_check(&live[i])) {
+            corrupted++;
+        }
+        phys_dealloc(Virt2Phys(live[i].address));
+    }
+
+    serial_printf("contig benchmark: %i huge allocations avg %i worst %i cycles, %i small avg %i cycles, %i frees avg %i cycles\n",
+                  huge_count, huge_count ? huge_cycles / huge_count : 0, huge_worst, small_count,
+                  small_count ? small_cycles / small_count : 0, free_count, free_count ? free_cycles / free_count : 0);
+    serial_printf("contig benchmark: %i failed allocations %i corrupted, allocated pages before %i after %i\n", failures,
+                  corrupted, allocated_before, total_allocated);
+
+    for (uint64_t node = 0; node < numa_node_count; node++) {
+        serial_printf("contig benchmark: node %i longest range scan kernel %i words user %i words\n", node,
+                      numa_nodes[node].pools[KERNEL_POOL].range_scan_max_words,
+                      numa_nodes[node].pools[USER_POOL].range_scan_max_words);
+    }
+}
+#endif
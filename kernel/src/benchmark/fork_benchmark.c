@@ -0,0 +1,90 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _BENCHMARK_
+#include "include/benchmark/benchmark.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/architecture/arch_cpu.h"
+#include "include/architecture/arch_tlb.h"
+#include "include/architecture/arch_vmm.h"
+#include "include/data_structures/doubly_linked_list.h"
+#include "include/drivers/serial/uart.h"
+#include "include/memory/kmalloc.h"
+#include "include/memory/vmm.h"
+
+#define FORK_BENCHMARK_HEAP_BASE 0x10000000UL
+#define FORK_BENCHMARK_WRITES 64 /* Pages written after each fork, each one is a copy on write fault */
+
+static const uint64_t fork_benchmark_heap_pages[] = {256, 2048, 8192}; /* 1MiB, 8MiB and 32MiB heaps */
+
+static void fork_benchmark_map_init(struct virt_map *map) {
+    map->top_level = alloc_virtual_map();
+    map->vm_regions = kzmalloc(sizeof(struct doubly_linked_list));
+    doubly_linked_list_init(map->vm_regions);
+    map_kernel_address_space(map->top_level);
+}
+
+static void fork_benchmark_map_free(struct virt_map *map) {
+    arch_dealloc_page_table(map->top_level);
+    free_virtual_map(map->top_level);
+    doubly_linked_list_destroy(map->vm_regions, true);
+    kfree(map->vm_regions);
+}
+
+/*
+ * Build a parent with a heap of heap_pages pages, fork its address space into a child and then write to a few of the child's
+ * pages the way a process would right after fork. The fork itself copies nothing so it should stay cheap no matter how big the
+ * heap is, the writes show what each page costs once it actually has to be copied (which is what an eager fork would pay for
+ * every page up front).
+ */
+static void fork_benchmark_run(const uint64_t heap_pages) {
+    struct virt_map parent;
+    struct virt_map child;
+    const uint64_t perms = READWRITE | NO_EXECUTE | USER;
+
+    fork_benchmark_map_init(&parent);
+    fork_benchmark_map_init(&child);
+    doubly_linked_list_insert_tail(parent.vm_regions, create_region(FORK_BENCHMARK_HEAP_BASE, heap_pages, HEAP, perms, false));
+
+    for (uint64_t i = 0; i < heap_pages; i++) {
+        map_single_page(parent.top_level, (uint64_t) umalloc(1), (uint64_t *) (FORK_BENCHMARK_HEAP_BASE + (i * PAGE_SIZE)),
+                        perms);
+    }
+
+    const uint64_t start = read_cycle_counter();
+    copy_address_space(&parent, &child);
+    const uint64_t fork_cycles = read_cycle_counter() - start;
+
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+    struct cpu *cpu = my_cpu();
+    tlb_switch_page_map(cpu, &child);
+    switch_page_table(child.top_level);
+
+    const uint64_t write_start = read_cycle_counter();
+    for (uint64_t i = 0; i < FORK_BENCHMARK_WRITES && i < heap_pages; i++) {
+        const uint64_t address = FORK_BENCHMARK_HEAP_BASE + (i * (heap_pages / FORK_BENCHMARK_WRITES) * PAGE_SIZE);
+        handle_cow_fault(&child, address);
+        *(volatile uint64_t *) address = i;
+    }
+    const uint64_t write_cycles = (read_cycle_counter() - write_start) / FORK_BENCHMARK_WRITES;
+
+    tlb_switch_page_map(cpu, kernel_pg_map);
+    switch_page_table(kernel_pg_map->top_level);
+    if (interrupts) {
+        enable_interrupts();
+    }
+
+    serial_printf("fork benchmark: %i page heap, fork %i cycles (%i per page), first write %i cycles per page, eager copy would be ~%i cycles\n",
+                  heap_pages, fork_cycles, fork_cycles / heap_pages, write_cycles, write_cycles * heap_pages);
+
+    fork_benchmark_map_free(&child);
+    fork_benchmark_map_free(&parent);
+}
+
+void benchmark_fork() {
+    for (uint64_t i = 0; i < sizeof(fork_benchmark_heap_pages) / sizeof(fork_benchmark_heap_pages[0]); i++) {
+        fork_benchmark_run(fork_benchmark_heap_pages[i]);
+    }
+}
+#endif
@@ -0,0 +1,73 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _BENCHMARK_
+#include "include/benchmark/benchmark.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/drivers/serial/uart.h"
+#include "include/memory/kmalloc.h"
+#include "include/memory/slab.h"
+
+#define KMALLOC_BENCHMARK_BATCH 64
+
+/*
+ * This is the size class lookup the way it used to be done, a walk over the caches until one is big enough. It is kept here
+ * so we have something to measure heap_slab_for against.
+ */
+static struct slab_cache *linear_slab_for(uint64_t size) {
+    for (uint64_t i = 0; i < NUM_SLABS; i++) {
+        struct slab_cache *cache = &slab_caches[i];
+
+        if (cache->entry_size >= size) {
+            return cache;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Time both lookups over every size a slab can serve, then hammer kmalloc/kfree for each size class. The alloc/free pairs are
+ * done in batches so that the magazines actually have to go back to the shared caches every so often rather than
+ * just bouncing one object in and out.
+ */
+void benchmark_kmalloc() {
+    volatile struct slab_cache *sink;
+    void *objects[KMALLOC_BENCHMARK_BATCH];
+    const uint64_t lookups = (BENCHMARK_ITERATIONS / SLAB_MAX_SIZE + 1) * SLAB_MAX_SIZE;
+
+    uint64_t start = read_cycle_counter();
+    for (uint64_t i = 0; i < lookups; i++) {
+        sink = linear_slab_for((i % SLAB_MAX_SIZE) + 1);
+    }
+    const uint64_t linear_cycles = read_cycle_counter() - start;
+
+    start = read_cycle_counter();
+    for (uint64_t i = 0; i < lookups; i++) {
+        sink = heap_slab_for((i % SLAB_MAX_SIZE) + 1);
+    }
+    const uint64_t direct_cycles = read_cycle_counter() - start;
+    (void) sink;
+
+    serial_printf("kmalloc benchmark: size class lookup linear %i cycles/call direct %i cycles/call\n",
+                  linear_cycles / lookups, direct_cycles / lookups);
+
+    for (uint64_t size = 1 << SLAB_MIN_SHIFT; size <= SLAB_MAX_SIZE; size <<= 1) {
+        uint64_t cycles = 0;
+
+        for (uint64_t i = 0; i < BENCHMARK_ITERATIONS / KMALLOC_BENCHMARK_BATCH; i++) {
+            start = read_cycle_counter();
+            for (uint64_t j = 0; j < KMALLOC_BENCHMARK_BATCH; j++) {
+                objects[j] = kmalloc(size);
+            }
+            for (uint64_t j = 0; j < KMALLOC_BENCHMARK_BATCH; j++) {
+                kfree(objects[j]);
+            }
+            cycles += read_cycle_counter() - start;
+        }
+
+        serial_printf("kmalloc benchmark: size %i kmalloc+kfree %i cycles/pair\n", size,
+                      cycles / ((BENCHMARK_ITERATIONS / KMALLOC_BENCHMARK_BATCH) * KMALLOC_BENCHMARK_BATCH));
+    }
+}
+#endif
@@ -0,0 +1,131 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _BENCHMARK_
+#include "include/benchmark/benchmark.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/drivers/serial/uart.h"
+#include "include/memory/kmalloc.h"
+#include "include/memory/mem.h"
+#include "include/memory/pmm.h"
+
+#define MEM_BENCHMARK_BUFFER_SIZE (64 * 1024)
+#define MEM_BENCHMARK_PAGES (MEM_BENCHMARK_BUFFER_SIZE / PAGE_SIZE)
+#define MEM_BENCHMARK_BYTES_PER_SIZE (16 * 1024 * 1024) /* Roughly how much gets moved for each size so the big ones don't take forever */
+
+/*
+ * This is memcpy/memset the way they used to be in boot/main.c, kept here so there is something to compare against
+ */
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void *memcpy_bytes(void *dest, const void *src, size_t count) {
+    uint8_t *pdest = dest;
+    const uint8_t *psrc = src;
+
+    for (size_t i = 0; i < count; i++) {
+        pdest[i] = psrc[i];
+    }
+
+    return dest;
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void *memset_bytes(void *dest, int ch, size_t count) {
+    uint8_t *pdest = dest;
+
+    for (size_t i = 0; i < count; i++) {
+        pdest[i] = (uint8_t) ch;
+    }
+
+    return dest;
+}
+
+static void *memcpy_rep(void *dest, const void *src, size_t count) {
+#ifdef __x86_64__
+    rep_movsb(dest, src, count);
+    return dest;
+#else
+    return _memcpy_words(dest, src, count);
+#endif
+}
+
+static void *memset_rep(void *dest, int ch, size_t count) {
+#ifdef __x86_64__
+    rep_stosb(dest, (uint8_t) ch, count);
+    return dest;
+#else
+    return _memset_words(dest, ch, count);
+#endif
+}
+
+static uint64_t time_copy(void *(*copy)(void *, const void *, size_t), void *dest, const void *src, size_t size,
+                          uint64_t rounds) {
+    const uint64_t start = read_cycle_counter();
+    for (uint64_t i = 0; i < rounds; i++) {
+        copy(dest, src, size);
+    }
+    return (read_cycle_counter() - start) / rounds;
+}
+
+static uint64_t time_set(void *(*set)(void *, int, size_t), void *dest, size_t size, uint64_t rounds) {
+    const uint64_t start = read_cycle_counter();
+    for (uint64_t i = 0; i < rounds; i++) {
+        set(dest, (int) i, size);
+    }
+    return (read_cycle_counter() - start) / rounds;
+}
+
+/*
+ * Run every variant over sizes from 16 bytes up to 64KiB and then compare memset against the non-temporal clear for whole pages.
+ * The copies are done with the source one byte off of alignment as well since that is the case the word loops have to work around.
+ * Whatever memcpy/memset picked at boot is printed alongside so it is easy to see if the cutoff in mem.c is in the right place.
+ */
+void benchmark_mem() {
+    uint8_t *src = kmalloc(MEM_BENCHMARK_BUFFER_SIZE + 8);
+    uint8_t *dest = kmalloc(MEM_BENCHMARK_BUFFER_SIZE + 8);
+
+    serial_printf("mem benchmark: ERMS %s, memcpy/memset switch to rep strings at %i bytes\n",
+                  mem_erms ? "present" : "not present", mem_erms ? mem_rep_threshold : 0);
+
+    for (size_t size = 16; size <= MEM_BENCHMARK_BUFFER_SIZE; size <<= 2) {
+        const uint64_t rounds = MEM_BENCHMARK_BYTES_PER_SIZE / size;
+
+        serial_printf("mem benchmark: memcpy %i bytes bytes %i words %i rep %i memcpy %i unaligned words %i rep %i cycles\n",
+                      size,
+                      time_copy(memcpy_bytes, dest, src, size, rounds),
+                      time_copy(_memcpy_words, dest, src, size, rounds),
+                      time_copy(memcpy_rep, dest, src, size, rounds),
+                      time_copy(memcpy, dest, src, size, rounds),
+                      time_copy(_memcpy_words, dest, src + 1, size, rounds),
+                      time_copy(memcpy_rep, dest, src + 1, size, rounds));
+
+        serial_printf("mem benchmark: memset %i bytes bytes %i words %i rep %i memset %i cycles\n",
+                      size,
+                      time_set(memset_bytes, dest, size, rounds),
+                      time_set(_memset_words, dest, size, rounds),
+                      time_set(memset_rep, dest, size, rounds),
+                      time_set(memset, dest, size, rounds));
+    }
+
+    kfree(src);
+    kfree(dest);
+
+    void *pages = Phys2Virt(phys_alloc(MEM_BENCHMARK_PAGES, KERNEL_POOL));
+    const uint64_t rounds = MEM_BENCHMARK_BYTES_PER_SIZE / MEM_BENCHMARK_BUFFER_SIZE;
+
+    uint64_t start = read_cycle_counter();
+    for (uint64_t i = 0; i < rounds; i++) {
+        memset(pages, 0, MEM_BENCHMARK_BUFFER_SIZE);
+    }
+    const uint64_t memset_cycles = (read_cycle_counter() - start) / (rounds * MEM_BENCHMARK_PAGES);
+
+    start = read_cycle_counter();
+    for (uint64_t i = 0; i < rounds; i++) {
+        clear_pages_nt(pages, MEM_BENCHMARK_PAGES);
+    }
+    const uint64_t nt_cycles = (read_cycle_counter() - start) / (rounds * MEM_BENCHMARK_PAGES);
+
+    serial_printf("mem benchmark: page clear memset %i cycles/page non-temporal %i cycles/page\n", memset_cycles,
+                  nt_cycles);
+    phys_dealloc(Virt2Phys(pages));
+}
+#endif
@@ -0,0 +1,53 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _BENCHMARK_
+#include "include/benchmark/benchmark.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/architecture/arch_cpu.h"
+#include "include/architecture/arch_local_interrupt_controller.h"
+#include "include/architecture/arch_smp.h"
+#include "include/architecture/arch_timer.h"
+#include "include/architecture/x86_64/pit.h"
+#include "include/drivers/serial/uart.h"
+
+#define TIMER_BENCHMARK_MS 200 /* How long the tick rate is measured for */
+#define TIMER_BENCHMARK_BROADCASTS 1000
+#define TIMER_BENCHMARK_CPUS 32 /* What the old broadcast scheme is extrapolated to */
+
+/*
+ * Compare scheduling ticks from each CPU's own LAPIC timer against the old scheme of the BSP taking the PIT interrupt and
+ * broadcasting an IPI to every other CPU on every tick.
+ *
+ * The tick rate this CPU actually gets from its LAPIC timer is measured against the PIT clock, then a batch of broadcasts of
+ * the PIT vector (which the other CPUs just acknowledge) is timed to get what each IPI costs the sender. From that we work out
+ * what the BSP would spend every second just sending ticks at TIMER_BENCHMARK_CPUS CPUs. With per-CPU timers that is 0, every
+ * CPU still takes the same number of timer interrupts but nobody sends any.
+ */
+void benchmark_timer() {
+    struct cpu *cpu = my_cpu();
+    const uint64_t interrupts = lapic_timer_interrupts[cpu->cpu_id];
+    const uint64_t ticks = timer_ticks;
+
+    timer_sleep(TIMER_BENCHMARK_MS);
+
+    const uint64_t elapsed = timer_ticks - ticks;
+    const uint64_t taken = lapic_timer_interrupts[cpu->cpu_id] - interrupts;
+    serial_printf("timer benchmark: LAPIC timer on CPU %i took %i interrupts in %i ms (%i per second, %i LAPIC ticks per ms)\n",
+                  cpu->cpu_id, taken, elapsed, elapsed ? (taken * 1000) / elapsed : 0, apic_ticks);
+
+    if (cpu_count < 2) {
+        serial_printf("timer benchmark: only one CPU, nothing to broadcast to\n");
+        return;
+    }
+
+    const uint64_t start = read_cycle_counter();
+    for (uint64_t i = 0; i < TIMER_BENCHMARK_BROADCASTS; i++) {
+        lapic_broadcast_interrupt(32);
+    }
+    const uint64_t per_ipi = (read_cycle_counter() - start) / (TIMER_BENCHMARK_BROADCASTS * (cpu_count - 1));
+
+    serial_printf("timer benchmark: PIT broadcast costs the sender %i cycles per IPI, at %i CPUs that is %i IPIs and %i cycles per second on the BSP, per-CPU LAPIC timers send none\n",
+                  per_ipi, TIMER_BENCHMARK_CPUS, (TIMER_BENCHMARK_CPUS - 1) * 1000, per_ipi * (TIMER_BENCHMARK_CPUS - 1) * 1000);
+}
+#endif
@@ -0,0 +1,87 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _BENCHMARK_
+#include "include/benchmark/benchmark.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/drivers/serial/uart.h"
+#include "include/memory/kmalloc.h"
+#include "include/scheduling/timer_wheel.h"
+
+#define TIMER_WHEEL_BENCHMARK_SPAN_MS 60000 /* Events are spread over the next minute */
+#define TIMER_WHEEL_BENCHMARK_TICKS 10000 /* How many ms of that we tick through one at a time */
+#define TIMER_WHEEL_BENCHMARK_CANCEL_EVERY 4 /* Every 4th event is cancelled before we start ticking */
+
+static const uint64_t timer_wheel_benchmark_events[] = {1000, 100000};
+
+static uint64_t timer_wheel_benchmark_fired;
+
+static void timer_wheel_benchmark_callback(void *data) {
+    (void) data;
+    timer_wheel_benchmark_fired++;
+}
+
+/*
+ * Arm events at pseudo random times over the next minute on a private wheel (so nothing real gets in the way), cancel some and
+ * then tick through the first TIMER_WHEEL_BENCHMARK_TICKS ms one at a time the way the LAPIC timer would.
+ *
+ * Arm and cancel should cost the same per event whatever the count. For the ticks the worst one is reported along with how
+ * many fired on it since that is all it should depend on, and separately the worst tick that had nothing due, which should
+ * not move at all between 1000 and 100000 events.
+ */
+static void timer_wheel_benchmark_run(const uint64_t count) {
+    struct timer_wheel *wheel = kzmalloc(sizeof(struct timer_wheel));
+    struct timer_event *events = kzmalloc(count * sizeof(struct timer_event));
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+
+    timer_wheel_init(wheel, 0);
+    timer_wheel_benchmark_fired = 0;
+
+    uint64_t start = read_cycle_counter();
+    for (uint64_t i = 0; i < count; i++) {
+        seed = (seed * 6364136223846793005ULL) + 1442695040888963407ULL;
+        timer_event_init(&events[i], timer_wheel_benchmark_callback, NULL);
+        timer_wheel_insert(wheel, &events[i], 1 + ((seed >> 33) % TIMER_WHEEL_BENCHMARK_SPAN_MS));
+    }
+    const uint64_t arm_cycles = (read_cycle_counter() - start) / count;
+
+    start = read_cycle_counter();
+    for (uint64_t i = 0; i < count; i += TIMER_WHEEL_BENCHMARK_CANCEL_EVERY) {
+        timer_event_cancel(&events[i]);
+    }
+    const uint64_t cancel_cycles = (read_cycle_counter() - start) / (count / TIMER_WHEEL_BENCHMARK_CANCEL_EVERY);
+
+    uint64_t total_cycles = 0;
+    uint64_t worst_cycles = 0;
+    uint64_t worst_fired = 0;
+    uint64_t worst_empty_cycles = 0;
+    for (uint64_t now = 1; now <= TIMER_WHEEL_BENCHMARK_TICKS; now++) {
+        const uint64_t fired = timer_wheel_benchmark_fired;
+        start = read_cycle_counter();
+        timer_wheel_advance(wheel, now);
+        const uint64_t cycles = read_cycle_counter() - start;
+
+        total_cycles += cycles;
+        if (cycles > worst_cycles) {
+            worst_cycles = cycles;
+            worst_fired = timer_wheel_benchmark_fired - fired;
+        }
+        if (timer_wheel_benchmark_fired == fired && cycles > worst_empty_cycles) {
+            worst_empty_cycles = cycles;
+        }
+    }
+
+    serial_printf("timer wheel benchmark: %i events, arm %i cycles, cancel %i cycles, %i fired over %i ticks, average tick %i cycles, worst tick %i cycles (%i fired), worst empty tick %i cycles, %i still pending\n",
+                  count, arm_cycles, cancel_cycles, timer_wheel_benchmark_fired, TIMER_WHEEL_BENCHMARK_TICKS,
+                  total_cycles / TIMER_WHEEL_BENCHMARK_TICKS, worst_cycles, worst_fired, worst_empty_cycles, wheel->pending);
+
+    kfree(events);
+    kfree(wheel);
+}
+
+void benchmark_timer_wheel() {
+    for (uint64_t i = 0; i < sizeof(timer_wheel_benchmark_events) / sizeof(timer_wheel_benchmark_events[0]); i++) {
+        timer_wheel_benchmark_run(timer_wheel_benchmark_events[i]);
+    }
+}
+#endif
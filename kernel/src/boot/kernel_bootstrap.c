@@ -14,6 +14,7 @@
 #include "include/memory/vmm.h"
 #include "include/memory/slab.h"
 #include "include/architecture/x86_64/acpi.h"
+#include "include/architecture/x86_64/srat.h"
 #include "include/architecture/arch_timer.h"
 #include "include/architecture/arch_local_interrupt_controller.h"
 #include "include/definitions/elf.h"
@@ -23,6 +24,15 @@
 #include "include/system_call/system_calls.h"
 #include "include/filesystem/tmpfs.h"
 #include "include/drivers/block/ramdisk.h"
+#include "include/data_structures/queue.h"
+#include "include/benchmark/benchmark.h"
+#include "include/memory/mem.h"
+#include "include/memory/zero_pool.h"
+#include "include/memory/meminfo.h"
+#include "include/memory/alloc_trace.h"
+#include "include/architecture/arch_tlb.h"
+#include "include/architecture/x86_64/tsc.h"
+#include "include/scheduling/timer_wheel.h"
 
 
 /*
@@ -64,11 +74,17 @@ void kernel_bootstrap() {
     initlock(framebuffer_device.lock, FRAME_LOCK);
     welcome_message();
     init_serial();
+    mem_init();
     arch_init_segments();
     arch_setup_interrupts();
     arch_paging_init();
+#ifdef __x86_64__
+    srat_init(); /* Before phys_init so it knows about NUMA nodes */
+#endif
     phys_init();
     heap_init();
+    queue_cache_init();
+    process_init();
     mem_bounds_init();
     arch_vmm_init();
     init_system_device_tree();
@@ -79,14 +95,21 @@ void kernel_bootstrap() {
 #ifdef __x86_64__
     lapic_init();
     acpi_init();
+    tsc_init(); /* After ACPI since that is where we find the HPET to calibrate against */
+    tlb_shootdown_init();
 #endif
 
     vfs_init();
     diosfs_init(0);
     tmpfs_mkfs(0, "/temp");
+    meminfo_init();
+#ifdef _ALLOC_TRACE_
+    alloc_trace_init();
+#endif
     bsp = false;
     // set bsp bool for acquire_spinlock so that my_cpu will be called and assigned when a processor takes a lock
     smp_init();
+    tlb_switch_page_map(my_cpu(), kernel_pg_map);
     my_cpu()->scheduler_state->rsp = (uint64_t)kzmalloc(DEFAULT_STACK_SIZE) + DEFAULT_STACK_SIZE;
     set_kernel_stack((void *)my_cpu()->scheduler_state->rsp);
     void *kernel_syscall_stack = kzmalloc(DEFAULT_STACK_SIZE) + DEFAULT_STACK_SIZE;
@@ -94,14 +117,23 @@ void kernel_bootstrap() {
     gs_stacks->kernel_syscall_stack = kernel_syscall_stack;
     wrmsr(KERNEL_GS_BASE,(uint64_t) gs_stacks);
     timer_init(1000);
+    timer_wheels_init();
+    framebuffer_cursor_init();
+#ifdef __x86_64__
+    lapic_timer_start(); /* The PIT above is only the clock now, each CPU's scheduling tick is its own LAPIC timer */
+#endif
     dev_fs_init();
     info_printf("Total MB Allocated %i out of %i\n", (total_allocated * (PAGE_SIZE / 1024)) / 1024,
                 (usable_pages * (PAGE_SIZE / 1024)) / 1024);
     register_syscall_dispatch();
     kprintf("System Call Dispatcher Set\n");
     kprintf_color(CYAN, "Kernel Boot Complete\n");
+#ifdef _BENCHMARK_
+    run_benchmarks();
+#endif
     DEBUG_PRINT("kernel_bootstrap: Kernel page map %x.64\n",kernel_pg_map->top_level);
     kthread_init();
+    zero_pool_init();
     ready = 1;
     setup_init();
 }
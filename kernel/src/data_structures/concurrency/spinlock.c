@@ -9,6 +9,32 @@
 
 bool bsp = true;
 
+/*
+ * Interrupts are turned off for as long as this CPU holds any spinlock, and are only turned back on when the outermost
+ * lock is released, and only if they were on before the first one was taken. Without this, releasing an inner lock
+ * would turn interrupts back on while an outer lock is still held.
+ */
+static void push_interrupts_off() {
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+    struct cpu *cpu = my_cpu();
+    if (cpu->lock_depth == 0) {
+        cpu->interrupts_before_lock = interrupts;
+    }
+    cpu->lock_depth++;
+}
+
+static void pop_interrupts_off() {
+    struct cpu *cpu = my_cpu();
+    if (cpu->lock_depth == 0) {
+        panic("pop_interrupts_off: not holding any locks");
+    }
+    cpu->lock_depth--;
+    if (cpu->lock_depth == 0 && cpu->interrupts_before_lock) {
+        enable_interrupts();
+    }
+}
+
 void initlock(struct spinlock *spinlock, uint64_t id) {
     if ((uint64_t )spinlock ==  0xFFFF8001C8C00018 || (uint64_t )spinlock ==  0xFFFF8001C8C60E80 ) {
         err_printf("INIT ~ LOCK ADDR %x.64 HOLDING PROC %x.64 CPU %x.64 RECURSION DEPTH %i ID %i LOCKED %i\n",spinlock,spinlock->holding_process,spinlock->cpu,spinlock->recursion_depth,spinlock->id,spinlock->locked);
@@ -18,6 +44,8 @@ void initlock(struct spinlock *spinlock, uint64_t id) {
     spinlock->locked = 0;
     spinlock->cpu = 0;
     spinlock->recursion_depth = 0;
+    spinlock->acquisitions = 0;
+    spinlock->contention_count = 0;
 }
 //TODO check int flag instead of just turning them back on
 void acquire_spinlock(struct spinlock *spinlock) {
@@ -40,7 +68,14 @@ void acquire_spinlock(struct spinlock *spinlock) {
         return;
     }
 
-    disable_interrupts();
+    push_interrupts_off();
+    /*
+     * Count contention before spinning so that we can see which locks are hot under multi-CPU load, it is atomically
+     * incremented since by definition someone else is in here with us
+     */
+    if (spinlock->locked) {
+        __sync_fetch_and_add(&spinlock->contention_count, 1);
+    }
     bool ret = arch_atomic_swap(&spinlock->locked, 1);
     if (!ret) {
 
@@ -54,35 +89,60 @@ void acquire_spinlock(struct spinlock *spinlock) {
     }
     spinlock->cpu = my_cpu();
     spinlock->holding_process = current_process();
-
+    spinlock->acquisitions++;
 }
 
 void release_spinlock(struct spinlock *spinlock) {
     if ((uint64_t )spinlock ==  0xFFFF8001C8C00018 || (uint64_t )spinlock ==  0xFFFF8001C8C60E80 ) {
         serial_printf("BAD SPINLOCK RELEASED\n");
     }
+    if (bsp == true) {
+        /* Nothing was taken during bootstrap (other than by try_lock), see acquire_spinlock */
+        spinlock->locked = 0;
+        enable_interrupts();
+        return;
+    }
+
+    /* A recursive acquire only bumped the depth so only the outermost release actually unlocks */
     if (spinlock->recursion_depth > 0) {
         spinlock->recursion_depth--;
+        return;
     }
 
-    if (spinlock->recursion_depth == 0) {
-        spinlock->cpu = NULL;
-        spinlock->holding_process = NULL;
-        spinlock->locked = 0;
-        spinlock->recursion_depth = 0;
-        enable_interrupts();
-    }
+    spinlock->cpu = NULL;
+    spinlock->holding_process = NULL;
+    spinlock->locked = 0;
+    pop_interrupts_off();
 }
 
+/*
+ * Same as acquire_spinlock but gives up instead of spinning. A lock we already hold counts as taken the same way it does for
+ * acquire_spinlock, otherwise a try_lock on it would always fail and the matching release would drop the outer hold.
+ *
+ * Interrupts go off before the swap, not after, an interrupt handler landing in between that wants the same lock would spin
+ * on us forever.
+ */
 bool try_lock(struct spinlock *spinlock) {
+    if (bsp == true) {
+        if(!arch_atomic_swap_or_return(&spinlock->locked,1)){
+            return false;
+        }
+        disable_interrupts();
+        return true;
+    }
 
+    if(spinlock->cpu == my_cpu() && spinlock->holding_process == current_process()){
+        spinlock->recursion_depth++;
+        return true;
+    }
+
+    push_interrupts_off();
     if(!arch_atomic_swap_or_return(&spinlock->locked,1)){
+        pop_interrupts_off();
         return false;
     }
-    disable_interrupts();
-    if(spinlock->cpu == my_cpu()){
-        spinlock->recursion_depth++;
-    }
     spinlock->cpu = my_cpu();
+    spinlock->holding_process = current_process();
+    spinlock->acquisitions++;
     return true;
 }
@@ -8,6 +8,9 @@
 #include <include/memory/kmalloc.h>
 #include <include/definitions/types.h>
 #include <include/architecture/arch_cpu.h>
+#include <include/memory/slab.h>
+
+struct slab_cache *queue_node_cache;
 
 
 /*
@@ -42,6 +45,14 @@ static void enqueue_fifo(struct queue *queue_head, struct queue_node *new_node);
 
 static void enqueue_lifo(struct queue *queue_head, struct queue_node *new_node);
 
+/*
+ * Queue nodes are allocated and freed on every enqueue and dequeue so they get their own cache, this needs to run once
+ * after the heap is up and before anything is enqueued
+ */
+void queue_cache_init() {
+    queue_node_cache = slab_cache_create("queue_node", sizeof(struct queue_node), sizeof(void *), NULL);
+}
+
 /*
  * Init a queue
  */
@@ -81,7 +92,7 @@ void enqueue(struct queue *queue_head, void *data_to_enqueue, const uint8_t prio
         panic("Null head");
     }
 
-    struct queue_node *new_node = kmalloc(sizeof(struct queue_node));
+    struct queue_node *new_node = slab_cache_alloc(queue_node_cache);
     queue_node_init(new_node, data_to_enqueue, priority);
 
 
@@ -158,7 +169,7 @@ static void enqueue_fifo(struct queue *queue_head, struct queue_node *new_node)
 
     if (new_node->data == NULL) {
         panic("Null data enqueue fifo");
-        kfree(new_node);
+        slab_cache_free(queue_node_cache, new_node);
         return;
     }
 
@@ -304,7 +315,7 @@ static void dequeue_fifo(struct queue *queue_head) {
 
     if (queue_head->head == NULL) {
         queue_head->node_count--;
-        kfree(pointer);
+        slab_cache_free(queue_node_cache, pointer);
         return;
     }
 
@@ -315,7 +326,7 @@ static void dequeue_fifo(struct queue *queue_head) {
         queue_head->tail = queue_head->head;
     }
 
-    kfree(pointer);
+    slab_cache_free(queue_node_cache, pointer);
 }
 
 /*
@@ -330,7 +341,7 @@ static void dequeue_lifo(struct queue *queue_head) {
     }
 
     if (queue_head->node_count == 1) {
-        kfree(pointer);
+        slab_cache_free(queue_node_cache, pointer);
         queue_head->head = NULL;
         queue_head->tail = NULL;
         queue_head->node_count--;
@@ -341,7 +352,7 @@ static void dequeue_lifo(struct queue *queue_head) {
     queue_head->head = pointer->next;
     queue_head->node_count--;
 
-    kfree(pointer);
+    slab_cache_free(queue_node_cache, pointer);
 }
 
 /*
@@ -359,7 +370,7 @@ static void dequeue_priority(struct queue *queue_head) {
 
     if (queue_head->head == NULL) {
         queue_head->node_count--;
-        kfree(pointer);
+        slab_cache_free(queue_node_cache, pointer);
         return;
     }
 
@@ -370,5 +381,5 @@ static void dequeue_priority(struct queue *queue_head) {
         queue_head->tail = queue_head->head;
     }
 
-    kfree(pointer);
+    slab_cache_free(queue_node_cache, pointer);
 }
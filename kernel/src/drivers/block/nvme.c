@@ -175,16 +175,19 @@ static int32_t nvme_setup_physical_region_pools(struct nvme_device *nvme_dev, ui
     num_pages = DIV_ROUND_UP(number_prps, prps_per_page);
 
     if (number_prps > nvme_dev->prp_entry_count) {
-        kfree(Phys2Virt(nvme_dev->prp_pool));
         /*
          * Always increase in increments of pages.  It doesn't waste
          * much memory and reduces the number of allocations.
+         *
+         * Every entry is rewritten below so the old contents don't matter, krealloc is used since it can usually
+         * grow the pool in place rather than handing back the old pages and grabbing new ones.
          */
-        nvme_dev->prp_pool = (kzmalloc(num_pages * page_size));
-        if (!nvme_dev->prp_pool) {
+        uint64_t *new_pool = krealloc(nvme_dev->prp_pool, num_pages * page_size);
+        if (!new_pool) {
             err_printf("kmalloc prp_pool fail\n");
             return KERN_NO_MEM;
         }
+        nvme_dev->prp_pool = new_pool;
         nvme_dev->prp_entry_count = prps_per_page * num_pages;
     }
 
@@ -279,9 +282,9 @@ nvme_raw_block(struct device *dev, uint64_t block_number, uint64_t block_count,
  */
 static int32_t nvme_wait_ready(struct nvme_device *nvme_dev, bool enabled) {
     uint32_t bit = enabled ? NVME_CSTS_RDY : 0;
-    int32_t timeout_millis;
+    uint64_t timeout_millis;
 
-    int64_t start;
+    uint64_t start;
 
     timeout_millis = NVME_CAP_TIMEOUT(nvme_dev->capabilities) * 500;
     start = timer_get_current_count();
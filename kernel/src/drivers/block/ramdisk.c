@@ -51,9 +51,21 @@ void ramdisk_init(uint64_t size_bytes, const uint64_t ramdisk_id, char *name, ui
         size_bytes = DEFAULT_RAMDISK_SIZE;
     }
 
-    ramdisk[ramdisk_id].ramdisk_start = kmalloc(size_bytes);
-    ramdisk[ramdisk_id].ramdisk_size_pages = size_bytes / PAGE_SIZE;
-    ramdisk[ramdisk_id].ramdisk_size_pages++; //just in case we're a page short with the above calc which is likely
+    /*
+     * Allocated as an exact number of pages so that ramdisk_end is actually the end of what we own, big ramdisks go through
+     * the contiguous range path. Running out is still fatal, everything built on the ramdisk (diosfs) assumes it is there, but
+     * we say why here instead of leaving a NULL ramdisk_start for somebody to trip over later.
+     */
+    const uint64_t pages = (size_bytes / PAGE_SIZE) + 1; //just in case we're a page short with the above calc which is likely
+    void *start = phys_alloc_contiguous(pages, KERNEL_POOL);
+    if (start == NULL) {
+        err_printf("ramdisk_init: %s needs %i contiguous pages\n", name, pages);
+        panic("ramdisk_init: not enough contiguous memory for the ramdisk");
+        return;
+    }
+
+    ramdisk[ramdisk_id].ramdisk_start = Phys2Virt(start);
+    ramdisk[ramdisk_id].ramdisk_size_pages = pages;
     ramdisk[ramdisk_id].ramdisk_end = ramdisk[ramdisk_id].ramdisk_start + (ramdisk[ramdisk_id].ramdisk_size_pages *
                                                                            PAGE_SIZE);
     ramdisk[ramdisk_id].block_size = block_size;
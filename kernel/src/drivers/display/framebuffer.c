@@ -13,6 +13,10 @@
 #include "include/drivers/display/font.h"
 #include "include/architecture/arch_timer.h"
 #include "include/device/device_filesystem.h"
+#include "include/scheduling/timer_wheel.h"
+
+#define CURSOR_BLINK_MS 250 /* How long the cursor box stays on (and off) */
+#define CURSOR_HALF_BLINKS 6 /* Three blinks each time there is new output */
 
 struct framebuffer main_framebuffer;
 #define MAIN_FB 0
@@ -113,17 +117,23 @@ void reset_x_value(struct framebuffer *fb) {
     fb->context.current_y_pos += fb->font_height;
 }
 
-void draw_cursor_box(struct framebuffer *fb, uint32_t color) {
+static void draw_cursor_box_at(struct framebuffer *fb, const uint64_t x, const uint64_t y, uint32_t color) {
     uint32_t *framebuffer = fb->address;
     for (uint64_t cy = fb->font_height - 1; cy < fb->font_height; cy++) {
         for (uint64_t cx = 0; cx < fb->font_width; cx++) {
-            const uint64_t px = fb->context.current_x_pos + cx; // Calculate absolute X position
-            const uint64_t py = fb->context.current_y_pos + cy; // Calculate absolute Y position
-            framebuffer[py * (fb->pitch / sizeof(uint32_t)) + px] = color; // Set pixel color
+            const uint64_t px = x + cx; // Calculate absolute X position
+            const uint64_t py = y + cy; // Calculate absolute Y position
+            if (px < fb->width && py < fb->height) {
+                framebuffer[py * (fb->pitch / sizeof(uint32_t)) + px] = color; // Set pixel color
+            }
         }
     }
 }
 
+void draw_cursor_box(struct framebuffer *fb, uint32_t color) {
+    draw_cursor_box_at(fb, fb->context.current_x_pos, fb->context.current_y_pos, color);
+}
+
 static void scroll_framebuffer(struct framebuffer *fb) {
     const uint64_t rows_size = fb->pitch * (fb->height - fb->font_height);
     const uint64_t row_size = fb->pitch * fb->font_height;
@@ -140,8 +150,51 @@ static void scroll_framebuffer(struct framebuffer *fb) {
     fb->context.current_x_pos = 0;
 }
 
-void current_pos_cursor(struct framebuffer *fb) {
+/*
+ * One half of a blink, run off the timer wheel of whichever CPU printed last. If somebody is printing right now we just try
+ * again on the next period rather than spin in interrupt context. The box is always erased where it was drawn, text may have
+ * moved the cursor on since.
+ */
+static void cursor_blink(void *data) {
+    struct framebuffer *fb = data;
+
     if (!try_lock(&fb->lock)) {
+        timer_event_arm(&fb->cursor_timer, CURSOR_BLINK_MS);
+        return;
+    }
+
+    if (fb->cursor_blinks & 1) {
+        draw_cursor_box_at(fb, fb->cursor_x, fb->cursor_y, BLACK);
+    } else {
+        fb->cursor_x = fb->context.current_x_pos;
+        fb->cursor_y = fb->context.current_y_pos;
+        draw_cursor_box_at(fb, fb->cursor_x, fb->cursor_y, WHITE);
+    }
+
+    fb->cursor_blinks--;
+    if (fb->cursor_blinks != 0) {
+        timer_event_arm(&fb->cursor_timer, CURSOR_BLINK_MS);
+    }
+
+    release_spinlock(&fb->lock);
+}
+
+/*
+ * Called once the timer wheels are up, before that there is nothing to drive the blink
+ */
+void framebuffer_cursor_init() {
+    timer_event_init(&main_framebuffer.cursor_timer, cursor_blink, &main_framebuffer);
+    main_framebuffer.cursor_blinks = 0;
+    main_framebuffer.cursor_enabled = true;
+}
+
+/*
+ * Blink the cursor a few times at the current position. This used to draw and timer_sleep right here, 1.5 seconds with
+ * the framebuffer lock held and interrupts off, now it only arms cursor_blink and returns. Every printf calls it once the
+ * output is down, a blink that is already going just carries on at the new position.
+ */
+void current_pos_cursor(struct framebuffer *fb) {
+    if (!fb->cursor_enabled || !try_lock(&fb->lock)) {
         return;
     }
     if (fb->context.current_x_pos >= fb->width) {
@@ -151,11 +204,9 @@ void current_pos_cursor(struct framebuffer *fb) {
         scroll_framebuffer(fb);
     }
 
-    for (size_t i = 0; i < 3; i++) {
-        draw_cursor_box(fb, WHITE);
-        timer_sleep(250);
-        draw_cursor_box(fb, BLACK);
-        timer_sleep(250);
+    if (fb->cursor_blinks == 0) {
+        fb->cursor_blinks = CURSOR_HALF_BLINKS;
+        timer_event_arm(&fb->cursor_timer, CURSOR_BLINK_MS);
     }
 
     release_spinlock(&fb->lock);
@@ -360,6 +411,7 @@ void kprintf(char *str, ...) {
         str++;
     }
     release_spinlock(&main_framebuffer.lock);
+    current_pos_cursor(&main_framebuffer);
     va_end(args);
 }
 
@@ -472,13 +524,18 @@ void debug_printf(char *str, ...) {
         str++;
     }
     release_spinlock(&main_framebuffer.lock);
+    current_pos_cursor(&main_framebuffer);
     va_end(args);
 }
 
 /*
  * It doesn't QUITE belong here but the others are here and it makes it easier to put it in the same header file.
  */
-void ksprintf(char *buffer, char *str, ...) {
+/*
+ * Same format as kprintf but into a buffer. The result is null terminated and the length (not counting the terminator) is returned
+ * so that callers can build up a larger buffer one line at a time.
+ */
+uint64_t ksprintf(char *buffer, char *str, ...) {
     uint64_t index = 0;
     va_list args;
     va_start(args, str);
@@ -585,6 +642,8 @@ void ksprintf(char *buffer, char *str, ...) {
     }
 
     va_end(args);
+    buffer[index] = '\0';
+    return index;
 }
 
 /*
@@ -701,6 +760,7 @@ void err_printf(char *str, ...) {
         str++;
     }
     release_spinlock(&main_framebuffer.lock);
+    current_pos_cursor(&main_framebuffer);
     va_end(args);
 }
 
@@ -818,6 +878,7 @@ void warn_printf(char *str, ...) {
     }
 
     release_spinlock(&main_framebuffer.lock);
+    current_pos_cursor(&main_framebuffer);
     va_end(args);
 }
 
@@ -935,6 +996,7 @@ void info_printf(char *str, ...) {
     }
 
     release_spinlock(&main_framebuffer.lock);
+    current_pos_cursor(&main_framebuffer);
     va_end(args);
 }
 
@@ -1053,6 +1115,7 @@ void kprintf_color(uint32_t color, char *str, ...) {
     }
 
     release_spinlock(&main_framebuffer.lock);
+    current_pos_cursor(&main_framebuffer);
     va_end(args);
 }
 
@@ -425,8 +425,7 @@ int64_t diosfs_read(struct vnode *vnode, const uint64_t offset, char *buffer, co
     struct diosfs_inode inode;
     diosfs_read_inode(fs, &inode, vnode->vnode_inode_number);
     DEBUG_PRINT("INODE %s NUMBER %i SIZE %i BLOCK COUNT %i BLOCK 0 %i 1 %i 2 %i",inode.name,inode.inode_number,inode.size,inode.block_count,inode.blocks[0],inode.blocks[1],inode.blocks[2]);
-    uint64_t ret = diosfs_read_bytes_from_inode(fs, &inode, buffer, PGROUNDUP(bytes),
-                                                offset % fs->superblock->block_size, bytes);
+    uint64_t ret = diosfs_read_bytes_from_inode(fs, &inode, buffer, PGROUNDUP(bytes), offset, bytes);
 
     release_spinlock(fs->lock);
     return ret;
@@ -1399,7 +1398,7 @@ static uint64_t diosfs_read_bytes_from_inode(struct diosfs_filesystem_context *f
     uint64_t start_offset = offset % fs->superblock->block_size;
 
     uint64_t current_block_number = 0;
-    uint64_t end_block = start_block + num_blocks_to_read;
+    uint64_t end_block = read_size_bytes ? (offset + read_size_bytes - 1) / fs->superblock->block_size : start_block;
 
 
     /*
@@ -1407,7 +1406,7 @@ static uint64_t diosfs_read_bytes_from_inode(struct diosfs_filesystem_context *f
      */
     uint64_t bytes_read = 0;
     uint64_t bytes_to_read = read_size_bytes;
-    for (uint64_t i = start_block; i <= end_block; i++) {
+    for (uint64_t i = start_block; i <= end_block && bytes_to_read != 0; i++) {
         uint64_t byte_size;
         if (fs->superblock->block_size - start_offset < bytes_to_read) {
             byte_size = fs->superblock->block_size - start_offset;
@@ -1854,14 +1853,29 @@ static void diosfs_read_block_by_number(const uint64_t block_number, char *buffe
     if (read_size_bytes + offset > fs->superblock->block_size) {
         read_size_bytes = fs->superblock->block_size - offset;
     }
+
+    /*
+     * The device only reads whole blocks so a partial read goes through a bounce buffer, otherwise it would land at the
+     * wrong spot and run off the end of the caller's buffer
+     */
+    char *block = buffer;
+    if (offset != 0 || read_size_bytes != fs->superblock->block_size) {
+        block = kmalloc(fs->superblock->block_size);
+    }
+
     uint64_t ret = fs->device->driver->device_ops->block_device_ops->block_read(
             fs->superblock->block_start_pointer +
-            block_number, 1, buffer, fs->device);
+            block_number, 1, block, fs->device);
 
     if (ret != DIOSFS_SUCCESS) {
         HANDLE_DISK_ERROR(ret, "diosfs_read_block_by_number");
         panic("diosfs_read_block_by_number");
     }
+
+    if (block != buffer) {
+        memcpy(buffer, block + offset, read_size_bytes);
+        kfree(block);
+    }
 }
 
 /*
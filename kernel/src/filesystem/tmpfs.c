@@ -40,6 +40,9 @@ static void tmpfs_delete_reg_file(struct tmpfs_node *node);
 
 static void tmpfs_remove_dirent_in_parent_directory(const struct tmpfs_node *node_to_remove);
 
+static int64_t tmpfs_read_generated(struct vnode *vnode, struct tmpfs_node *node, uint64_t offset, char *buffer,
+                                    uint64_t bytes);
+
 uint8_t tmpfs_node_number_bitmap[PAGE_SIZE] = {0}; // only 1 since we won't support multiple distinct tmpfs filesystems
 /*
  * Store the procfs root so when I implement it's usage later we can access it directly without worrying where it is
@@ -219,6 +222,12 @@ int64_t tmpfs_read(struct vnode *vnode, uint64_t offset, char *buffer, uint64_t
     struct tmpfs_filesystem_context *context = vnode->filesystem_object;
     acquire_spinlock(&context->fs_lock);
     struct tmpfs_node *node = find_tmpfs_node_from_vnode(vnode);
+
+    if (node->generate != NULL) {
+        const int64_t ret = tmpfs_read_generated(vnode, node, offset, buffer, bytes);
+        release_spinlock(&context->fs_lock);
+        return ret;
+    }
     uint64_t page = offset > PAGE_SIZE ? offset / PAGE_SIZE : 0;
     offset = offset % PAGE_SIZE;
     const uint64_t total_bytes = bytes;
@@ -350,6 +359,67 @@ void tmpfs_mkfs(const uint64_t filesystem_id, char *directory_to_mount_onto) {
     log_kernel_message("Tmpfs initialized.\n");
 }
 
+/*
+ * Create a file under procfs whose contents come from calling generate rather than from anything written to it. This is
+ * how live information (like meminfo) is exposed, it is built again every time the file is read so it is never stale.
+ *
+ * The generator gets a TMPFS_GENERATED_FILE_SIZE buffer and returns how many bytes it put in it. It is run once up front
+ * so that the file has a sensible size for readers that ask for the whole thing.
+ */
+struct vnode *procfs_create_generated_file(char *name, uint64_t (*generate)(char *buffer, uint64_t size)) {
+    if (!procfs_online) {
+        return NULL;
+    }
+
+    char *path = vnode_get_canonical_path(procfs_root);
+    struct vnode *vnode = vnode_create(path, name, VNODE_FILE);
+    kfree(path);
+
+    if (vnode == NULL) {
+        warn_printf("procfs_create_generated_file: could not create %s\n", name);
+        return NULL;
+    }
+
+    struct tmpfs_filesystem_context *context = vnode->filesystem_object;
+    acquire_spinlock(&context->fs_lock);
+    struct tmpfs_node *node = find_tmpfs_node_from_vnode(vnode);
+    node->generate = generate;
+
+    char *contents = kmalloc(TMPFS_GENERATED_FILE_SIZE);
+    node->tmpfs_node_size = generate(contents, TMPFS_GENERATED_FILE_SIZE);
+    vnode->vnode_size = node->tmpfs_node_size;
+    kfree(contents);
+    release_spinlock(&context->fs_lock);
+
+    serial_printf("TMPFS: Created %s file under procfs\n", name);
+    return vnode;
+}
+
+/*
+ * Build the file and copy out whatever part of it was asked for, the size is updated every time since it can change from
+ * one read to the next
+ */
+static int64_t tmpfs_read_generated(struct vnode *vnode, struct tmpfs_node *node, const uint64_t offset, char *buffer,
+                                    uint64_t bytes) {
+    char *contents = kmalloc(TMPFS_GENERATED_FILE_SIZE);
+    const uint64_t size = node->generate(contents, TMPFS_GENERATED_FILE_SIZE);
+    node->tmpfs_node_size = size;
+    vnode->vnode_size = size;
+
+    if (offset >= size) {
+        kfree(contents);
+        return 0;
+    }
+
+    if (bytes > size - offset) {
+        bytes = size - offset;
+    }
+
+    memcpy(buffer, contents + offset, bytes);
+    kfree(contents);
+    return (int64_t) bytes;
+}
+
 /*
  * Finds a given node where the sought-after page is found
  * If the node is not found this means we are reaching a new area and will allocate a new page list entry, allocating the first page as a courtesy
@@ -9,6 +9,7 @@
 #include <include/drivers/display/framebuffer.h>
 #include <include/drivers/serial/uart.h>
 #include <include/memory/kmalloc.h>
+#include <include/memory/slab.h>
 #include "include/architecture/arch_cpu.h"
 #include "include/memory/mem.h"
 #include "include/architecture/arch_timer.h"
@@ -26,6 +27,9 @@ struct vnode static_vnode_pool[VFS_STATIC_POOL_SIZE];
 //Root node
 struct vnode vfs_root;
 
+//Dynamically allocated vnodes come from here once the static pool is gone
+struct slab_cache *vnode_cache;
+
 //VFS lock
 struct spinlock vfs_lock;
 struct spinlock list_lock;
@@ -62,6 +66,7 @@ void vfs_init() {
     vfs_root.vnode_ops = NULL;
     vfs_root.vnode_filesystem_id = VNODE_FS_VNODE_ROOT;
     vfs_root.node_lock = kzmalloc(sizeof (struct spinlock));
+    vnode_cache = slab_cache_create("vnode", sizeof(struct vnode), sizeof(void *), NULL);
     kprintf("Virtual Filesystem Initialized\n");
     serial_printf("VFS initialized\n");
 }
@@ -73,7 +78,7 @@ void vfs_init() {
 struct vnode *vnode_alloc() {
     acquire_spinlock(&list_lock);
     if (vnode_static_pool.head == NULL) {
-        struct vnode *new_node = kzmalloc(sizeof(struct vnode));
+        struct vnode *new_node = slab_cache_alloc(vnode_cache);
         DEBUG_PRINT("VNODE ALLOC %x.64\n", new_node);
         release_spinlock(&list_lock);
         new_node->node_lock = kzmalloc(sizeof(struct spinlock));
@@ -150,7 +155,7 @@ void vnode_free(struct vnode *vnode) {
     }
     kfree(vnode->node_lock);
     vnode->node_lock = NULL;
-    kfree(vnode);
+    slab_cache_free(vnode_cache, vnode);
     release_spinlock(&list_lock);
 }
 
@@ -25,5 +25,9 @@ static inline void nop(){
     asm("nop");
 }
 
+static inline uint64_t read_cycle_counter() {
+    return rdtsc();
+}
+
 
 #endif
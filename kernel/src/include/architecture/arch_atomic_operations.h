@@ -9,4 +9,6 @@
 
 bool arch_atomic_swap(uint64_t *field, uint64_t new_value);
 bool arch_atomic_swap_or_return(uint64_t *field, uint64_t new_value);
+uint64_t arch_atomic_exchange(uint64_t *field, uint64_t new_value);
+bool arch_atomic_cas(uint64_t *field, uint64_t expected, uint64_t new_value);
 #endif //DIONYSOS_ARCH_ATOMIC_OPERATIONS_H
@@ -8,6 +8,8 @@
 #include "limine.h"
 #include "include/scheduling/process.h"
 #include "include/data_structures/queue.h"
+#include "include/memory/slab.h"
+#include "include/memory/pmm.h"
 
 //Static allocation for 8, will never use this many but that is okay.
 
@@ -58,6 +60,13 @@ struct cpu
     struct process* running_process;
     struct queue* local_run_queue;
     struct gs_stacks* gs_stacks;
+    struct slab_magazine magazines[MAX_SLAB_CACHES]; /* Per-CPU object caches in front of the kernel heap slabs */
+    struct per_cpu_pages page_caches[2]; /* Per-CPU single page caches in front of the buddy allocator, one per pool */
+    uint64_t lock_depth; /* How many spinlocks this CPU is holding, see push_interrupts_off */
+    uint64_t interrupts_before_lock; /* Whether interrupts were on before the first of those locks was taken */
+    uint8_t numa_node; /* Which NUMA node this CPU is on, page allocations come from here first */
+    bool idle; /* Halted with nothing to run, whoever gives it work clears this and sends it a wakeup, see sched_kick */
+    uint64_t idle_entries; /* How many times this CPU has gone idle */
 };
 
 static inline void set_user_gs_stack(void* stack, struct cpu* cpu) {
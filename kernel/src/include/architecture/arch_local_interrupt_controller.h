@@ -38,10 +38,20 @@
 #define LAPIC_SPURIOUS 0xF0
 #define LAPIC_EOI 0xB0
 
+#define LAPIC_TIMER_PERIOD_MS 1 /* Scheduling tick on every CPU */
+#define LAPIC_CALIBRATE_MS 10
+
+extern uint64_t apic_ticks;
+extern uint8_t lapic_timer_vector;
+extern uint8_t lapic_wakeup_vector;
+extern uint64_t lapic_timer_interrupts[];
+
 void lapic_init();
 void lapic_timer_stop();
 void lapic_timer_oneshot(uint8_t vec, uint64_t ms);
 void lapic_calibrate_timer();
+void lapic_timer_periodic(uint8_t vec, uint64_t ms);
+void lapic_timer_start();
 void lapic_write(uint32_t reg, uint32_t val);
 uint32_t lapic_read(uint32_t reg);
 void lapic_eoi();
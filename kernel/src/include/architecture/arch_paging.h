@@ -65,6 +65,7 @@ extern p4d_t *global_pg_dir;
 #define PTE_NX          (1ULL << 63ULL)// no execute
 #define PTE_PCD         0x010ULL // page cache disable
 #define PTE_PWT         0x008ULL //page write through
+#define PTE_COW         0x200ULL // One of the bits left to software, a read only page shared by fork that is copied on the first write
 
 
 #define PTE_PAT         1UL << 7UL //Only bit 7 in your run-of-the-mill 4k PTEs
@@ -77,6 +78,16 @@ extern p4d_t *global_pg_dir;
 #define PAT_WB 0x06 //write back
 #define PAT_UC_MINUS 0x07 // uncached-
 
+#define MTRR_CAP_MSR 0xFE
+#define MTRR_DEF_TYPE_MSR 0x2FF
+#define MTRR_PHYS_BASE_MSR(n) (0x200 + ((n) * 2))
+#define MTRR_PHYS_MASK_MSR(n) (0x201 + ((n) * 2))
+#define MTRR_ENABLE (1ULL << 11ULL) // Def type E bit, MTRRs are off altogether without it
+#define MTRR_FIXED_ENABLE (1ULL << 10ULL) // Def type FE bit, fixed range MTRRs cover the first 1MiB
+#define MTRR_MASK_VALID (1ULL << 11ULL) // Phys mask V bit
+#define MTRR_TYPE(base) ((base) & 0xFF)
+#define MTRR_MAX_VARIABLE 16
+
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint64_t)(pte) & ~0xF000000000000FFFULL)
 #define PTE_FLAGS(pte)  ((uint64_t)(pte) &  0xF000000000000FFFULL)
@@ -5,9 +5,25 @@
 #ifndef ARCH_TIMER_H
 #define ARCH_TIMER_H
 #include <stdint.h>
-uint16_t timer_get_current_count();
+
+#define CLOCK_MONOTONIC 1
+
+/*
+ * Same layout as the userspace one so clock_gettime can fill it in directly
+ */
+struct kernel_timespec {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+};
+
+uint64_t timer_get_current_count();
+uint64_t clock_monotonic_ns();
+int64_t clock_gettime(uint64_t clock_id, struct kernel_timespec *ts);
 void timer_set_frequency_hz(uint64_t freq);
 void timer_init(uint64_t hz);
 void timer_set_reload_value(uint16_t value);
 void timer_sleep(uint16_t millis);
+struct cpu;
+void timer_idle(struct cpu *cpu, uint64_t max_millis);
+void timer_wake_cpu(struct cpu *cpu);
 #endif
\ No newline at end of file
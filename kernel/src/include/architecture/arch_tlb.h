@@ -0,0 +1,91 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include "include/definitions/types.h"
+#include "include/definitions/definitions.h"
+#include "include/architecture/arch_paging.h"
+#include "include/data_structures/spinlock.h"
+
+/*
+ * TLB shootdown. Changing or removing a mapping only invalidates the TLB of the CPU doing it, any other CPU with the same page
+ * table loaded can keep using the old translation (and write to a page that has been freed and handed to someone else) until
+ * it next reloads cr3. So every CPU that has the page table loaded is sent the addresses to drop.
+ *
+ * Callers collect the addresses they touch in a tlb_batch and flush it once at the end. Flushing puts the addresses on the
+ * flush queue of each CPU that has that page table loaded, sends each of them one IPI, and waits until they have all done it.
+ * A batch (or a queue) with more addresses than it has room for just asks for the whole TLB to be dropped instead, past a few
+ * dozen pages reloading cr3 is cheaper than all the invlpgs anyway.
+ */
+
+#define TLB_BATCH_MAX 32 /* Addresses a batch holds before it gives up and asks for a full flush */
+#define TLB_QUEUE_MAX 64 /* Addresses each CPU's flush queue holds, a few batches can land on it before it runs its handler */
+
+/*
+ * PCIDs. With CR4.PCIDE set every TLB entry is tagged with the PCID in the low 12 bits of cr3 at the time, and loading cr3 with
+ * bit 63 set keeps the entries of the PCID being loaded instead of throwing them away. So a CPU that comes back to an address
+ * space it ran recently can pick up where it left off instead of refilling the whole TLB.
+ *
+ * There are only 4096 PCIDs and no bound on how many page maps there can be, so rather than giving each virt_map one for life
+ * every CPU keeps a handful of slots, each remembering a top level. Slot n is PCID n + 1 (PCID 0 is what everything boots with
+ * and is never loaded without a flush). Switching to a top level that has a slot reuses it, anything else takes the oldest slot
+ * and loads it with a flush.
+ *
+ * A CPU that does not have a page map loaded does not get a shootdown for it, so its slot for that map is marked stale instead
+ * and the next switch to it flushes.
+ */
+#define TLB_PCID_SLOTS 8
+#define CR3_NOFLUSH BIT(63)
+#define CR4_PCIDE BIT(17)
+#define CPUID_PCID BIT(17) /* CPUID leaf 1 ECX */
+
+struct tlb_pcid_slot {
+    uint64_t top_level;
+    uint64_t stale;
+};
+
+struct tlb_pcid_cache {
+    struct tlb_pcid_slot slots[TLB_PCID_SLOTS];
+    uint64_t next_victim;
+    uint64_t hits; /* Switches that kept the TLB */
+    uint64_t misses; /* Switches that flushed, either no slot or a stale one */
+    uint64_t skipped; /* Switches to the page map that was already loaded, cr3 is not touched at all */
+};
+
+struct tlb_batch {
+    p4d_t *pgdir;
+    uint64_t count;
+    bool full_flush;
+    uint64_t addresses[TLB_BATCH_MAX];
+};
+
+/*
+ * One per CPU. Senders append under the lock, the owning CPU empties it from its IPI handler. requested is bumped by every
+ * sender and completed is set by the owner once it has flushed everything up to that point, so a sender knows its addresses
+ * are gone once completed has caught up to the ticket it got.
+ */
+struct tlb_flush_queue {
+    struct spinlock lock;
+    uint64_t count;
+    bool full_flush;
+    uint64_t requested;
+    uint64_t completed;
+    uint64_t addresses[TLB_QUEUE_MAX];
+    uint64_t ipis_received;
+    uint64_t full_flushes;
+};
+
+extern uint64_t tlb_shootdowns; /* Batches that had to go to at least one other CPU */
+extern uint64_t tlb_ipis_sent;
+extern bool tlb_pcid_enabled;
+extern struct tlb_pcid_cache tlb_pcid_caches[];
+
+void tlb_shootdown_init();
+void tlb_cpu_init();
+void tlb_batch_init(struct tlb_batch *batch, p4d_t *pgdir);
+void tlb_batch_add(struct tlb_batch *batch, uint64_t address);
+void tlb_batch_flush(struct tlb_batch *batch);
+void tlb_shootdown(p4d_t *pgdir, uint64_t address);
+void tlb_shootdown_poll();
+uint64_t tlb_switch_page_map(struct cpu *cpu, struct virt_map *page_map);
+void tlb_page_map_freed(p4d_t *pgdir);
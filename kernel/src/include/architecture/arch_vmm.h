@@ -13,7 +13,18 @@
 enum {
     ALLOC = 1,
     DEBUG = 2,
-    USER_ALLOC = 4
+    USER_ALLOC = 4,
+    SPLIT = 8 /* Break up any huge page in the way so the walk always ends at a 4KiB entry, see walk_page_directory_level */
+};
+
+/*
+ * Paging levels for walk_page_directory_level, named after how much one entry at that level maps
+ */
+enum {
+    PAGE_LEVEL_4K = 1,
+    PAGE_LEVEL_2M = 2,
+    PAGE_LEVEL_1G = 3,
+    PAGE_LEVEL_512G = 4
 };
 
 #ifdef __x86_64__
@@ -48,6 +59,7 @@ void switch_page_table(p4d_t *page_dir);
 
 int map_pages(p4d_t *pgdir, uint64_t physaddr, const uint64_t *va, uint64_t perms, uint64_t size);
 int map_single_page(p4d_t *pgdir, uint64_t physaddr, const uint64_t *va, const uint64_t perms);
+int protect_page(p4d_t *pgdir, uint64_t va, uint64_t perms);
 uint64_t dealloc_va(p4d_t *pgdir, uint64_t address);
 
 void dealloc_va_range(p4d_t *pgdir, uint64_t address, uint64_t size);
@@ -63,7 +75,11 @@ void dealloc_user_va_range(p4d_t *pgdir, const uint64_t address, const uint64_t
 uint64_t dealloc_user_va(p4d_t *pgdir, const uint64_t address);
 
 pte_t *walk_page_directory(p4d_t *pgdir, const void *va, const int flags);
+pte_t *walk_page_directory_level(p4d_t *pgdir, const void *va, int flags, int level, uint64_t *leaf_size);
 uint64_t check_page_mapping(uint64_t *pagemap, void *address);
 void arch_map_foreign(p4d_t *user_page_table,uint64_t *va, uint64_t size);
 void arch_unmap_foreign(uint64_t size);
-void free_page_tables(p4d_t *pgdir);
\ No newline at end of file
+void free_page_tables(p4d_t *pgdir);
+void share_user_pages(p4d_t *source, p4d_t *destination);
+int copy_on_write_page(p4d_t *pgdir, uint64_t va);
+void map_foreign_range(p4d_t *pgdir, uint64_t va, p4d_t *source, uint64_t source_va, uint64_t pages, uint64_t perms);
\ No newline at end of file
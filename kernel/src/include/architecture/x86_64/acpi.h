@@ -99,6 +99,8 @@ struct description_table_header {
 extern int8_t acpi_extended;
 extern void *acpi_root_sdt;
 
+void acpi_root_init();
+
 void acpi_init();
 
 void *find_acpi_table(const char *name);
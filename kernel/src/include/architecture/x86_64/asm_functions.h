@@ -96,6 +96,29 @@ static inline void stosq(void* addr, long long data, int cnt) {
 }
 
 
+// Copies count bytes with a single rep movsb, only worth it on CPUs with ERMS (see mem_init)
+static inline void rep_movsb(void* dest, const void* src, uint64_t count) {
+    asm volatile("cld; rep movsb" :
+        "+D" (dest), "+S" (src), "+c" (count) :
+        :
+        "memory", "cc");
+}
+
+// Fills count bytes with a single rep stosb, only worth it on CPUs with ERMS (see mem_init)
+static inline void rep_stosb(void* dest, uint8_t data, uint64_t count) {
+    asm volatile("cld; rep stosb" :
+        "+D" (dest), "+c" (count) :
+        "a" (data) :
+        "memory", "cc");
+}
+
+// Executes cpuid for the given leaf and subleaf
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid" :
+        "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) :
+        "a" (leaf), "c" (subleaf));
+}
+
 // Loads the Task Register (TR).
 static inline void ltr(uint16_t sel) {
     asm volatile("ltr %0" : : "r" (sel));
@@ -133,6 +156,16 @@ static inline uint64_t xchg(volatile uint64_t *addr, uint64_t newval) {
     return result;
 }
 
+// Atomic compare and exchange, returns whatever was in *addr before. It only changed if that is equal to expected.
+static inline uint64_t cmpxchg(volatile uint64_t *addr, uint64_t expected, uint64_t newval) {
+    uint64_t result;
+    asm volatile("lock; cmpxchg %2, %1" :
+        "=a" (result), "+m" (*addr) :
+        "r" (newval), "0" (expected) :
+        "memory", "cc");
+    return result;
+}
+
 static inline uint64_t rcr2(void) {
     uint64_t val;
     asm volatile("mov %%cr2, %0" : "=r" (val));
@@ -184,6 +217,16 @@ static inline uint64_t interrupts_enabled() {
     return ((flags & BIT(9)) > 0);
 }
 
+/*
+ * Read the time stamp counter, only used for measuring things so no serializing instruction in front of it
+ */
+static inline uint64_t rdtsc() {
+    uint32_t low;
+    uint32_t high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t) high << 32) | low;
+}
+
 static inline void clflush64(void *ptr) {
     __asm__ volatile("clflush (%0)" :: "r"(ptr));
 }
@@ -7,7 +7,9 @@
 #pragma once
 
 #include "stdint.h"
+#include "stdbool.h"
 #define REGISTER_WIDTH 8
+#define FEMTOSECONDS_PER_SECOND 1000000000000000ULL
 enum register_offsets {
     capabilities_id = 0x0,
     general_config = 0x10,
@@ -54,5 +56,8 @@ enum register_offsets {
 extern struct hpet hpet;
 
 void hpet_initialize_and_enable_interrupts(uint64_t hz);
+bool hpet_enable_counter();
+uint64_t hpet_get_main_counter();
+uint64_t hpet_get_period();
 
 #endif //KERNEL_HPET_H
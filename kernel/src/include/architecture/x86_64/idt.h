@@ -41,8 +41,9 @@ inline void load_idtr(struct idtr_desc *idtr) {
 
 void idt_init(void);
 void irq_register(uint8_t vec, void* handler);
+void irq_register_local(uint8_t vec, void* handler);
 void irq_unregister(uint8_t vec);
-uint8_t idt_get_vector();
+uint8_t idt_get_irq_vector();
 void idt_reload();
 void irq_handler(uint8_t vec);
 void irq_handler_init();
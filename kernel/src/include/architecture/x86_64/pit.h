@@ -12,6 +12,12 @@
 #define CHANNEL2_DATA 0x42
 #define CMD 0x43
 
+/* Channel 2 gate and output, see pit_channel2_start */
+#define PIT_GATE_PORT 0x61
+#define PIT_GATE_CHANNEL2 (1 << 0)
+#define PIT_GATE_SPEAKER (1 << 1)
+#define PIT_GATE_OUTPUT2 (1 << 5)
+
 extern bool use_pit;
 extern volatile uint64_t timer_ticks;
 void x86_timer_interrupt();
@@ -20,4 +26,6 @@ void pit_set_reload_value(uint16_t new_reload_value);
 void pit_set_freq(uint64_t freq);
 uint64_t get_pit_ticks();
 uint16_t pit_get_current_count();
+void pit_channel2_start(uint64_t ms);
+bool pit_channel2_expired();
 #endif //PIT_H
@@ -0,0 +1,58 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+
+#include "include/definitions/types.h"
+#include "acpi.h"
+
+#define SRAT_TYPE_LAPIC_AFFINITY 0
+#define SRAT_TYPE_MEMORY_AFFINITY 1
+#define SRAT_TYPE_X2APIC_AFFINITY 2
+
+#define SRAT_ENABLED BIT(0) /* Same bit for every entry type, entries without it are to be ignored */
+
+struct acpi_srat {
+    struct acpi_sdt header;
+    uint32_t reserved;
+    uint64_t reserved2;
+    int8_t table[];
+}__attribute__((packed));
+
+struct srat_header {
+    uint8_t type;
+    uint8_t len;
+}__attribute__((packed));
+
+struct srat_lapic_affinity {
+    struct srat_header header;
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+}__attribute__((packed));
+
+struct srat_memory_affinity {
+    struct srat_header header;
+    uint32_t proximity_domain;
+    uint16_t reserved;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+}__attribute__((packed));
+
+struct srat_x2apic_affinity {
+    struct srat_header header;
+    uint16_t reserved;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+}__attribute__((packed));
+
+void srat_init();
@@ -0,0 +1,35 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include <stdbool.h>
+#include "include/definitions/types.h"
+
+/*
+ * The TSC as a monotonic nanosecond clock. It is calibrated once at boot against the HPET main counter (or PIT channel 2 if
+ * there is no HPET), after that reading the time is an rdtsc and a multiply so any CPU can do it at any time without locks.
+ *
+ * Nanoseconds are worked out as ((tsc - base) * mult) >> TSC_SHIFT, mult being 10^9 / the TSC frequency scaled up by 2^TSC_SHIFT.
+ * The multiply is done in 128 bits so it does not overflow however long the machine has been up.
+ *
+ * This assumes every CPU's TSC ticks at the same rate and was started at the same time, which is what CPUID calls an
+ * invariant TSC. Without one (some hypervisors do not advertise it) it still works but a thread that moves between CPUs could
+ * see time step backwards a little, tsc_init says so when it happens.
+ */
+
+#define TSC_SHIFT 32
+#define TSC_CALIBRATE_MS 10
+#define CPUID_INVARIANT_TSC BIT(8) /* CPUID leaf 0x80000007 EDX */
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+struct tsc_clock {
+    uint64_t hz;
+    uint64_t mult;
+    uint64_t base; /* TSC value at time 0 */
+    bool invariant;
+};
+
+extern struct tsc_clock tsc_clock;
+
+void tsc_init();
+uint64_t tsc_read_ns();
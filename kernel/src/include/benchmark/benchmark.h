@@ -0,0 +1,23 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include "include/definitions/types.h"
+
+/*
+ * In-kernel micro benchmarks. Nothing in here is built unless _BENCHMARK_ is defined (add -D_BENCHMARK_ to the CFLAGS in the
+ * Makefile), in which case run_benchmarks is called at the end of kernel_bootstrap and everything is reported over serial.
+ *
+ * Timing is done with read_cycle_counter so results are in cycles, not nanoseconds.
+ */
+
+#define BENCHMARK_ITERATIONS 100000
+
+void run_benchmarks();
+void benchmark_kmalloc();
+void benchmark_mem();
+void benchmark_contig();
+void benchmark_context_switch();
+void benchmark_fork();
+void benchmark_timer();
+void benchmark_timer_wheel();
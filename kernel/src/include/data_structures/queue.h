@@ -33,6 +33,7 @@ struct queue {
 
 };
 
+void queue_cache_init();
 void queue_init(struct queue* queue_head, uint8_t queue_mode, char* name);
 void enqueue(struct queue* queue_head, void* data_to_enqueue, uint8_t priority);
 void dequeue(struct queue* queue_head);
\ No newline at end of file
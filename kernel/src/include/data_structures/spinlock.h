@@ -17,6 +17,8 @@ struct spinlock{
     struct cpu *cpu;
     uint64_t recursion_depth;
     struct process *holding_process;
+    uint64_t acquisitions; /* How many times this lock has been taken */
+    uint64_t contention_count; /* How many of those acquisitions found the lock already held by someone else */
 };
 
 //bootstrap bool so we can avoid cpu stuff while boostrapping
@@ -57,6 +57,9 @@ enum {
     FRAME_LOCK,
     QUEUE_LOCK,
     KERNEL_MESSAGE_LOCK,
+    TIMER_WHEEL_LOCK,
+    TLB_LOCK,
+    ALLOC_TRACE_LOCK,
 };
 
 #define SPRINTF_MAX_LEN 4096
@@ -182,7 +185,7 @@ int64_t get_size(uint64_t handle);
 
 int64_t seek(uint64_t handle, uint64_t whence);
 
-void ksprintf(char *buffer, char *str, ...);
+uint64_t ksprintf(char *buffer, char *str, ...);
 
 void warn_printf(char *str, ...);
 
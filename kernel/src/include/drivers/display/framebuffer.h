@@ -6,6 +6,7 @@
 #define FRAMEBUFFER_H
 #include <stdint.h>
 #include "../../data_structures/spinlock.h"
+#include "../../scheduling/timer_event.h"
 
 #include "../../device/device.h"
 
@@ -88,6 +89,11 @@ struct framebuffer {
     uint64_t font_width;
     struct text_mode_context context;
     struct spinlock lock;
+    struct timer_event cursor_timer; /* Blinks the cursor, see current_pos_cursor */
+    uint64_t cursor_blinks; /* Half blinks left to go, odd means the box is showing right now */
+    uint64_t cursor_x; /* Where the box was last drawn so it can be erased there even if text has moved on */
+    uint64_t cursor_y;
+    bool cursor_enabled; /* Set once the timer wheels are up, see framebuffer_cursor_init */
 };
 
 
@@ -109,5 +115,7 @@ void fb_ops_draw_string(struct device *dev, uint32_t color, char *s);
 
 void framebuffer_init();
 
+void framebuffer_cursor_init();
+
 void current_pos_cursor(struct framebuffer *fb);
 #endif //FRAMEBUFFER_H
@@ -14,6 +14,7 @@
 #define PAGES_PER_TMPFS_ENTRY 1024UL
 #define DIRECTORY_ENTRY_ARRAY_SIZE VNODE_MAX_DIRECTORY_ENTRIES * sizeof(uintptr_t)
 #define MAX_TMPFS_ENTRIES VNODE_MAX_DIRECTORY_ENTRIES
+#define TMPFS_GENERATED_FILE_SIZE (4 * PAGE_SIZE) /* The most a generated procfs file can hold, see procfs_create_generated_file */
 
 struct tmpfs_directory_entries {
     struct tmpfs_node **entries;
@@ -51,6 +52,7 @@ struct tmpfs_node {
     uint64_t tmpfs_node_pages;
     uint8_t node_type;
     uint64_t t_flags;
+    uint64_t (*generate)(char *buffer, uint64_t size); /* If set, this file is not stored anywhere and is built fresh by this on every read */
 
     union {
         struct doubly_linked_list *page_list; //holds tmpfs page_list_entries as defined above
@@ -75,6 +77,8 @@ int64_t tmpfs_write(struct vnode *vnode, uint64_t offset, const char *buffer, ui
 
 int64_t tmpfs_read(struct vnode *vnode, uint64_t offset, char *buffer, uint64_t bytes);
 
+struct vnode *procfs_create_generated_file(char *name, uint64_t (*generate)(char *buffer, uint64_t size));
+
 struct vnode *tmpfs_link(struct vnode *vnode, struct vnode *new_vnode, uint8_t type);
 
 void tmpfs_unlink(struct vnode *vnode);
@@ -0,0 +1,70 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include "include/definitions/types.h"
+
+/*
+ * Allocation site profiler. Nothing in here is built unless _ALLOC_TRACE_ is defined (add -D_ALLOC_TRACE_ to the CFLAGS in the
+ * Makefile), without it the ALLOC_TRACE hooks in the allocators compile away to nothing.
+ *
+ * Every kmalloc, kzmalloc, umalloc, phys_alloc and phys_zalloc (and every kfree / phys_dealloc) drops a record into a per-CPU
+ * ring buffer. The rings are folded into a table of call sites whenever they get full or someone asks for a report, which is
+ * printed over serial by alloc_trace_print and can be read from /temp/procfs/alloc_trace.
+ */
+
+#define ALLOC_TRACE_RING_SIZE 1024 /* Records per CPU, must be a power of two */
+#define ALLOC_TRACE_DRAIN_THRESHOLD (ALLOC_TRACE_RING_SIZE - 64) /* A CPU folds its own ring in once it is this full */
+#define ALLOC_TRACE_MAX_SITES 512 /* Distinct call sites we can keep track of, must be a power of two */
+#define ALLOC_TRACE_MAX_LIVE 16384 /* Live allocations we can match frees against, must be a power of two */
+#define ALLOC_TRACE_TOP 16 /* How many call sites each report lists */
+#define ALLOC_TRACE_LINE_MAX 128 /* No single line of the report is longer than this */
+
+enum alloc_trace_kind {
+    ALLOC_TRACE_KMALLOC,
+    ALLOC_TRACE_KZMALLOC,
+    ALLOC_TRACE_UMALLOC,
+    ALLOC_TRACE_PHYS_ALLOC,
+    ALLOC_TRACE_FREE,
+};
+
+struct alloc_trace_record {
+    uint64_t caller;
+    uint64_t address;
+    uint64_t size;
+    uint32_t cpu;
+    uint8_t kind;
+};
+
+/*
+ * One CPU's ring. Only that CPU ever writes records and moves head, whoever holds alloc_trace_lock reads them and moves tail.
+ * Nothing is overwritten, if the ring is full the record is dropped and counted.
+ */
+struct alloc_trace_ring {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    struct alloc_trace_record records[ALLOC_TRACE_RING_SIZE];
+};
+
+struct alloc_trace_site {
+    uint64_t caller;
+    uint8_t kind; /* Which allocator this site calls */
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t live_bytes;
+    uint64_t total_bytes;
+    uint64_t window_allocations; /* Allocations since the last report, this is what the rate is worked out from */
+};
+
+#ifdef _ALLOC_TRACE_
+#define ALLOC_TRACE(kind, address, size) \
+    alloc_trace_record((kind), (uint64_t) __builtin_return_address(0), (uint64_t) (address), (size))
+#else
+#define ALLOC_TRACE(kind, address, size)
+#endif
+
+void alloc_trace_init();
+void alloc_trace_record(uint8_t kind, uint64_t caller, uint64_t address, uint64_t size);
+void alloc_trace_print();
+uint64_t alloc_trace_generate(char *buffer, uint64_t size);
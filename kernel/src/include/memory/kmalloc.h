@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+extern struct spinlock alloc_lock;
+
 void *kmalloc(uint64_t size);
 
 void *_kalloc(uint64_t size);
@@ -22,4 +24,6 @@ void *kzmalloc(uint64_t size);
 void *umalloc(uint64_t pages);
 
 void ufree(void *address);
+
+void kmalloc_print_stats();
 #endif //KERNEL_KALLOC_H
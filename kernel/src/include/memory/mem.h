@@ -6,8 +6,18 @@
 #define KERNEL_MEM_H
 #include "stddef.h"
 #include "include/definitions/string.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+extern bool mem_erms;
+extern uint64_t mem_rep_threshold;
+
+void mem_init();
 void *memset(void *dest, int ch, size_t count);
 void *memcpy(void *dest, const void *src, size_t count);
 void *memmove(void *dest, const void *src, size_t count);
 int memcmp(const void *lhs, const void *rhs, size_t count);
+void *_memcpy_words(void *dest, const void *src, size_t count);
+void *_memset_words(void *dest, int ch, size_t count);
+void clear_pages_nt(void *address, size_t pages);
 #endif //KERNEL_MEM_H
@@ -0,0 +1,10 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include "include/definitions/types.h"
+
+#define MEMINFO_LINE_MAX 256 /* No single line of the report is longer than this, generation stops once there isn't room for another */
+
+void meminfo_init();
+uint64_t meminfo_generate(char *buffer, uint64_t size);
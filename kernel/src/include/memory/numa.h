@@ -0,0 +1,41 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include "include/definitions/types.h"
+#include "include/memory/pmm.h"
+
+#define MAX_NUMA_NODES 8
+#define MAX_NUMA_RANGES 32 /* How many memory affinity ranges we will take from the firmware */
+#define NUMA_NO_NODE 0xFF /* numa_node_of_address for memory no firmware range covers */
+
+/*
+ * One physical address range and the node it belongs to, straight out of the firmware tables (the SRAT on x86)
+ */
+struct numa_memory_range {
+    uint64_t start;
+    uint64_t end;
+    uint8_t node;
+};
+
+/*
+ * Every node gets its own kernel and user pool so that memory can be handed out from the node the asking CPU sits on.
+ * Nodes are numbered densely in the order the firmware tells us about them, proximity_domain is what the firmware called it.
+ */
+struct numa_node {
+    uint32_t proximity_domain;
+    struct buddy_pool pools[2];
+    uint64_t local_allocations; /* Blocks handed to a CPU on this node (or explicitly asked for from this node) */
+    uint64_t fallback_allocations; /* Blocks handed out because the node that was asked for had nothing left */
+};
+
+extern struct numa_node numa_nodes[MAX_NUMA_NODES];
+extern uint64_t numa_node_count;
+
+uint8_t numa_add_memory_range(uint32_t proximity_domain, uint64_t base, uint64_t length);
+void numa_add_cpu(uint32_t proximity_domain, uint32_t apic_id);
+void numa_finalize();
+uint8_t numa_node_of_cpu(uint32_t apic_id);
+uint8_t numa_node_of_address(uint64_t address, uint64_t *range_end);
+uint8_t numa_local_node();
+void numa_print_stats();
@@ -11,18 +11,18 @@ extern uint64_t highest_address;
 #define KERNEL_POOL 0
 #define USER_POOL 1
 #define PAGE_SIZE 4096UL
-#define BITMAP 0
-#define BUDDY 1
 /* For buddy */
 #define MAX_ORDER 10
-#define STATIC_POOL_FLAG BIT(5) /* So we know to return to the pool not try to call kfree on it */
-#define FIRST_BLOCK_FLAG BIT(6) /* So that we dont coalesce into other areas or memory*/
-#define IN_TREE_FLAG BIT(7)
-#define STATIC_POOL_SIZE 48000UL
-#define PHYS_ZONE_COUNT 15
-#define FREE 0x1
-#define USED 0x2
-#define UNUSED 0xFFFFFFFFFFFFFFFFUL
+#define NO_FRAME 0xFFFFFFFFU /* Null index for the intrusive free lists in struct page_frame */
+#define FRAME_ALLOCATED BIT(0) /* This frame is the first page of an allocated block */
+#define FRAME_RANGE BIT(1) /* This frame is the first page of an allocation bigger than a MAX_ORDER block, see buddy_alloc_range */
+#define FRAME_SLAB BIT(2) /* This frame is the first page of a slab, see heap_cache_for */
+
+/* For the per-CPU page caches */
+#define PCP_SIZE 64 /* Size of the ring, must be a power of two */
+#define PCP_HIGH 48 /* High watermark, once a CPU is holding this many free pages it gives some back */
+#define PCP_LOW 16 /* Low watermark, how many pages are left after giving them back */
+#define PCP_BATCH 16 /* How many pages are pulled from the buddy allocator when a CPU runs dry */
 
 #define DEFAULT_SLAB_SIZE_PAGES 32
 extern uint64_t lowest_user_phys_addr;
@@ -34,7 +34,17 @@ extern uint64_t usable_pages;
 extern uint64_t page_range_index;
 int phys_init();
 void *phys_alloc(uint64_t pages,uint8_t zone);
+void *phys_alloc_node(uint64_t pages, uint8_t zone, uint8_t node);
+void *phys_alloc_contiguous(uint64_t pages, uint8_t zone);
+void *phys_zalloc(uint64_t pages,uint8_t zone);
 void phys_dealloc(void *address);
+uint64_t phys_alloc_size(void *address);
+bool phys_resize(void *address, uint64_t pages);
+void phys_page_share(void *address);
+bool phys_page_unshare(void *address);
+uint64_t phys_page_shares(void *address);
+void phys_mark_slab(void *address, bool slab);
+bool phys_is_slab(void *address);
 uint64_t next_power_of_two(uint64_t x);
 bool is_power_of_two(uint64_t x);
 bool check_phys_addr_usage(void *addr) ;
@@ -47,16 +57,54 @@ struct contiguous_page_range {
   };
 extern struct contiguous_page_range contiguous_pages[20];
 
-struct buddy_block {
-    struct buddy_block *next;
-    uint64_t zone;
-    void* start_address;
-    uint64_t flags;
+/*
+ * One of these exists for every physical page up to highest_address, indexed by page frame number (physical address / PAGE_SIZE).
+ *
+ * Only the first page of a block means anything. While the block is free, next and prev link it into the free list for its order,
+ * while it is allocated order says how big it was so phys_dealloc knows what to give back. For FRAME_RANGE allocations next
+ * instead holds how many pages were handed out.
+ */
+struct page_frame {
+    uint32_t next;
+    uint32_t prev;
     uint8_t order;
-    uint8_t is_free;
-    uint64_t buddy_chain_length;
-    uint64_t reserved;
-    uint64_t reserved_2;
+    uint8_t flags;
+    uint8_t node; /* The NUMA node this page is on, set for every page in phys_init */
+    uint32_t ref_count; /* How many address spaces besides the first one map this page, fork shares user pages copy on write */
+};
+
+/*
+ * The kernel and user pools of each NUMA node (see struct numa_node) get their own set of free lists, the buddy bitmaps are shared
+ * since the pool boundary is aligned to a MAX_ORDER block so no buddy pair can ever straddle it. Node boundaries are not aligned
+ * so buddy_free checks that separately.
+ */
+struct buddy_pool {
+    uint32_t free_list[MAX_ORDER + 1];
+    uint64_t free_blocks[MAX_ORDER + 1];
+    uint64_t free_pages;
+    uint64_t total_pages;
+    uint64_t range_allocations; /* Allocations bigger than a MAX_ORDER block, see buddy_alloc_range */
+    uint64_t range_failures;
+    uint64_t range_scan_max_words; /* The longest bitmap scan buddy_alloc_range has done, in 64 bit words */
 };
 
+/*
+ * Per-CPU cache of single free pages, one of these per pool hangs off of struct cpu. It is a ring with a hot end and a cold end,
+ * frees go on the hot end and allocations come off the hot end so recently touched pages get reused first. Pages pulled in from the
+ * buddy allocator go on the cold end, and when the cache goes over PCP_HIGH it is the cold end that is given back.
+ */
+struct per_cpu_pages {
+    uint64_t head; /* The hot end */
+    uint64_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t drains;
+    uint32_t frames[PCP_SIZE];
+};
+
+extern struct page_frame *page_frames;
+extern uint64_t page_frame_count;
+extern struct spinlock buddy_lock;
+extern struct spinlock pmm_lock; /* Guards the zeroed page pool, see zero_pool.c */
+
 #endif
\ No newline at end of file
@@ -3,49 +3,128 @@
 //
 #pragma once
 
-#include <include/drivers/serial/uart.h>
-
 #include "include/definitions/types.h"
 #include "include/definitions/definitions.h"
 
-#define NUM_SLABS 10
+#define NUM_SLABS 10 /* kmalloc size classes, these are always the first NUM_SLABS entries of slab_caches */
+#define MAX_OBJECT_CACHES 16 /* How many named object caches can be created with slab_cache_create */
+#define MAX_SLAB_CACHES (NUM_SLABS + MAX_OBJECT_CACHES)
+#define MAGAZINE_SIZE 32 /* How many objects each CPU can hold per size class before it has to give some back */
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2) /* How many objects are moved to/from the shared slab under the lock at once */
+#define SLAB_MAX_EMPTY 1 /* How many completely empty slabs a cache keeps around before handing them back to the buddy allocator */
+#define SLAB_SIZE_BYTES (DEFAULT_SLAB_SIZE_PAGES * PAGE_SIZE)
+#define SLAB_MIN_SHIFT 3 /* The smallest size class is 1 << SLAB_MIN_SHIFT bytes, each class after it doubles */
+#define SLAB_MAX_SIZE 2048 /* The largest size class, anything bigger than this does not come from a slab */
+#define SLAB_NO_OWNER UINT32_MAX /* No CPU has pulled objects from this slab into its magazine yet */
+
+/*
+ * Slabs are always SLAB_SIZE_BYTES aligned so the slab that owns any object can be found by masking off the low bits
+ */
+#define SLAB_FROM_ADDRESS(address) ((struct slab *) ((uint64_t) (address) & ~(SLAB_SIZE_BYTES - 1)))
+
 extern struct hash_table slab_hash;
 
-struct slab{
+enum slab_list {
+    SLAB_PARTIAL,
+    SLAB_FULL,
+    SLAB_EMPTY
+};
+
+/*
+ * A slab is one SLAB_SIZE_BYTES chunk of memory chopped up into objects of one size. This structure sits at the very start
+ * of the chunk itself, the objects come after it. The cache pointer must stay first since free paths only have an object
+ * address to go off of and they mask down to it.
+ *
+ * The owner is whichever CPU last refilled its magazine from this slab. Frees from any other CPU do not go into their own
+ * magazine, they are pushed onto remote_free with a compare and swap and the owner takes them back in bulk, see heap_remote_free.
+ */
+struct slab {
+    struct slab_cache *cache;
+    struct slab *next;
+    struct slab *prev;
     void **first_free;
-    uint64_t entry_size;
     void *start_address;
     void *end_address;
-} ;
+    uint64_t in_use;
+    uint64_t capacity;
+    uint8_t list;
+    uint32_t owner;
+    uint64_t remote_free; /* Lock-free stack of objects freed by other CPUs, linked through their first word */
+    struct slab *remote_next; /* Link in the owner's remote_slabs stack while remote_free is not empty */
+};
 
 /*
- * This will be used to create a more sophisticated data structure later
+ * A cache is every slab for one size class or, for caches made with slab_cache_create, one type of object. Slabs move between the partial, full and empty lists as objects come and
+ * go, allocations are always served from a partial slab first so that we fill up what we have before touching empty ones.
+ * Once a cache is holding more than SLAB_MAX_EMPTY empty slabs, the extras go back to the buddy allocator.
  */
-struct header {
-    struct slab *slab;
+struct slab_cache {
+    char *name;
+    uint64_t entry_size;
+    uint64_t align;
+    uint64_t color; /* Offset the next slab's objects will start at past the header, see heap_create_slab */
+    void (*init)(void *object); /* Optional, run on every object as it is handed out, after it has been zero'd */
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;
+    uint64_t partial_count;
+    uint64_t full_count;
+    uint64_t empty_count;
+    uint64_t objects_in_use;
+    uint64_t objects_total;
+    uint64_t slabs_created;
+    uint64_t slabs_reclaimed;
 };
 
-struct metadata {
-    uint64_t pages;
-    uint64_t size;
+/*
+ * Per-CPU magazine, one of these hangs off of struct cpu for each cache. Allocations and frees are served from here
+ * with interrupts off and no lock, the shared slab (and alloc_lock) is only touched when a magazine is empty or full
+ * and then it is done in batches of MAGAZINE_BATCH.
+ *
+ * remote_slabs is the one field other CPUs touch, it is a lock-free stack of this CPU's slabs that have had objects freed
+ * into them from elsewhere and it is only ever changed with arch_atomic_cas / arch_atomic_exchange.
+ */
+struct slab_magazine {
+    uint64_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t drains;
+    uint64_t remote_frees; /* Objects this CPU freed into slabs owned by some other CPU */
+    uint64_t remote_reclaimed; /* Objects other CPUs freed into our slabs that we have put back */
+    uint64_t remote_slabs;
+    void *objects[MAGAZINE_SIZE];
 };
 
-extern struct slab slabs[10];
+extern struct slab_cache slab_caches[MAX_SLAB_CACHES];
 
-static inline struct slab *heap_slab_for(uint64_t size) {
-    for (uint64_t i = 0; i < (sizeof(slabs) / sizeof(slabs[0])); i++) {
-        struct slab *slab = &slabs[i];
+/*
+ * Size classes are powers of two starting at 1 << SLAB_MIN_SHIFT, so the class index is just the position of the highest
+ * set bit of size - 1 (how many bits it takes to hold it) minus SLAB_MIN_SHIFT. No need to walk the caches.
+ */
+static inline struct slab_cache *heap_slab_for(uint64_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        return NULL;
+    }
 
-        if (slab->entry_size >= size) {
-            return slab;
-        }
+    if (size <= (1 << SLAB_MIN_SHIFT)) {
+        return &slab_caches[0];
     }
 
-    return NULL;
+    return &slab_caches[64 - __builtin_clzll(size - 1) - SLAB_MIN_SHIFT];
 }
 
 int heap_init();
-void heap_create_slab(struct slab *slab, uint64_t entry_size,uint64_t pages);
-void *heap_allocate_from_slab(struct slab *slab);
-void heap_free_in_slab(struct slab *slab, void *address);
-
+void heap_cache_init(struct slab_cache *cache, uint64_t entry_size);
+struct slab_cache *slab_cache_create(char *name, uint64_t size, uint64_t align, void (*init)(void *object));
+void *slab_cache_alloc(struct slab_cache *cache);
+void slab_cache_free(struct slab_cache *cache, void *object);
+struct slab_cache *heap_cache_for(void *address);
+struct slab *heap_create_slab(struct slab_cache *cache, uint64_t pages);
+void *heap_allocate_from_slab(struct slab_cache *cache);
+void heap_free_in_slab(struct slab_cache *cache, void *address);
+uint64_t _heap_reclaim();
+uint64_t heap_reclaim();
+void heap_print_stats();
+void *heap_magazine_alloc(struct slab_cache *cache);
+void heap_magazine_free(struct slab_cache *cache, void *address);
+void heap_collect_remote(struct slab_cache *cache, struct slab_magazine *magazine);
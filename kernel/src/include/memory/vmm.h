@@ -10,6 +10,7 @@
 #include "include/definitions/types.h"
 
 extern struct virt_map *kernel_pg_map;
+extern uint64_t page_table_pages;
 
 /*
  * x = value, y = align by
@@ -49,6 +50,15 @@ struct virtual_region {
     uint64_t ref_count;
     uint64_t perms;
     bool contiguous; // if not contiguous we go page by page
+    /*
+     * File backed regions (ELF segments) are not mapped up front, each page is read in from here the first time it is touched,
+     * see handle_region_fault. file_va is where the file data starts and does not have to be page aligned, anything in the
+     * region past file_va + file_size is zero filled.
+     */
+    struct vnode *file;
+    uint64_t file_va;
+    uint64_t file_offset;
+    uint64_t file_size;
 };
 
 struct virt_map {
@@ -58,6 +68,8 @@ struct virt_map {
 
 
 void arch_kvm_init(p4d_t *pgdir);
+void *page_table_alloc();
+void page_table_free(void *table);
 
 void arch_vmm_init();
 
@@ -77,6 +89,10 @@ void free_virtual_map(uint64_t *virtual_map);
 uint64_t *alloc_virtual_map();
 
 void attach_user_region(struct virt_map *map,struct virtual_region *region);
+void attach_lazy_region(struct virt_map *map, struct virtual_region *region);
+int64_t handle_region_fault(struct virt_map *map, uint64_t address);
+void copy_address_space(struct virt_map *parent, struct virt_map *child);
+int64_t handle_cow_fault(struct virt_map *map, uint64_t address);
 void arch_switch_page_table(void *top_level);
 
 
@@ -0,0 +1,30 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include <stdbool.h>
+#include "include/definitions/types.h"
+
+#define ZERO_POOL_SIZE 256 /* How many pre-zeroed pages the pool will hold at most */
+#define ZERO_POOL_LOW 64 /* Once the pool drops under this, idle CPUs will kick the worker to top it back up */
+#define ZERO_POOL_BATCH 16 /* How many pages the worker zeroes before it yields the CPU */
+
+/*
+ * A stack of kernel pool pages that have already been zeroed, a low priority kthread refills it in the background so that
+ * phys_zalloc and kzmalloc do not have to memset a page while the caller waits.
+ */
+struct zero_pool {
+    uint64_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refilled;
+    bool worker_sleeping;
+    uint64_t pages[ZERO_POOL_SIZE]; /* Physical addresses */
+};
+
+extern struct zero_pool zero_pool;
+
+void zero_pool_init();
+void *zero_pool_get();
+void zero_pool_idle();
+void zero_pool_print_stats();
@@ -6,7 +6,11 @@
 #define KTHREAD_H
 #pragma once
 #include "include/definitions/definitions.h"
+
+struct process;
 void kthread_init();
 void kthread_main();
 void kthread_work(worker_function function, void *args);
+struct process *kthread_create(worker_function function, void *args, uint8_t priority);
+void kthread_entry(worker_function function, void *args);
 #endif //KTHREAD_H
@@ -10,6 +10,7 @@
 #include "include/architecture/arch_cpu.h"
 #include "include/architecture/arch_vmm.h"
 #include "include/scheduling/process.h"
+#include "include/scheduling/timer_event.h"
 
 #define GS_BASE 0xC0000101
 #define KERNEL_GS_BASE 0xC0000102
@@ -55,10 +56,14 @@ struct process {
     uint8_t file_descriptors[16];
     uint64_t affinity;
     bool inside_kernel;
-    bool interrupt_state; //for use in saving/restoring interrupt state with spinlocks
+    bool started; /* Has been switched to before. Only the first switch to a user process goes straight out to user mode, after that it is always resumed wherever it left off in the kernel (a system call, or the timer interrupt) */
+    bool on_cpu; /* Set from when sched_run switches to it until its registers are saved again after it switches away */
+    uint64_t lock_depth; /* The CPU's lock_depth while this process was switched away, see sched_run */
+    uint64_t interrupts_before_lock; /* And its interrupts_before_lock */
     void *stack;
     void *kernel_stack;
     void *sleep_channel;
+    struct timer_event sleep_timer; /* Deadline for sched_sleep_timeout */
     struct virtual_handle_list *handle_list;
     struct virt_map *page_map;
     struct cpu *current_cpu; /* Which run queue , if any is this process on? */
@@ -86,6 +91,7 @@ struct register_state {
     uint64_t r13;
     uint64_t r14;
     uint64_t r15;
+    uint64_t user_rsp; /* Only used the first time a user process is switched to, context_switch sysrets with this as the stack */
 #endif
     bool interrupts_enabled;
 };
@@ -117,6 +123,12 @@ void exit();
 void sleep(void *channel);
 void wakeup(const void *channel);
 void set_kernel_stack(void *kernel_stack);
+void process_init();
 struct process *alloc_process(uint64_t state, bool user, struct process *parent);
 void free_process(struct process *process);
+int64_t spawn(char *path_to_executable, uint64_t flags, uint64_t aux_arguments);
+int64_t fork(uint64_t flags, uint64_t aux_arguments);
+
+extern struct slab_cache *process_cache;
+extern struct slab_cache *register_state_cache;
 #endif
@@ -5,7 +5,14 @@
 #ifndef _SCHED_H_
 #define _SCHED_H_
 
-#define BASE_QUANTUM 50 /* Base Time Quantum,  can be multiplied by task prio not sure how I'll do that yet */
+#define BASE_QUANTUM 50 /* Base Time Quantum in timer ticks, see SCHED_QUANTUM for how priority stretches it */
+#define SCHED_IDLE_MAX_MS 1000 /* The longest an idle CPU sleeps without being woken, it goes back and checks for work after this */
+
+/*
+ * How many ticks a process gets each time it is dispatched before the timer preempts it. Every step up in priority is another
+ * half of BASE_QUANTUM, so LOW gets 50 ticks and REAL_TIME gets 200.
+ */
+#define SCHED_QUANTUM(priority) (BASE_QUANTUM + (((uint64_t) (priority) * BASE_QUANTUM) / 2))
 
 enum task_priority {
     LOW = 0,
@@ -22,10 +29,14 @@ void sched_init(void);
 void sched_yield(void);
 void sched_run(void);
 void sched_preempt(void);
+void sched_tick(void);
+struct cpu;
+void sched_kick(struct cpu *cpu);
 void sched_claim_process(void);
 void sched_exit(void);
 _Noreturn void scheduler_main(void);
 void sched_sleep(void *sleep_channel);
+int64_t sched_sleep_timeout(void *sleep_channel, uint64_t millis);
 void sched_wakeup(const void *wakeup_channel);
 void global_enqueue_process(struct process *process);
 #endif
\ No newline at end of file
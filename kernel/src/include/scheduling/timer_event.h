@@ -0,0 +1,31 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include <stdbool.h>
+#include "include/definitions/types.h"
+
+/*
+ * Split out of timer_wheel.h so struct process can embed one without dragging in spinlock.h, which includes process.h itself
+ */
+
+struct timer_wheel;
+
+/*
+ * The event is embedded in whatever is waiting on it (see sleep_timer in struct process) so arming one never allocates, and
+ * pprev points at whatever points at us so we can be unlinked without knowing which list we are on.
+ */
+struct timer_event {
+    struct timer_event *next;
+    struct timer_event **pprev;
+    uint64_t expires; /* In ms on the monotonic clock */
+    void (*callback)(void *data);
+    void *data;
+    struct timer_wheel *wheel;
+    uint16_t slot;
+    bool pending;
+};
+
+void timer_event_init(struct timer_event *event, void (*callback)(void *data), void *data);
+void timer_event_arm(struct timer_event *event, uint64_t millis);
+bool timer_event_cancel(struct timer_event *event);
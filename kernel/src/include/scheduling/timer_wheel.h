@@ -0,0 +1,57 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#pragma once
+#include <stdbool.h>
+#include "include/definitions/types.h"
+#include "include/data_structures/spinlock.h"
+#include "include/scheduling/timer_event.h"
+
+/*
+ * Timer events. Kernel code can ask for a callback some number of milliseconds from now and processes can sleep with a
+ * deadline (sched_sleep_timeout), both are kept on a per-CPU hierarchical timing wheel that is advanced from the LAPIC timer
+ * interrupt.
+ *
+ * The wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots. A slot on level 0 covers 1ms, each level up every slot
+ * covers TIMER_WHEEL_LEVEL_DIVISOR times as much as the one below (1ms, 8ms, 64ms ... ~4.4 minutes on level 6), so the further
+ * away a timer is the coarser it gets, at most about 1/8th late. An event is dropped into whichever level can hold it when it
+ * is armed and never moves after that, there is no cascading down through the levels like the classic wheel does. That is
+ * what keeps everything bounded, arming and cancelling are a handful of pointer writes and a tick only ever looks at one slot
+ * per level and whatever is in it has expired, no matter how many events are pending.
+ *
+ * Events are never fired early. Anything further out than the top level can reach (TIMER_WHEEL_MAX_MS, ~4.5 hours) is capped
+ * there and fires at the cap.
+ *
+ * The wheel's clock is clock_monotonic_ns in milliseconds rather than a count of ticks, an idle CPU stops ticking and when it
+ * comes back it skips straight to the next event instead of replaying every tick it missed.
+ */
+
+#define TIMER_WHEEL_LEVELS 7
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS) /* 64 so each level's occupied slots fit in one uint64_t */
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVEL_SHIFT 3
+#define TIMER_WHEEL_LEVEL_DIVISOR (1 << TIMER_WHEEL_LEVEL_SHIFT)
+#define TIMER_WHEEL_SHIFT(level) ((level) * TIMER_WHEEL_LEVEL_SHIFT)
+#define TIMER_WHEEL_GRANULARITY(level) (1ULL << TIMER_WHEEL_SHIFT(level)) /* How many ms a slot on this level covers */
+#define TIMER_WHEEL_MAX_MS ((uint64_t) (TIMER_WHEEL_SLOTS - 2) << TIMER_WHEEL_SHIFT(TIMER_WHEEL_LEVELS - 1))
+#define TIMER_WHEEL_NO_SLOT 0xFFFF /* Not in a slot, either not armed or taken out of the wheel to be fired */
+
+struct timer_wheel {
+    struct spinlock lock;
+    uint64_t clock; /* The next ms we have not processed yet */
+    uint64_t pending; /* How many events are armed on this wheel */
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; /* Bit n set means slot n on that level has something in it */
+    struct timer_event *running; /* The event whose callback is running right now, see timer_event_cancel */
+    struct timer_event *slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+};
+
+extern struct timer_wheel timer_wheels[];
+
+void timer_wheels_init();
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void timer_wheel_insert(struct timer_wheel *wheel, struct timer_event *event, uint64_t expires);
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+uint64_t timer_wheel_next_expiry(struct timer_wheel *wheel);
+void timer_wheel_tick();
+uint64_t timer_wheel_idle_ms(uint64_t max_millis);
@@ -31,6 +31,36 @@ struct syscall_args {
 
 #define IA32_LSTAR 0xC0000082
 
+/*
+ * What syscall_entry pushes on the syscall stack before it calls system_call_dispatch, lowest address first. user_rsp is r15,
+ * which is where the user stack pointer is kept while we are in here.
+ */
+struct syscall_frame {
+    uint64_t rdi;
+    uint64_t rsi;
+    uint64_t rdx;
+    uint64_t r10;
+    uint64_t r8;
+    uint64_t r9;
+    uint64_t user_rsp;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t rbp;
+    uint64_t rbx;
+    uint64_t rflags;
+    uint64_t rip;
+};
+
+/*
+ * Only valid inside a system call, gs has been swapped so gs:0 is the top of this CPU's syscall stack
+ */
+static inline struct syscall_frame *current_syscall_frame() {
+    uint64_t stack_top;
+    asm volatile("mov %%gs:0, %0" : "=r"(stack_top));
+    return (struct syscall_frame *) (stack_top - sizeof(struct syscall_frame));
+}
+
 __attribute__((always_inline))
 extern int syscall_entry();
 
@@ -68,6 +98,8 @@ enum system_calls {
     SYS_CREATE,
     SYS_HEAP_GROW,
     SYS_HEAP_SHRINK,
+    SYS_FORK,
+    SYS_CLOCK_GETTIME,
     MAX_SYS
 };
 #endif //SYSTEM_CALLS_H
@@ -0,0 +1,307 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#ifdef _ALLOC_TRACE_
+#include "include/memory/alloc_trace.h"
+#include "include/definitions/definitions.h"
+#include "include/data_structures/spinlock.h"
+#include "include/architecture/arch_cpu.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/memory/kmalloc.h"
+#include "include/memory/pmm.h"
+#include "include/filesystem/tmpfs.h"
+#include "include/drivers/serial/uart.h"
+#include <include/drivers/display/framebuffer.h>
+
+/*
+ * Live allocations, keyed by address so that a free can be matched back up to the site that made the allocation
+ */
+struct alloc_trace_live {
+    uint64_t address;
+    uint64_t size;
+    uint32_t site;
+};
+
+static struct alloc_trace_ring alloc_trace_rings[MAX_CPUS];
+static struct alloc_trace_site alloc_trace_sites[ALLOC_TRACE_MAX_SITES];
+static struct alloc_trace_live alloc_trace_live[ALLOC_TRACE_MAX_LIVE];
+static uint64_t alloc_trace_site_count = 0;
+static uint64_t alloc_trace_untracked = 0; /* Records we had nowhere to put because a table was full */
+static uint64_t alloc_trace_window_start = 0;
+static struct spinlock alloc_trace_lock;
+
+static const char *alloc_trace_kind_names[] = {"kmalloc", "kzmalloc", "umalloc", "phys_alloc", "free"};
+
+/*
+ * Called once tmpfs is up so the report can be read as a file, records made before this are kept and show up in the first report
+ */
+void alloc_trace_init() {
+    initlock(&alloc_trace_lock, ALLOC_TRACE_LOCK);
+    alloc_trace_window_start = read_cycle_counter();
+    procfs_create_generated_file("alloc_trace", alloc_trace_generate);
+}
+
+static uint64_t alloc_trace_hash(uint64_t key) {
+    return ((key >> 3) * 0x9E3779B97F4A7C15UL) >> 32;
+}
+
+/*
+ * Find the site for this caller, adding it if this is the first time we have seen it. Open addressing, sites are never removed.
+ * Returns NULL if the table is full.
+ */
+static struct alloc_trace_site *alloc_trace_site_for(uint64_t caller, uint8_t kind) {
+    uint64_t slot = alloc_trace_hash(caller) & (ALLOC_TRACE_MAX_SITES - 1);
+
+    for (uint64_t i = 0; i < ALLOC_TRACE_MAX_SITES; i++) {
+        struct alloc_trace_site *site = &alloc_trace_sites[slot];
+
+        if (site->caller == caller) {
+            return site;
+        }
+
+        if (site->caller == 0) {
+            site->caller = caller;
+            site->kind = kind;
+            alloc_trace_site_count++;
+            return site;
+        }
+
+        slot = (slot + 1) & (ALLOC_TRACE_MAX_SITES - 1);
+    }
+
+    return NULL;
+}
+
+static struct alloc_trace_live *alloc_trace_live_find(uint64_t address) {
+    uint64_t slot = alloc_trace_hash(address) & (ALLOC_TRACE_MAX_LIVE - 1);
+
+    while (alloc_trace_live[slot].address != 0) {
+        if (alloc_trace_live[slot].address == address) {
+            return &alloc_trace_live[slot];
+        }
+        slot = (slot + 1) & (ALLOC_TRACE_MAX_LIVE - 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Linear probing with no tombstones, so removing an entry shifts anything after it in the same run back into the hole if the
+ * hole is somewhere between that entry's home slot and where it is now. Otherwise lookups would stop early at the hole.
+ */
+static void alloc_trace_live_remove(struct alloc_trace_live *entry) {
+    uint64_t hole = entry - alloc_trace_live;
+    uint64_t next = (hole + 1) & (ALLOC_TRACE_MAX_LIVE - 1);
+
+    while (alloc_trace_live[next].address != 0) {
+        const uint64_t home = alloc_trace_hash(alloc_trace_live[next].address) & (ALLOC_TRACE_MAX_LIVE - 1);
+
+        if (((next - home) & (ALLOC_TRACE_MAX_LIVE - 1)) >= ((next - hole) & (ALLOC_TRACE_MAX_LIVE - 1))) {
+            alloc_trace_live[hole] = alloc_trace_live[next];
+            hole = next;
+        }
+        next = (next + 1) & (ALLOC_TRACE_MAX_LIVE - 1);
+    }
+
+    alloc_trace_live[hole].address = 0;
+}
+
+/*
+ * Undo a live allocation, either because it was freed or because the same address came back from an allocator again which
+ * means we dropped its free somewhere along the way
+ */
+static void alloc_trace_release(struct alloc_trace_live *entry) {
+    struct alloc_trace_site *site = &alloc_trace_sites[entry->site];
+    site->frees++;
+    site->live_bytes -= entry->size;
+    alloc_trace_live_remove(entry);
+}
+
+/*
+ * Fold one record into the site and live tables. Frees of things we never saw allocated (anything from before a ring
+ * overflowed, or the second record when kfree hands a page to phys_dealloc) just do not match and are ignored.
+ */
+static void alloc_trace_account(const struct alloc_trace_record *record) {
+    if (record->address == 0) {
+        return;
+    }
+
+    struct alloc_trace_live *entry = alloc_trace_live_find(record->address);
+    if (entry != NULL) {
+        alloc_trace_release(entry);
+    }
+
+    if (record->kind == ALLOC_TRACE_FREE) {
+        return;
+    }
+
+    struct alloc_trace_site *site = alloc_trace_site_for(record->caller, record->kind);
+    if (site == NULL) {
+        alloc_trace_untracked++;
+        return;
+    }
+
+    site->allocations++;
+    site->window_allocations++;
+    site->total_bytes += record->size;
+
+    uint64_t slot = alloc_trace_hash(record->address) & (ALLOC_TRACE_MAX_LIVE - 1);
+    for (uint64_t i = 0; i < ALLOC_TRACE_MAX_LIVE; i++) {
+        if (alloc_trace_live[slot].address == 0) {
+            alloc_trace_live[slot].address = record->address;
+            alloc_trace_live[slot].size = record->size;
+            alloc_trace_live[slot].site = site - alloc_trace_sites;
+            site->live_bytes += record->size;
+            return;
+        }
+        slot = (slot + 1) & (ALLOC_TRACE_MAX_LIVE - 1);
+    }
+
+    alloc_trace_untracked++;
+}
+
+/*
+ * Consume everything in a ring, alloc_trace_lock must be held. Records are read before tail is moved past them so the owning CPU
+ * can never write over one we are still looking at.
+ */
+static void alloc_trace_drain(struct alloc_trace_ring *ring) {
+    const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    for (uint64_t tail = ring->tail; tail != head; tail++) {
+        alloc_trace_account(&ring->records[tail & (ALLOC_TRACE_RING_SIZE - 1)]);
+    }
+
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Drop a record into this CPU's ring. Interrupts are off so that nothing else on this CPU can get between reading head and
+ * moving it. If the ring is getting full this CPU folds it into the tables itself, alloc_trace_lock is never held while allocating
+ * so this is safe from inside any of the allocators.
+ */
+void alloc_trace_record(uint8_t kind, uint64_t caller, uint64_t address, uint64_t size) {
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+
+    const uint32_t cpu = bsp ? 0 : my_cpu()->cpu_id;
+    struct alloc_trace_ring *ring = &alloc_trace_rings[cpu];
+    const uint64_t head = ring->head;
+    const uint64_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (used == ALLOC_TRACE_RING_SIZE) {
+        ring->dropped++;
+    } else {
+        struct alloc_trace_record *record = &ring->records[head & (ALLOC_TRACE_RING_SIZE - 1)];
+        record->caller = caller;
+        record->address = address;
+        record->size = size;
+        record->cpu = cpu;
+        record->kind = kind;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    if (used + 1 >= ALLOC_TRACE_DRAIN_THRESHOLD) {
+        acquire_spinlock(&alloc_trace_lock);
+        alloc_trace_drain(ring);
+        release_spinlock(&alloc_trace_lock);
+    }
+
+    if (interrupts) {
+        enable_interrupts();
+    }
+}
+
+static uint64_t alloc_trace_live_key(const struct alloc_trace_site *site) {
+    return site->live_bytes;
+}
+
+static uint64_t alloc_trace_rate_key(const struct alloc_trace_site *site) {
+    return site->window_allocations;
+}
+
+/*
+ * Insertion sort the ALLOC_TRACE_TOP biggest sites by key into top, returns how many there were
+ */
+static uint64_t alloc_trace_top(uint64_t (*key)(const struct alloc_trace_site *site), uint32_t *top) {
+    uint64_t count = 0;
+
+    for (uint32_t i = 0; i < ALLOC_TRACE_MAX_SITES; i++) {
+        const struct alloc_trace_site *site = &alloc_trace_sites[i];
+        if (site->caller == 0 || key(site) == 0) {
+            continue;
+        }
+
+        uint64_t position = count < ALLOC_TRACE_TOP ? count++ : ALLOC_TRACE_TOP;
+        while (position > 0 && key(&alloc_trace_sites[top[position - 1]]) < key(site)) {
+            if (position < ALLOC_TRACE_TOP) {
+                top[position] = top[position - 1];
+            }
+            position--;
+        }
+
+        if (position < ALLOC_TRACE_TOP) {
+            top[position] = i;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Fold every CPU's ring in and write out the top call sites by live bytes and by how often they have allocated since the last
+ * report. Rates are per million cycles since we have no wall clock to go off of. Reading this starts a new rate window.
+ */
+uint64_t alloc_trace_generate(char *buffer, uint64_t size) {
+    uint32_t top[ALLOC_TRACE_TOP];
+    uint64_t length = 0;
+    uint64_t dropped = 0;
+
+    acquire_spinlock(&alloc_trace_lock);
+    for (uint64_t i = 0; i < MAX_CPUS; i++) {
+        alloc_trace_drain(&alloc_trace_rings[i]);
+        dropped += alloc_trace_rings[i].dropped;
+    }
+
+    const uint64_t now = read_cycle_counter();
+    const uint64_t window = now - alloc_trace_window_start ? now - alloc_trace_window_start : 1;
+
+    length += ksprintf(buffer + length, "sites: %i dropped records: %i untracked: %i window: %i cycles\n",
+                       alloc_trace_site_count, dropped, alloc_trace_untracked, window);
+
+    length += ksprintf(buffer + length, "top sites by live bytes:\n");
+    uint64_t count = alloc_trace_top(alloc_trace_live_key, top);
+    for (uint64_t i = 0; i < count && length + ALLOC_TRACE_LINE_MAX < size; i++) {
+        const struct alloc_trace_site *site = &alloc_trace_sites[top[i]];
+        length += ksprintf(buffer + length, "  %x.64 %s live %i bytes total %i bytes allocations %i frees %i\n",
+                           site->caller, alloc_trace_kind_names[site->kind], site->live_bytes, site->total_bytes,
+                           site->allocations, site->frees);
+    }
+
+    if (length + ALLOC_TRACE_LINE_MAX < size) {
+        length += ksprintf(buffer + length, "top sites by allocation rate:\n");
+    }
+    count = alloc_trace_top(alloc_trace_rate_key, top);
+    for (uint64_t i = 0; i < count && length + ALLOC_TRACE_LINE_MAX < size; i++) {
+        const struct alloc_trace_site *site = &alloc_trace_sites[top[i]];
+        length += ksprintf(buffer + length, "  %x.64 %s %i allocations %i per million cycles\n", site->caller,
+                           alloc_trace_kind_names[site->kind], site->window_allocations,
+                           (site->window_allocations * 1000000) / window);
+    }
+
+    for (uint64_t i = 0; i < ALLOC_TRACE_MAX_SITES; i++) {
+        alloc_trace_sites[i].window_allocations = 0;
+    }
+    alloc_trace_window_start = now;
+    release_spinlock(&alloc_trace_lock);
+
+    return length;
+}
+
+void alloc_trace_print() {
+    char *buffer = kmalloc(TMPFS_GENERATED_FILE_SIZE);
+    const uint64_t length = alloc_trace_generate(buffer, TMPFS_GENERATED_FILE_SIZE);
+    buffer[length] = '\0';
+    serial_printf("alloc trace: %s", buffer);
+    kfree(buffer);
+}
+#endif
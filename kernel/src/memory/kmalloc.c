@@ -10,12 +10,16 @@
 #include <include/drivers/display/framebuffer.h>
 
 #include "include/memory/slab.h"
+#include "include/memory/zero_pool.h"
+#include "include/memory/numa.h"
 #include "include/drivers/serial/uart.h"
 #include "include/memory/mem.h"
+#include "include/memory/alloc_trace.h"
 #include "include/architecture/arch_paging.h"
+#include "include/architecture/arch_cpu.h"
+#include "include/architecture/arch_smp.h"
 
 struct spinlock alloc_lock;
-struct spinlock userlock;
 /*
  * Init Memory for Kernel Heap.
  * Because 32 bytes is a common needed size so far in this kernel, I have allocated a metric fuckload of slab memory for it (comparatively)
@@ -23,12 +27,11 @@ struct spinlock userlock;
 int heap_init() {
     kprintf("Initializing Kernel Heap...\n");
     initlock(&alloc_lock, ALLOC_LOCK);
-    initlock(&userlock, ALLOC_LOCK);
-    int size = 8;
+    int size = 1 << SLAB_MIN_SHIFT;
     for (uint64_t i = 0; i < NUM_SLABS; i++) {
-        heap_create_slab(&slabs[i], size,DEFAULT_SLAB_SIZE_PAGES);
+        heap_cache_init(&slab_caches[i], size);
         size <<= 1;
-        if (size >= PAGE_SIZE) {
+        if (size > SLAB_MAX_SIZE) {
             break;
         }
     }
@@ -51,45 +54,67 @@ int heap_init() {
 
 // Going to entertain a higher level wrapper function for locking for the time being. If this works fine I will leave it otherwise I will
 // revisit for a more robust locking scheme
+//
+// Slab sized requests are served from the per-CPU magazines first so that the common case never touches alloc_lock,
+// during bootstrap my_cpu() is not usable yet so everything goes straight to the locked path.
+// Anything too big for a slab goes straight to phys_alloc which does its own locking.
 void *kmalloc(uint64_t size) {
-    acquire_spinlock(&alloc_lock);
-    void *ret = _kalloc(size);
-    release_spinlock(&alloc_lock);
+    void *ret;
+
+    if (size > SLAB_MAX_SIZE) {
+        ret = _kalloc(size);
+    } else if (!bsp && heap_slab_for(size) != NULL) {
+        ret = heap_magazine_alloc(heap_slab_for(size));
+    } else {
+        acquire_spinlock(&alloc_lock);
+        ret = _kalloc(size);
+        release_spinlock(&alloc_lock);
+    }
+
+    ALLOC_TRACE(ALLOC_TRACE_KMALLOC, ret, size);
     return ret;
 }
 
 /*
- *  Umalloc and free will JUST deal with physical addresses, wrapped here with a lock and so dont need to worry about specifying the zone flag when called around the codebase
+ *  Umalloc and free will JUST deal with physical addresses, wrapped here so you dont need to worry about specifying the zone flag when called around the codebase.
+ *  phys_alloc and phys_dealloc do their own locking.
  */
 void *umalloc(uint64_t pages) {
-    acquire_spinlock(&userlock);
-    void *return_value = phys_alloc(pages,USER_POOL);
-
-    if (return_value == NULL) {
-        release_spinlock(&userlock);
-        return NULL;
-    }
-    release_spinlock(&userlock);
-    return return_value;
+    void *ret = phys_alloc_node(pages, USER_POOL, numa_local_node());
+    ALLOC_TRACE(ALLOC_TRACE_UMALLOC, ret, pages * PAGE_SIZE);
+    return ret;
 }
 
 
 void ufree(void *address) {
-    acquire_spinlock(&userlock);
     phys_dealloc(address);
-    release_spinlock(&userlock);
 }
 
 /*
- * Zeros memory before passing it to you, generally there would be some sort of zero'd page cache but we don't need to go that far
- * with a hobby operating system. Just zero on demand.
+ * Zeros memory before passing it to you. Single page requests are taken from the zeroed page pool when it has something for us,
+ * anything else (or a dry pool) is just zeroed on demand.
  */
 void *kzmalloc(uint64_t size) {
-    acquire_spinlock(&alloc_lock);
-    void *ret = _kalloc(size);
-    memset(ret, 0, size);
-    // I am sure this is not the "official" way to do a kzmalloc you would have idle kthreads zeroing pages in a pool but this is fine for now
-    release_spinlock(&alloc_lock);
+    void *ret;
+
+    if (size > SLAB_MAX_SIZE) {
+        void *zeroed = size <= PAGE_SIZE ? zero_pool_get() : NULL;
+        if (zeroed != NULL) {
+            ret = Phys2Virt(zeroed);
+        } else {
+            ret = _kalloc(size);
+            memset(ret, 0, size);
+        }
+    } else if (!bsp && heap_slab_for(size) != NULL) {
+        ret = heap_magazine_alloc(heap_slab_for(size)); /* Magazine objects are already zero'd on the way out */
+    } else {
+        acquire_spinlock(&alloc_lock);
+        ret = _kalloc(size);
+        memset(ret, 0, size);
+        release_spinlock(&alloc_lock);
+    }
+
+    ALLOC_TRACE(ALLOC_TRACE_KZMALLOC, ret, size);
     return ret;
 }
 
@@ -100,16 +125,17 @@ void *kzmalloc(uint64_t size) {
  */
 void *_kalloc(uint64_t size) {
     if (size < PAGE_SIZE) {
-        struct slab *slab = heap_slab_for(size);
-        if (slab != NULL) {
-            void *addr = heap_allocate_from_slab(slab);
+        struct slab_cache *cache = heap_slab_for(size);
+        if (cache != NULL) {
+            void *addr = heap_allocate_from_slab(cache);
             return addr;
         }
     }
 
 
-    uint64_t page_count = (size + (PAGE_SIZE)) / PAGE_SIZE;
-    void *return_value = Phys2Virt(phys_alloc(page_count,KERNEL_POOL));
+    /* phys_alloc_node rather than phys_alloc so that page sized kmallocs are not traced a second time, see alloc_trace.h */
+    uint64_t page_count = (size + (PAGE_SIZE - 1)) / PAGE_SIZE;
+    void *return_value = Phys2Virt(phys_alloc_node(page_count,KERNEL_POOL, numa_local_node()));
 
     if (return_value == NULL) {
         return NULL;
@@ -133,8 +159,7 @@ void _kfree(void *address) {
     return;
 
 slab:
-    struct header *slab_header = (struct header *) ((uint64_t) address & ~((DEFAULT_SLAB_SIZE_PAGES * PAGE_SIZE) - 1));
-    heap_free_in_slab(slab_header->slab, address);
+    heap_free_in_slab(heap_cache_for(address), address);
 }
 
 /*
@@ -142,60 +167,130 @@ slab:
  * I will use this as a soapbox opportunity to say that realloc is not a safe function in a secure context. You have no
  * way to know if the memory that just deallocated was erased if there was sensitive data in it. That is always something
  * that needs to be kept in mind, and it is best to avoid realloc and to use malloc and zero yourself.
+ *
+ * Page allocations are resized in place whenever the buddy allocator can manage it (see phys_resize), how big they really are
+ * comes from the page frame array so nothing is stored in front of the memory. Slab objects only move when the new size does not
+ * fit in the object's size class anymore, shrinking a slab object never moves it.
  */
 void *krealloc(void *address, uint64_t new_size) {
-    acquire_spinlock(&alloc_lock);
     if (address == NULL) {
-        return _kalloc(new_size);
+        return kmalloc(new_size);
     }
 
-    if (((uint64_t) address & 0xFFF) == 0) {
-        struct metadata *metadata = (struct metadata *) (address - PAGE_SIZE);
-        if (((metadata->size + (PAGE_SIZE - 1)) / PAGE_SIZE) == ((new_size + (PAGE_SIZE - 1)) / PAGE_SIZE)) {
-            metadata->size = new_size;
+    acquire_spinlock(&alloc_lock);
+    uint64_t old_size;
+    const uint64_t old_pages = ((uint64_t) address & 0xFFF) ? 0 : phys_alloc_size(Virt2Phys(address));
+
+    if (old_pages != 0) {
+        const uint64_t new_pages = (new_size + (PAGE_SIZE - 1)) / PAGE_SIZE;
+        if (phys_resize(Virt2Phys(address), new_pages)) {
             release_spinlock(&alloc_lock);
+            ALLOC_TRACE(ALLOC_TRACE_FREE, address, 0);
+            ALLOC_TRACE(ALLOC_TRACE_KMALLOC, address, new_size);
             return address;
         }
-
-        void *new_address = _kalloc(new_size);
-        if (new_address == NULL) {
-            release_spinlock(&alloc_lock);
+        old_size = old_pages * PAGE_SIZE;
+    } else {
+        struct slab_cache *cache = heap_cache_for(address);
+        if (cache == NULL) {
+            panic("krealloc: not a heap address");
             return NULL;
         }
-
-        if (metadata->size > new_size) {
-            memcpy(new_address, address, new_size);
-        } else {
-            memcpy(new_address, address, metadata->size);
+        if (new_size <= cache->entry_size) {
+            release_spinlock(&alloc_lock);
+            return address;
         }
+        old_size = cache->entry_size;
+    }
 
-        _kfree(address);
+    void *new_address = _kalloc(new_size);
+    if (new_address == NULL) {
         release_spinlock(&alloc_lock);
-        return new_address;
+        return NULL;
     }
 
-    struct header *slab_header = (struct header *) ((uint64_t) address & ~0xFFF);
-    struct slab *slab = slab_header->slab;
+    memcpy(new_address, address, old_size < new_size ? old_size : new_size);
+    _kfree(address);
+    release_spinlock(&alloc_lock);
+    ALLOC_TRACE(ALLOC_TRACE_FREE, address, 0);
+    ALLOC_TRACE(ALLOC_TRACE_KMALLOC, new_address, new_size);
+    return new_address;
+}
 
-    if (new_size > slab->entry_size) {
-        void *new_address = _kalloc(new_size);
-        if (new_address == NULL) {
-            return NULL;
-        }
+/*
+ * Slab objects go back into this CPU's magazine without taking alloc_lock. Page aligned addresses go straight to phys_dealloc
+ * which sorts out whether it is a page allocation or a slab entry sitting right on a page line and locks accordingly.
+ */
+void kfree(void *address) {
+    ALLOC_TRACE(ALLOC_TRACE_FREE, address, 0);
 
-        memcpy(new_address, address, slab->entry_size);
-        heap_free_in_slab(slab, address);
-        release_spinlock(&alloc_lock);
-        return new_address;
+    if (address != NULL && ((uint64_t) address & 0xFFF) == 0) {
+        phys_dealloc(Virt2Phys(address));
+        return;
     }
-    release_spinlock(&alloc_lock);
-    return address;
-}
 
+    if (!bsp && ((uint64_t) address & 0xFFF)) {
+        struct slab_cache *cache = heap_cache_for(address);
+        if (cache != NULL) {
+            heap_magazine_free(cache, address);
+            return;
+        }
+    }
 
-void kfree(void *address) {
     acquire_spinlock(&alloc_lock);
     _kfree(address);
     release_spinlock(&alloc_lock);
 }
 
+/*
+ * Dump the per-CPU magazine counters and how contended alloc_lock has been, this is mostly so we can tell how much the
+ * magazines are actually saving us under multi-CPU load
+ */
+void kmalloc_print_stats() {
+    uint64_t total_hits = 0;
+    uint64_t total_misses = 0;
+    uint64_t total_drains = 0;
+
+    for (uint64_t i = 0; i < MAX_CPUS; i++) {
+        if (cpu_list[i].cpu_id != i) {
+            continue;
+        }
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t drains = 0;
+        uint64_t remote_frees = 0;
+        uint64_t remote_reclaimed = 0;
+
+        for (uint64_t j = 0; j < MAX_SLAB_CACHES; j++) {
+            hits += cpu_list[i].magazines[j].hits;
+            misses += cpu_list[i].magazines[j].misses;
+            drains += cpu_list[i].magazines[j].drains;
+            remote_frees += cpu_list[i].magazines[j].remote_frees;
+            remote_reclaimed += cpu_list[i].magazines[j].remote_reclaimed;
+        }
+
+        serial_printf("kmalloc: CPU %i magazine hits %i misses %i drains %i remote frees %i remote reclaimed %i\n", i,
+                      hits, misses, drains, remote_frees, remote_reclaimed);
+        for (uint64_t zone = 0; zone < 2; zone++) {
+            struct per_cpu_pages *pcp = &cpu_list[i].page_caches[zone];
+            serial_printf("kmalloc: CPU %i %s page cache hits %i misses %i drains %i holding %i\n", i,
+                          zone == KERNEL_POOL ? "kernel" : "user", pcp->hits, pcp->misses, pcp->drains, pcp->count);
+        }
+        total_hits += hits;
+        total_misses += misses;
+        total_drains += drains;
+    }
+
+    serial_printf("kmalloc: total magazine hits %i misses %i drains %i\n", total_hits, total_misses, total_drains);
+    serial_printf("kmalloc: alloc_lock acquisitions %i contended %i\n", alloc_lock.acquisitions,
+                  alloc_lock.contention_count);
+    serial_printf("kmalloc: buddy_lock acquisitions %i contended %i\n", buddy_lock.acquisitions,
+                  buddy_lock.contention_count);
+    numa_print_stats();
+    zero_pool_print_stats();
+    heap_print_stats();
+#ifdef _ALLOC_TRACE_
+    alloc_trace_print();
+#endif
+}
+
@@ -0,0 +1,239 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#include <stdint.h>
+#include <stdbool.h>
+#include "include/memory/mem.h"
+#include "include/memory/pmm.h"
+#include "include/definitions/definitions.h"
+#include "include/drivers/serial/uart.h"
+#ifdef __x86_64__
+#include "include/architecture/x86_64/asm_functions.h"
+#endif
+
+/*
+ * These used to be byte at a time loops in boot/main.c. Everything goes through here, slab and page zeroing, the framebuffer scroll,
+ * diosfs block reads and so on, so it is worth doing properly.
+ *
+ * There are two ways through each of them. The portable one moves 8 bytes at a time once the destination is aligned. On x86 CPUs
+ * that advertise ERMS (enhanced rep movsb/stosb) a plain rep movsb/stosb beats anything we can write without SSE, which we don't get in the kernel,
+ * but it has a startup cost so small requests stay on the word loops. FSRM (fast short rep mov) makes that startup cost mostly go
+ * away so the cutoff is dropped when we have it. mem_init picks all of this at boot, until then everything takes the word loops.
+ *
+ * GCC is allowed to turn a copy loop into a call to memcpy, which would be a call to ourselves, so that is switched off for this file's loops.
+ */
+#define MEM_NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+#define MEM_REP_THRESHOLD_ERMS 256 /* Below this many bytes the word loops beat rep movsb/stosb on plain ERMS */
+#define MEM_REP_THRESHOLD_FSRM 32 /* Same as above with FSRM */
+#define CPUID_LEAF_EXTENDED_FEATURES 7
+#define CPUID_ERMS BIT(9) /* ebx */
+#define CPUID_FSRM BIT(4) /* edx */
+
+typedef uint64_t __attribute__((__may_alias__)) mem_word; /* Lets us read any buffer 8 bytes at a time without angering strict aliasing */
+
+bool mem_erms = false;
+uint64_t mem_rep_threshold = UINT64_MAX;
+
+void mem_init() {
+#ifdef __x86_64__
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+
+    if (eax >= CPUID_LEAF_EXTENDED_FEATURES) {
+        cpuid(CPUID_LEAF_EXTENDED_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+        if (ebx & CPUID_ERMS) {
+            mem_erms = true;
+            mem_rep_threshold = (edx & CPUID_FSRM) ? MEM_REP_THRESHOLD_FSRM : MEM_REP_THRESHOLD_ERMS;
+        }
+    }
+#endif
+    serial_printf("mem: ERMS %s, rep string cutoff %i bytes\n", mem_erms ? "present" : "not present",
+                  mem_erms ? mem_rep_threshold : 0);
+}
+
+/*
+ * Byte copy until the destination is 8 byte aligned, then words, then whatever is left over. The source may still be misaligned,
+ * x86 doesn't care about that and it is far cheaper than shifting words around to line it up.
+ */
+MEM_NO_LIBCALL void *_memcpy_words(void *dest, const void *src, size_t count) {
+    uint8_t *pdest = dest;
+    const uint8_t *psrc = src;
+
+    while (count && ((uint64_t) pdest & 7)) {
+        *pdest++ = *psrc++;
+        count--;
+    }
+
+    while (count >= 32) {
+        ((mem_word *) pdest)[0] = ((const mem_word *) psrc)[0];
+        ((mem_word *) pdest)[1] = ((const mem_word *) psrc)[1];
+        ((mem_word *) pdest)[2] = ((const mem_word *) psrc)[2];
+        ((mem_word *) pdest)[3] = ((const mem_word *) psrc)[3];
+        pdest += 32;
+        psrc += 32;
+        count -= 32;
+    }
+
+    while (count >= 8) {
+        *(mem_word *) pdest = *(const mem_word *) psrc;
+        pdest += 8;
+        psrc += 8;
+        count -= 8;
+    }
+
+    while (count--) {
+        *pdest++ = *psrc++;
+    }
+
+    return dest;
+}
+
+MEM_NO_LIBCALL void *_memset_words(void *dest, int ch, size_t count) {
+    uint8_t *pdest = dest;
+    const uint64_t pattern = (uint8_t) ch * 0x0101010101010101ULL;
+
+    while (count && ((uint64_t) pdest & 7)) {
+        *pdest++ = (uint8_t) ch;
+        count--;
+    }
+
+    while (count >= 32) {
+        ((mem_word *) pdest)[0] = pattern;
+        ((mem_word *) pdest)[1] = pattern;
+        ((mem_word *) pdest)[2] = pattern;
+        ((mem_word *) pdest)[3] = pattern;
+        pdest += 32;
+        count -= 32;
+    }
+
+    while (count >= 8) {
+        *(mem_word *) pdest = pattern;
+        pdest += 8;
+        count -= 8;
+    }
+
+    while (count--) {
+        *pdest++ = (uint8_t) ch;
+    }
+
+    return dest;
+}
+
+/*
+ * Same as _memcpy_words but from the top down, for memmove when the destination overlaps the end of the source
+ */
+MEM_NO_LIBCALL static void *memcpy_words_backwards(void *dest, const void *src, size_t count) {
+    uint8_t *pdest = (uint8_t *) dest + count;
+    const uint8_t *psrc = (const uint8_t *) src + count;
+
+    while (count && ((uint64_t) pdest & 7)) {
+        *--pdest = *--psrc;
+        count--;
+    }
+
+    while (count >= 8) {
+        pdest -= 8;
+        psrc -= 8;
+        *(mem_word *) pdest = *(const mem_word *) psrc;
+        count -= 8;
+    }
+
+    while (count--) {
+        *--pdest = *--psrc;
+    }
+
+    return dest;
+}
+
+// GCC and Clang reserve the right to generate calls to the following 4 functions even if they are not directly called.
+void *memcpy(void *dest, const void *src, size_t count) {
+#ifdef __x86_64__
+    if (count >= mem_rep_threshold) {
+        rep_movsb(dest, src, count);
+        return dest;
+    }
+#endif
+    return _memcpy_words(dest, src, count);
+}
+
+void *memset(void *dest, int ch, size_t count) {
+#ifdef __x86_64__
+    if (count >= mem_rep_threshold) {
+        rep_stosb(dest, (uint8_t) ch, count);
+        return dest;
+    }
+#endif
+    return _memset_words(dest, ch, count);
+}
+
+/*
+ * A forward copy is fine whenever the destination is below the source, even if they overlap, since every write lands behind
+ * the reads still to come. Only a destination that overlaps the tail of the source needs to go backwards.
+ */
+void *memmove(void *dest, const void *src, size_t count) {
+    if (dest == src || count == 0) {
+        return dest;
+    }
+
+    if ((uint64_t) dest < (uint64_t) src || (uint64_t) dest >= (uint64_t) src + count) {
+        return memcpy(dest, src, count);
+    }
+
+    return memcpy_words_backwards(dest, src, count);
+}
+
+/*
+ * Compare a word at a time until we find one that differs, then work out which byte it was
+ */
+MEM_NO_LIBCALL int memcmp(const void *lhs, const void *rhs, size_t count) {
+    const uint8_t *p1 = lhs;
+    const uint8_t *p2 = rhs;
+
+    while (count >= 8 && *(const mem_word *) p1 == *(const mem_word *) p2) {
+        p1 += 8;
+        p2 += 8;
+        count -= 8;
+    }
+
+    while (count--) {
+        if (*p1 != *p2) {
+            return *p1 < *p2 ? -1 : 1;
+        }
+        p1++;
+        p2++;
+    }
+
+    return 0;
+}
+
+/*
+ * Zero whole pages with non-temporal stores so they don't push everything else out of the cache on the way. This is for pages
+ * that nobody is going to touch for a while (the zeroed page pool), for anything that is about to be used just memset it.
+ * movnti only needs general purpose registers so it is fine without SSE enabled. The sfence at the end makes sure the stores are
+ * visible before anyone else is handed the page.
+ */
+void clear_pages_nt(void *address, size_t pages) {
+#ifdef __x86_64__
+    uint64_t *pdest = address;
+    uint64_t *end = pdest + ((pages * PAGE_SIZE) / sizeof(uint64_t));
+
+    while (pdest < end) {
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)\n\t"
+                     "movnti %1, 32(%0)\n\t"
+                     "movnti %1, 40(%0)\n\t"
+                     "movnti %1, 48(%0)\n\t"
+                     "movnti %1, 56(%0)\n\t"
+                     :
+                     : "r" (pdest), "r" (0UL)
+                     : "memory");
+        pdest += 8;
+    }
+    asm volatile("sfence" ::: "memory");
+#else
+    memset(address, 0, pages * PAGE_SIZE);
+#endif
+}
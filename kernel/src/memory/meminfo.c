@@ -0,0 +1,113 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#include "include/definitions/types.h"
+#include "include/definitions/definitions.h"
+#include "include/memory/meminfo.h"
+#include "include/memory/pmm.h"
+#include "include/memory/numa.h"
+#include "include/memory/slab.h"
+#include "include/memory/vmm.h"
+#include "include/memory/zero_pool.h"
+#include "include/filesystem/tmpfs.h"
+#include "include/drivers/block/ramdisk.h"
+#include "include/architecture/arch_tlb.h"
+#include <include/architecture/arch_cpu.h>
+#include <include/drivers/display/framebuffer.h>
+
+/*
+ * /temp/procfs/meminfo, a snapshot of where all of the physical memory is going. It is rebuilt on every read (see
+ * procfs_create_generated_file) so you can just keep reading it to watch fragmentation or a leak develop.
+ *
+ * None of the allocator locks are taken here. Reading the counters racily is fine for a report like this and it means
+ * reading the file can never deadlock against an allocation happening underneath it. Everything is in pages unless it says otherwise.
+ */
+void meminfo_init() {
+    procfs_create_generated_file("meminfo", meminfo_generate);
+}
+
+/*
+ * Free block counts per order for one pool. Free pages spread across lots of low order blocks with nothing in the high
+ * orders is what fragmentation looks like.
+ */
+static uint64_t meminfo_pool(char *buffer, const uint64_t node, const char *zone_name, const struct buddy_pool *pool) {
+    uint64_t length = ksprintf(buffer, "node %i %s pool: total %i free %i free blocks by order:", node, zone_name,
+                               pool->total_pages, pool->free_pages);
+
+    for (uint64_t order = 0; order <= MAX_ORDER; order++) {
+        length += ksprintf(buffer + length, " %i", pool->free_blocks[order]);
+    }
+
+    length += ksprintf(buffer + length, " ranges %i failed %i longest scan %i words", pool->range_allocations,
+                       pool->range_failures, pool->range_scan_max_words);
+
+    buffer[length++] = '\n';
+    return length;
+}
+
+uint64_t meminfo_generate(char *buffer, uint64_t size) {
+    uint64_t length = 0;
+
+    length += ksprintf(buffer + length, "usable: %i\nallocated: %i\npage size: %i bytes\n", usable_pages,
+                       total_allocated, PAGE_SIZE);
+
+    for (uint64_t node = 0; node < numa_node_count; node++) {
+        if (length + (2 * MEMINFO_LINE_MAX) > size) {
+            goto done;
+        }
+        length += meminfo_pool(buffer + length, node, "kernel", &numa_nodes[node].pools[KERNEL_POOL]);
+        length += meminfo_pool(buffer + length, node, "user", &numa_nodes[node].pools[USER_POOL]);
+    }
+
+    for (uint64_t i = 0; i < MAX_SLAB_CACHES; i++) {
+        const struct slab_cache *cache = &slab_caches[i];
+        if (cache->entry_size == 0) {
+            continue;
+        }
+
+        if (length + MEMINFO_LINE_MAX > size) {
+            goto done;
+        }
+
+        length += ksprintf(buffer + length,
+                           "slab %s-%i: objects in use %i of %i slabs partial %i full %i empty %i created %i reclaimed %i\n",
+                           cache->name, cache->entry_size, cache->objects_in_use, cache->objects_total,
+                           cache->partial_count, cache->full_count, cache->empty_count, cache->slabs_created,
+                           cache->slabs_reclaimed);
+    }
+
+    /*
+     * Memory parked in per-CPU caches, it is free as far as anyone is concerned but the buddy allocator can't see it
+     */
+    uint64_t cached_pages = 0;
+    uint64_t cached_objects = 0;
+    for (uint64_t i = 0; i < MAX_CPUS; i++) {
+        if (cpu_list[i].cpu_id != i) {
+            continue;
+        }
+
+        cached_pages += cpu_list[i].page_caches[KERNEL_POOL].count + cpu_list[i].page_caches[USER_POOL].count;
+        for (uint64_t j = 0; j < MAX_SLAB_CACHES; j++) {
+            cached_objects += cpu_list[i].magazines[j].count;
+        }
+    }
+
+    uint64_t ramdisk_pages = 0;
+    for (uint64_t i = 0; i < RAMDISK_COUNT; i++) {
+        if (ramdisk[i].ramdisk_start != NULL) {
+            ramdisk_pages += ramdisk[i].ramdisk_size_pages;
+        }
+    }
+
+    if (length + (3 * MEMINFO_LINE_MAX) > size) {
+        goto done;
+    }
+
+    length += ksprintf(buffer + length, "per-cpu page caches: %i\nper-cpu magazine objects: %i\nzeroed page pool: %i\n",
+                       cached_pages, cached_objects, zero_pool.count);
+    length += ksprintf(buffer + length, "page tables: %i\nramdisks: %i\n", page_table_pages, ramdisk_pages);
+    length += ksprintf(buffer + length, "tlb shootdowns: %i ipis: %i\n", tlb_shootdowns, tlb_ipis_sent);
+
+done:
+    return length;
+}
@@ -0,0 +1,131 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#include "include/definitions/types.h"
+#include "include/memory/numa.h"
+#include "include/memory/pmm.h"
+#include <include/architecture/arch_cpu.h>
+#include <include/data_structures/spinlock.h>
+#include <include/drivers/display/framebuffer.h>
+#include "include/drivers/serial/uart.h"
+
+/*
+ * The firmware tables are parsed before phys_init (see srat_init) so everything in here is static, there is no heap yet.
+ *
+ * If the firmware never tells us anything, numa_finalize leaves a single node 0 that owns all memory and every CPU,
+ * which is exactly how the physical allocator behaved before it knew about nodes.
+ */
+struct numa_node numa_nodes[MAX_NUMA_NODES];
+uint64_t numa_node_count = 0;
+
+static struct numa_memory_range numa_ranges[MAX_NUMA_RANGES];
+static uint64_t numa_range_count = 0;
+
+/*
+ * Indexed by APIC ID the same way cpu_list is
+ */
+static uint8_t numa_cpu_nodes[MAX_CPUS];
+
+/*
+ * Proximity domains are whatever the firmware felt like numbering them, turn them into 0..numa_node_count
+ */
+static uint8_t numa_node_for_domain(uint32_t proximity_domain) {
+    for (uint64_t i = 0; i < numa_node_count; i++) {
+        if (numa_nodes[i].proximity_domain == proximity_domain) {
+            return i;
+        }
+    }
+
+    if (numa_node_count == MAX_NUMA_NODES) {
+        warn_printf("numa: more than %i nodes, folding proximity domain %i into node 0\n", MAX_NUMA_NODES,
+                    proximity_domain);
+        return 0;
+    }
+
+    numa_nodes[numa_node_count].proximity_domain = proximity_domain;
+    return numa_node_count++;
+}
+
+uint8_t numa_add_memory_range(uint32_t proximity_domain, uint64_t base, uint64_t length) {
+    const uint8_t node = numa_node_for_domain(proximity_domain);
+
+    if (numa_range_count == MAX_NUMA_RANGES) {
+        warn_printf("numa: too many memory ranges, ignoring range at %x.64\n", base);
+        return node;
+    }
+
+    numa_ranges[numa_range_count].start = base;
+    numa_ranges[numa_range_count].end = base + length;
+    numa_ranges[numa_range_count].node = node;
+    numa_range_count++;
+    return node;
+}
+
+void numa_add_cpu(uint32_t proximity_domain, uint32_t apic_id) {
+    const uint8_t node = numa_node_for_domain(proximity_domain);
+
+    if (apic_id >= MAX_CPUS) {
+        return;
+    }
+
+    numa_cpu_nodes[apic_id] = node;
+}
+
+/*
+ * Called by phys_init once the firmware has had its say
+ */
+void numa_finalize() {
+    if (numa_node_count == 0) {
+        numa_node_count = 1;
+    }
+}
+
+uint8_t numa_node_of_cpu(uint32_t apic_id) {
+    return apic_id < MAX_CPUS ? numa_cpu_nodes[apic_id] : 0;
+}
+
+/*
+ * Which node owns this address, range_end is set to where that stops being true so that phys_init never builds a buddy block
+ * that spans two nodes. Addresses the firmware did not mention get NUMA_NO_NODE up until the next range it did mention, it is
+ * up to the caller where those go.
+ */
+uint8_t numa_node_of_address(uint64_t address, uint64_t *range_end) {
+    uint64_t next_start = UINT64_MAX;
+
+    for (uint64_t i = 0; i < numa_range_count; i++) {
+        if (address >= numa_ranges[i].start && address < numa_ranges[i].end) {
+            *range_end = numa_ranges[i].end;
+            return numa_ranges[i].node;
+        }
+
+        if (numa_ranges[i].start > address && numa_ranges[i].start < next_start) {
+            next_start = numa_ranges[i].start;
+        }
+    }
+
+    *range_end = next_start;
+    return NUMA_NO_NODE;
+}
+
+/*
+ * The node of whichever CPU we are running on. my_cpu() is not usable during bootstrap so everything allocated then
+ * comes from node 0 first.
+ */
+uint8_t numa_local_node() {
+    if (bsp) {
+        return 0;
+    }
+
+    return my_cpu()->numa_node;
+}
+
+void numa_print_stats() {
+    for (uint64_t node = 0; node < numa_node_count; node++) {
+        const struct numa_node *numa_node = &numa_nodes[node];
+        serial_printf("numa: node %i (domain %i) kernel pool %i of %i pages free user pool %i of %i pages free local allocations %i fallback allocations %i\n",
+                      node, numa_node->proximity_domain,
+                      numa_node->pools[KERNEL_POOL].free_pages, numa_node->pools[KERNEL_POOL].total_pages,
+                      numa_node->pools[USER_POOL].free_pages, numa_node->pools[USER_POOL].total_pages,
+                      numa_node->local_allocations, numa_node->fallback_allocations);
+    }
+}
@@ -5,31 +5,40 @@
 #include "include/memory/pmm.h"
 #include <include/definitions/definitions.h>
 #include <include/architecture/arch_cpu.h>
-#include <include/data_structures/hash_table.h>
+#include <include/architecture/arch_vmm.h>
+#include <include/architecture/arch_asm_functions.h>
 #include <include/data_structures/spinlock.h>
 #include <include/drivers/display/framebuffer.h>
 #include <include/memory/kmalloc.h>
 #include <include/memory/slab.h>
+#include <include/memory/zero_pool.h>
+#include <include/memory/numa.h>
 #include "limine.h"
 #include "include/memory/mem.h"
+#include "include/memory/alloc_trace.h"
 #include "include/architecture/arch_paging.h"
 #include "include/drivers/serial/uart.h"
-#include "include/data_structures/binary_tree.h"
 
 /*
  * Static prototypes
  */
-static void buddy_coalesce(struct buddy_block *block);
+static uint32_t buddy_alloc(uint64_t order, uint8_t zone, uint8_t node);
 
-static struct buddy_block *buddy_alloc(uint64_t pages,uint8_t zone);
+static uint32_t buddy_alloc_range(uint64_t pages, uint8_t zone, uint8_t node);
 
-static void buddy_free(void *address);
+static uint32_t buddy_alloc_nodes(uint64_t pages, uint8_t zone, uint8_t preferred_node);
 
-static void buddy_block_free(struct buddy_block *block);
+static void buddy_free(uint64_t pfn);
 
-static struct buddy_block *buddy_block_get();
+static uint32_t phys_alloc_frames(uint64_t pages, uint8_t zone, uint8_t node);
 
-static struct buddy_block *buddy_split(struct buddy_block *block);
+static void buddy_free_block(uint64_t pfn, uint64_t order);
+
+static void buddy_free_range(uint64_t pfn, uint64_t pages);
+
+static uint32_t pcp_alloc(uint8_t zone);
+
+static void pcp_free(uint32_t pfn, uint8_t zone);
 
 /*
  * Bootloader requests for the memory and HHDM offset
@@ -54,21 +63,22 @@ uint64_t total_allocated = 0;
 struct spinlock pmm_lock;
 struct spinlock buddy_lock;
 
- /* will just use one zone until it's all allocated then increment the zone pointer */
-struct binary_tree buddy_free_list_zone[2];
-struct singly_linked_list spare_page_list;
+struct page_frame *page_frames;
+uint64_t page_frame_count = 0;
 
-struct buddy_block buddy_block_static_pool[STATIC_POOL_SIZE];
-// should be able to handle ~8 GB of memory in 2 << max order size blocks and the rest can be taken from a slab
-
-struct singly_linked_list unused_buddy_blocks_list;
+/*
+ * One bitmap per order, bit n of the order o bitmap is set when the block starting at page frame (n << o) is free and sitting in
+ * a free list. This is what lets us check if a buddy is free without touching any lists.
+ */
+uint64_t *buddy_bitmaps[MAX_ORDER + 1];
 
-struct static_hash_table used_buddy_hash_table;
+/*
+ * Page frames below this belong to the user pool, at or above it they belong to the kernel pool
+ */
+uint64_t user_boundary_pfn = 0;
 
 uint64_t highest_page_index = 0;
-uint64_t last_used_index = 0;
 uint64_t usable_pages = 0;
-uint64_t used_pages = 0;
 uint64_t reserved_pages = 0;
 uint64_t hhdm_offset = 0;
 uint64_t page_range_index = 0;
@@ -77,30 +87,109 @@ uint64_t page_range_index = 0;
 #define PAGE_RANGE_SIZE 20
 struct contiguous_page_range contiguous_pages[PAGE_RANGE_SIZE] = {};
 
+/*
+ * Bitmap helpers. The bitmaps are shared between every node and pool. Pools are not always serialized by the same lock (see pcp_alloc),
+ * and while no buddy pair crosses a pool boundary a single 64 bit word of a higher order bitmap can, so the updates are atomic.
+ */
+static bool buddy_bitmap_test(uint64_t order, uint64_t pfn) {
+    const uint64_t index = pfn >> order;
+    return buddy_bitmaps[order][index / 64] & BIT(index % 64);
+}
+
+static void buddy_bitmap_set(uint64_t order, uint64_t pfn) {
+    const uint64_t index = pfn >> order;
+    __atomic_fetch_or(&buddy_bitmaps[order][index / 64], BIT(index % 64), __ATOMIC_RELAXED);
+}
+
+static void buddy_bitmap_clear(uint64_t order, uint64_t pfn) {
+    const uint64_t index = pfn >> order;
+    __atomic_fetch_and(&buddy_bitmaps[order][index / 64], ~BIT(index % 64), __ATOMIC_RELAXED);
+}
+
+static uint8_t buddy_zone_of(uint64_t pfn) {
+    return pfn < user_boundary_pfn ? USER_POOL : KERNEL_POOL;
+}
 
 /*
- * This init function just goes through the memory map passed by the bootloader which is then mapped into the contiguous page ranges depending on how many there are.
- * After this a bubble sort is applied to the contiguous page range array in order from largest to smallest
- *
- * Once this is done, the static pool is filled with MAX_ORDER size buddy blocks and each buddy block struct is assigned its zone pointer, start address, next block , etc
- *
- * As of right now, my indicator for the start of a max order block is with the flag FIRST_BLOCK_FLAG being tied to the start address of the original block.
- * This is not perfect because it can allow this scenario:
- *
- * First - > second merged with third -> fourth -> Next First
- *
- * I am aware of this, and will fix this at a later date.
- *
- * After this, the binary tree buddy_free_list_zone is filled. I was originally going to have a tree for each contiguous zone however
- * I have just hardcoded the first tree for now. I have yet to make a final decision and it is not important right now so it can wait.
- *
- * All free blocks are inserted into the tree.
+ * Every frame remembers which node it is on (set in phys_init), so this is the pool of that node for the frame's zone
+ */
+static struct buddy_pool *buddy_pool_of(uint64_t pfn) {
+    return &numa_nodes[page_frames[pfn].node].pools[buddy_zone_of(pfn)];
+}
+
+/*
+ * Push a free block onto the head of its free list and mark it free in the bitmap for its order
+ */
+static void buddy_list_push(uint64_t pfn, uint64_t order) {
+    struct buddy_pool *pool = buddy_pool_of(pfn);
+    struct page_frame *frame = &page_frames[pfn];
+
+    frame->order = order;
+    frame->flags = 0;
+    frame->prev = NO_FRAME;
+    frame->next = pool->free_list[order];
+
+    if (frame->next != NO_FRAME) {
+        page_frames[frame->next].prev = pfn;
+    }
+
+    pool->free_list[order] = pfn;
+    pool->free_blocks[order]++;
+    pool->free_pages += 1 << order;
+    buddy_bitmap_set(order, pfn);
+}
+
+/*
+ * Unlink a free block from wherever it is in its free list, since the list is doubly linked this is O(1) which is what lets
+ * coalescing pull a buddy out without searching for it
+ */
+static void buddy_list_remove(uint64_t pfn, uint64_t order) {
+    struct buddy_pool *pool = buddy_pool_of(pfn);
+    struct page_frame *frame = &page_frames[pfn];
+
+    if (frame->prev != NO_FRAME) {
+        page_frames[frame->prev].next = frame->next;
+    } else {
+        pool->free_list[order] = frame->next;
+    }
+
+    if (frame->next != NO_FRAME) {
+        page_frames[frame->next].prev = frame->prev;
+    }
+
+    frame->next = NO_FRAME;
+    frame->prev = NO_FRAME;
+    pool->free_blocks[order]--;
+    pool->free_pages -= 1 << order;
+    buddy_bitmap_clear(order, pfn);
+}
+
+/*
+ * Smallest order that holds this many pages
+ */
+static uint64_t buddy_order(uint64_t pages) {
+    if (pages <= 1) {
+        return 0;
+    }
+    return 64 - __builtin_clzll(pages - 1);
+}
+
+/*
+ * This init function goes through the memory map passed by the bootloader and records every usable range in the contiguous page ranges.
  *
+ * The memory is then split into two pools, everything below USER_SPAN_SIZE (rounded down to a MAX_ORDER block) is the user pool
+ * and everything above it is the kernel pool. The kernel page tables only map the first 4GB and the kernel pool in the HHDM so keep that in mind
+ * if you change this.
  *
- * After this , the hash table is initialized. The hashmap (used_buddy_hash_table). The way it works is when a block is allocated, the start addressed is hashed and put into the table.
- * When memory is freed, the address is hashed and looked up in the hashtable to remove it.
+ * The buddy allocator's bookkeeping is one struct page_frame per page plus one bitmap per order. That is carved out of the start
+ * of the first usable range in the kernel pool that is large enough to hold it, nothing has to be statically sized anymore.
  *
+ * Each NUMA node (see numa.c, the firmware tables are read before we get here) has its own pair of pools. If the firmware did not
+ * describe any nodes, everything is node 0.
  *
+ * After that every usable range is chopped into the largest naturally aligned blocks that fit (never crossing the pool boundary
+ * or a node boundary) and they are all pushed onto the free lists of the node they are on. Since every block is aligned to its own size, a block's buddy is always just its
+ * page frame number with the order bit flipped.
  */
 uint64_t highest_address = 0;
 uint64_t highest_user_phys_addr = 0;
@@ -109,7 +198,6 @@ int phys_init() {
     kprintf("Initializing Physical Memory Manager...\n");
     initlock(&buddy_lock, BUDDY_LOCK);
     initlock(&pmm_lock, PMM_LOCK);
-    singly_linked_list_init(&spare_page_list,0);
     struct limine_memmap_response *memmap = memmap_request.response;
     struct limine_hhdm_response *hhdm = hhdm_request.response;
     struct limine_memmap_entry **entries = memmap->entries;
@@ -120,6 +208,10 @@ int phys_init() {
 
         switch (entry->type) {
             case LIMINE_MEMMAP_USABLE:
+                if (page_range_index == PAGE_RANGE_SIZE) {
+                    warn_printf("phys_init: too many usable memory ranges, ignoring range at %x.64\n", entry->base);
+                    break;
+                }
                 contiguous_pages[page_range_index].start_address = entry->base;
                 contiguous_pages[page_range_index].end_address = entry->base + entry->length;
                 contiguous_pages[page_range_index].pages = entry->length / PAGE_SIZE;
@@ -140,143 +232,122 @@ int phys_init() {
         }
     }
 
+    highest_page_index = highest_address / PAGE_SIZE;
+    page_frame_count = highest_page_index;
+    user_boundary_pfn = (USER_SPAN_SIZE / PAGE_SIZE) & ~((1UL << MAX_ORDER) - 1);
+
     /*
-     *  Quick bubble sort for the small list
+     * Figure out how much bookkeeping we need and find somewhere in the kernel pool to put it
      */
+    uint64_t metadata_size = page_frame_count * sizeof(struct page_frame);
+    for (uint64_t order = 0; order <= MAX_ORDER; order++) {
+        metadata_size += (((page_frame_count >> order) / 64) + 1) * sizeof(uint64_t);
+    }
+    const uint64_t metadata_pages = (metadata_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    void *metadata = NULL;
+    for (uint64_t i = 0; i < page_range_index; i++) {
+        const uint64_t start_pfn = (contiguous_pages[i].start_address + PAGE_SIZE - 1) / PAGE_SIZE;
+        const uint64_t end_pfn = contiguous_pages[i].end_address / PAGE_SIZE;
+
+        if (start_pfn >= user_boundary_pfn && end_pfn - start_pfn >= metadata_pages) {
+            metadata = Phys2Virt(start_pfn * PAGE_SIZE);
+            contiguous_pages[i].start_address = (start_pfn + metadata_pages) * PAGE_SIZE;
+            contiguous_pages[i].pages -= metadata_pages;
+            break;
+        }
+    }
+
+    if (metadata == NULL) {
+        panic("phys_init: no room for page frame metadata in the kernel pool");
+    }
 
-    int changes = 1;
+    memset(metadata, 0, metadata_pages * PAGE_SIZE);
+    page_frames = metadata;
+    metadata += page_frame_count * sizeof(struct page_frame);
+    for (uint64_t order = 0; order <= MAX_ORDER; order++) {
+        buddy_bitmaps[order] = metadata;
+        metadata += (((page_frame_count >> order) / 64) + 1) * sizeof(uint64_t);
+    }
 
-    while (changes) {
-        int local_changes = 0;
-        for (size_t i = 0; i < page_range_index - 1; i++) {
-            if (contiguous_pages[i].pages < contiguous_pages[i + 1].pages) {
-                struct contiguous_page_range placeholder = contiguous_pages[i];
-                contiguous_pages[i] = contiguous_pages[i + 1];
-                contiguous_pages[i + 1] = placeholder;
-                local_changes++;
+    numa_finalize();
+    for (uint64_t node = 0; node < MAX_NUMA_NODES; node++) {
+        for (uint64_t zone = 0; zone < 2; zone++) {
+            for (uint64_t order = 0; order <= MAX_ORDER; order++) {
+                numa_nodes[node].pools[zone].free_list[order] = NO_FRAME;
             }
         }
-        if (local_changes == 0) {
-            changes = 0;
-        }
     }
 
-
     /*
-     *  Set up the buddy blocks which we will use
-     *  later to replace our bitmap allocation scheme, reason being buddy
-     *  makes for easier contiguous allocation whereas bitmap or freelist can get pretty out-of-order pretty quickly
-     *
+     *  Chop each range into the biggest aligned blocks we can and put them in the free lists. Page 0 is skipped so that
+     *  a physical address of 0 is never handed out.
      */
+    uint64_t unaffined_pages = 0;
+    for (uint64_t i = 0; i < page_range_index; i++) {
+        uint64_t pfn = (contiguous_pages[i].start_address + PAGE_SIZE - 1) / PAGE_SIZE;
+        const uint64_t end_pfn = contiguous_pages[i].end_address / PAGE_SIZE;
 
-    size_t index = 0; /* Index into the static buddy block pool */
-
-    for (size_t i = 0; i < page_range_index; i++) {
-
-        if (contiguous_pages[i].pages < (1 << MAX_ORDER)){
-            for(size_t k = 0; k < contiguous_pages[i].pages; k++){
-              singly_linked_list_insert_head(&spare_page_list,(void *) contiguous_pages[i].start_address + (k * PAGE_SIZE));
-            }
-            continue;
+        if (pfn == 0) {
+            pfn = 1;
         }
 
-        for (uint64_t j = 0; j < contiguous_pages[i].pages; j += (1 << MAX_ORDER)) {
+        while (pfn < end_pfn) {
+            uint64_t limit = (pfn < user_boundary_pfn && end_pfn > user_boundary_pfn) ? user_boundary_pfn : end_pfn;
+            uint64_t node_end = UINT64_MAX;
+            uint8_t node = numa_node_of_address(pfn * PAGE_SIZE, &node_end);
 
-            /*
-             * Safety checks to avoid possibly dishing out invalid memory
-             */
-
-            //any runoff just collect it as spare pages
-            if((contiguous_pages[i].pages - j) < (1 << MAX_ORDER)){
-                for(size_t k = j; k < contiguous_pages[i].pages; k++){
-                    singly_linked_list_insert_head(&spare_page_list,(void *) contiguous_pages[i].start_address + (k * PAGE_SIZE));
-                }
-                continue;
+            if (node_end / PAGE_SIZE < limit && node_end / PAGE_SIZE > pfn) {
+                limit = node_end / PAGE_SIZE;
             }
 
+            uint64_t order = MAX_ORDER;
 
-            buddy_block_static_pool[index].start_address = (void *) (
-                contiguous_pages[i].start_address + (j * (PAGE_SIZE)) & ~(PAGE_SIZE -1));
-            buddy_block_static_pool[index].flags = STATIC_POOL_FLAG;
-
-            buddy_block_static_pool[index].order = MAX_ORDER;
-            buddy_block_static_pool[index].zone = i;
-            buddy_block_static_pool[index].is_free = FREE;
+            while (order > 0 && ((pfn & ((1UL << order) - 1)) || pfn + (1UL << order) > limit)) {
+                order--;
+            }
 
+            const uint8_t zone = buddy_zone_of(pfn);
+            if (zone == USER_POOL && lowest_user_phys_addr > pfn * PAGE_SIZE) {
+                lowest_user_phys_addr = pfn * PAGE_SIZE;
+            }
 
-            if (index != 0 && (buddy_block_static_pool[index - 1].zone == buddy_block_static_pool[index].zone)) {
-                buddy_block_static_pool[index - 1].next = &buddy_block_static_pool[index];
-                buddy_block_static_pool[index - 1].flags |= FIRST_BLOCK_FLAG;
+            /*
+             * Memory the SRAT did not cover (or all of it, if there was no SRAT) still has to live somewhere, node 0 gets it. With
+             * a SRAT this is counted and reported below since it probably means the table is missing something.
+             */
+            if (node == NUMA_NO_NODE) {
+                node = 0;
+                unaffined_pages += 1UL << order;
             }
-            index++;
-            if (index == STATIC_POOL_SIZE) {
-                kprintf("Start addr %x.64\n", buddy_block_static_pool[index - 1].start_address);
-                panic("Phys_init : Static pool size hit"); /* A panic is excessive but it's fine for now*/
+
+            for (uint64_t i = 0; i < 1UL << order; i++) {
+                page_frames[pfn + i].node = node;
             }
-        }
 
-        buddy_block_static_pool[index - 1].next = &buddy_block_static_pool[index];
-        /* Since the logic above will not apply for the last entry putting this here */
+            numa_nodes[node].pools[zone].total_pages += 1UL << order;
+            buddy_list_push(pfn, order);
+            pfn += 1UL << order;
+        }
     }
 
-    singly_linked_list_init(&unused_buddy_blocks_list, 0);
-    for (uint64_t i = index; i < STATIC_POOL_SIZE; i++) {
-        buddy_block_static_pool[i].is_free = FREE;
-        buddy_block_static_pool[i].zone = UNUSED;
+    highest_user_phys_addr = user_boundary_pfn * PAGE_SIZE;
 
-        buddy_block_static_pool[i].next = NULL;
-        buddy_block_static_pool[i].zone = UNUSED;
-        buddy_block_static_pool[i].start_address = 0;
-        buddy_block_static_pool[i].flags = STATIC_POOL_FLAG;
-        buddy_block_static_pool[i].order = UNUSED;
-
-        singly_linked_list_insert_head(&unused_buddy_blocks_list, &buddy_block_static_pool[i]);
+    uint64_t kernel_pages = 0;
+    uint64_t user_pages = 0;
+    for (uint64_t node = 0; node < numa_node_count; node++) {
+        kernel_pages += numa_nodes[node].pools[KERNEL_POOL].total_pages;
+        user_pages += numa_nodes[node].pools[USER_POOL].total_pages;
     }
 
-    /*
-     *  Set up buddy blocks and insert them into proper trees
-     */
-    index = 0;
-    init_tree(&buddy_free_list_zone[KERNEL_POOL],REGULAR_TREE, 0);
-    init_tree(&buddy_free_list_zone[USER_POOL],REGULAR_TREE, 0);
-    struct binary_tree *tree;
-
-    uint64_t kcount = 0;
-    uint64_t ucount = 0;
-    for (size_t i = 0; i < page_range_index; i++) {
-        while (buddy_block_static_pool[index].zone == i) {
-
-
-            if ((uintptr_t) buddy_block_static_pool[index].start_address > USER_SPAN_SIZE) {
-
-                tree = &buddy_free_list_zone[KERNEL_POOL];
-                buddy_block_static_pool[index].zone = KERNEL_POOL;
-                kcount++;
-            }else {
-                if(lowest_user_phys_addr > (uint64_t )buddy_block_static_pool[index].start_address ){
-                    lowest_user_phys_addr = (uint64_t )buddy_block_static_pool[index].start_address;
-                }
-                if(highest_user_phys_addr < (uint64_t )buddy_block_static_pool[index].start_address + (((1 << MAX_ORDER) * PAGE_SIZE))){
-
-                    highest_user_phys_addr = (uint64_t )buddy_block_static_pool[index].start_address + (((1 << MAX_ORDER) * PAGE_SIZE)) ;
-                }
-                tree = &buddy_free_list_zone[USER_POOL];
-                buddy_block_static_pool[index].zone = USER_POOL;
-                ucount++;
-            }
-
-
-            insert_tree_node(tree, &buddy_block_static_pool[index],
-                             buddy_block_static_pool[index].order);
-            index++;
-        }
+    info_printf("Kernel Page Pool Page Count: %i User Page Pool Page Count: %i Page Frame Metadata Pages : %i\n",
+                kernel_pages, user_pages, metadata_pages);
+    info_printf("%i NUMA Node(s)\n", numa_node_count);
+    if (unaffined_pages != 0 && unaffined_pages != kernel_pages + user_pages) {
+        warn_printf("numa: %i pages are not in any firmware memory range, they were put on node 0\n", unaffined_pages);
     }
-    info_printf("Kernel Page Pool Page Count: %i User Page Pool Page Count: %i Spare Page Count : %i\n", kcount * 1 << MAX_ORDER, ucount * 1 << MAX_ORDER,spare_page_list.node_count);
-
-    static_hash_table_init(&used_buddy_hash_table,HASH_TABLE_STATIC_POOL_SIZE);
+    numa_print_stats();
 
-    serial_printf("%i free block objects\n", unused_buddy_blocks_list.node_count);
-    highest_page_index = highest_address / PAGE_SIZE;
     uint32_t pages_mib = (usable_pages * PAGE_SIZE) >> 20;
 
     kprintf("Physical Memory Manager Initialized\n");
@@ -286,414 +357,622 @@ int phys_init() {
 }
 
 /*
- * The phys_alloc function calls buddy_alloc which attempts to find a buddy block of an appropriate size to the request in pages. It panics on failure. The block
- * is marked USED and the return value is the start address of the buddy block that was found.
+ * The phys_alloc function calls buddy_alloc which attempts to find a buddy block of an appropriate size to the request in pages. It panics on failure.
+ * The return value is the physical start address of the block that was found.
+ *
+ * Memory comes from the node of the CPU asking for it, see phys_alloc_node.
  */
 
 void *phys_alloc(uint64_t pages,uint8_t zone) {
+    void *ret = phys_alloc_node(pages, zone, numa_local_node());
+    ALLOC_TRACE(ALLOC_TRACE_PHYS_ALLOC, ret, pages * PAGE_SIZE);
+    return ret;
+}
+
+/*
+ * Allocate from the given node, falling back to the other nodes in turn if it has nothing left.
+ *
+ * Single pages for the local node come from this CPU's page cache first which does not need buddy_lock unless it has to be
+ * refilled, everything else goes to the buddy allocator under buddy_lock.
+ */
+void *phys_alloc_node(uint64_t pages, uint8_t zone, uint8_t node) {
+    const uint32_t pfn = phys_alloc_frames(pages, zone, node);
 
-    struct buddy_block *block = buddy_alloc(pages,zone);
-    if (block == NULL) {
+    if (pfn == NO_FRAME) {
         panic("phys_alloc cannot allocate");
     }
-    block->is_free = USED;
-    total_allocated += 1 << block->order;
-    void *return_value = (void *) block->start_address;
-    return return_value;
+
+    return (void *) ((uint64_t) pfn * PAGE_SIZE);
+}
+
+/*
+ * For the callers that need a big physically contiguous region (ramdisk images, NVMe PRP pools and the like) and would rather
+ * handle running out than panic. Anything over a MAX_ORDER block is sized to the page rather than rounded up to a power of two,
+ * see buddy_alloc_range for how long the search can take. Returns NULL if nothing big enough is free on any node.
+ */
+void *phys_alloc_contiguous(uint64_t pages, uint8_t zone) {
+    const uint32_t pfn = phys_alloc_frames(pages, zone, numa_local_node());
+
+    if (pfn == NO_FRAME) {
+        return NULL;
+    }
+
+    return (void *) ((uint64_t) pfn * PAGE_SIZE);
+}
+
+/*
+ * The shared part of phys_alloc_node and phys_alloc_contiguous, gives back the first page frame number or NO_FRAME
+ */
+static uint32_t phys_alloc_frames(uint64_t pages, uint8_t zone, uint8_t node) {
+    const uint64_t order = buddy_order(pages);
+    uint32_t pfn = NO_FRAME;
+
+    if (node >= numa_node_count) {
+        node = 0;
+    }
+
+    if (!bsp && order == 0 && node == numa_local_node()) {
+        pfn = pcp_alloc(zone);
+    }
+
+    if (pfn == NO_FRAME) {
+        acquire_spinlock(&buddy_lock);
+        pfn = buddy_alloc_nodes(pages, zone, node);
+        release_spinlock(&buddy_lock);
+    }
+
+    /*
+     * Before giving up, have the kernel heap give back any empty slabs it is sitting on. Slabs only ever come from the kernel pool
+     * so there is no point doing this for user allocations. This is done with buddy_lock dropped since freeing the slabs needs it.
+     */
+    if (pfn == NO_FRAME && zone == KERNEL_POOL && heap_reclaim() != 0) {
+        acquire_spinlock(&buddy_lock);
+        pfn = buddy_alloc_nodes(pages, zone, node);
+        release_spinlock(&buddy_lock);
+    }
+
+    return pfn;
 }
 /*
  * Debugging function
  */
 bool check_phys_addr_usage(void *addr) {
-    return static_hash_table_check(&used_buddy_hash_table,hash((uint64_t) addr,HASH_TABLE_STATIC_POOL_SIZE),addr);
+    const uint64_t pfn = (uint64_t) addr / PAGE_SIZE;
+    return pfn < page_frame_count && page_frames[pfn].flags & FRAME_ALLOCATED;
 }
+
 void *phys_zalloc(uint64_t pages,uint8_t zone) {
-    struct buddy_block *block = buddy_alloc(pages,zone);
-    if (block == NULL) {
-        panic("phys_alloc cannot allocate");
+    void *return_value = pages == 1 && zone == KERNEL_POOL ? zero_pool_get() : NULL;
+
+    if (return_value == NULL) {
+        return_value = phys_alloc_node(pages, zone, numa_local_node());
+        memset(Phys2Virt(return_value),0,pages * PAGE_SIZE);
     }
-    block->is_free = USED;
-    total_allocated += 1 << block->order;
-    void *return_value = (void *) block->start_address;
-    memset(Phys2Virt(return_value),0,pages * PAGE_SIZE);
+
+    ALLOC_TRACE(ALLOC_TRACE_PHYS_ALLOC, return_value, pages * PAGE_SIZE);
     return return_value;
 }
 
 /*
- * The phys_dealloc simply calls buddy_free.
+ * The phys_dealloc function gives single pages to this CPU's page cache and everything else to buddy_free.
+ *
+ * If the address is not the start of an allocated block, this means that it is a slab entry that is right on a page line.
+ * Because of this, we will invoke the slab free functions on the virtual equivalent of the passed physical address and we will return.
+ * That is checked up front so that alloc_lock is never taken while holding buddy_lock. Anything that is neither (a double free)
+ * is warned about and ignored.
  */
 void phys_dealloc(void *address) {
-    buddy_free(address);
+    const uint64_t pfn = (uint64_t) address / PAGE_SIZE;
+    ALLOC_TRACE(ALLOC_TRACE_FREE, address, 0);
+
+    if (pfn >= page_frame_count || !(page_frames[pfn].flags & FRAME_ALLOCATED)) {
+        void *virtual_address = Phys2Virt(address);
+        struct slab_cache *cache = heap_cache_for(virtual_address);
+
+        /* Not a slab object either, so this is a double free or a page that was never ours. Drop it rather than free it twice */
+        if (cache == NULL) {
+            warn_printf("phys_dealloc: %x.64 is not allocated, ignoring the free\n", address);
+            return;
+        }
+
+        acquire_spinlock(&alloc_lock);
+        heap_free_in_slab(cache, virtual_address);
+        release_spinlock(&alloc_lock);
+        return;
+    }
+
+    /* Pages from other nodes skip the page cache, it only ever holds pages local to this CPU */
+    if (!bsp && page_frames[pfn].order == 0 && !(page_frames[pfn].flags & FRAME_RANGE) &&
+        page_frames[pfn].node == numa_local_node()) {
+        pcp_free(pfn, buddy_zone_of(pfn));
+        return;
+    }
+
+    acquire_spinlock(&buddy_lock);
+    buddy_free(pfn);
+    release_spinlock(&buddy_lock);
 }
 
+/*
+ * How many pages the allocation starting at this address really owns, which can be more than was asked for since block
+ * allocations are rounded up to a power of two. The page frame array is the size table, there is nothing stored in the
+ * memory itself. Returns 0 if the address is not the start of an allocation (a slab entry that sits on a page line for example).
+ */
+uint64_t phys_alloc_size(void *address) {
+    const uint64_t pfn = (uint64_t) address / PAGE_SIZE;
+
+    if (pfn >= page_frame_count || !(page_frames[pfn].flags & FRAME_ALLOCATED)) {
+        return 0;
+    }
+
+    if (page_frames[pfn].flags & FRAME_RANGE) {
+        return page_frames[pfn].next;
+    }
+
+    return 1UL << page_frames[pfn].order;
+}
 
 /*
- *  buddy_alloc first checks what order is required to meet the page demand
- *  It will iterate from 1 to MAX_ORDER checking if this # of pages matches, or if it is between two orders.
- *  When a match is found, it will attempt to allocate the right size.
- *
- *  If the right size gets no hits it looks for
- *  right size + 1, this continues until either a block is found or MAX_ORDER is reached.
- *
- * If the block found is not the ideal size, buddy_split is called in a loop until a block of appropriate size is returned.
- *
- * When the ideal block is finally attained, the start address is hashed and inserted into the hash table so that it can be
- * found when the address is freed.
- *
- * There is a single check on if the index is bigger than the order. This is because during debugging I uncovered that one particular block ALWAYS ends up
- * in the wrong tree node. Of the counterless thousands of operations, only one address was doing this. Since it was only 1 block doing this ,
- * I just put a check for it and to remove it from the tree so that it can never be allocated which removes the issue entirely.
- * At some point I should fix it but again, it is only one block out of thousands that does this, so it is not of high importance.
- *
+ * Reference counts for user pages that are mapped by more than one address space (fork shares every user page of the parent
+ * with the child copy on write). The count is of the extra mappings so every page starts out owned by exactly one, and
+ * whoever drops a mapping calls phys_page_unshare first and only frees the page if that says nobody else has it.
  *
+ * Unsharing is a compare and swap loop rather than a plain decrement so that when the last two owners let go at the same
+ * time exactly one of them sees the count already at 0 and frees the page.
  */
+void phys_page_share(void *address) {
+    if (__atomic_fetch_add(&page_frames[(uint64_t) address / PAGE_SIZE].ref_count, 1, __ATOMIC_ACQ_REL) == UINT32_MAX) {
+        panic("phys_page_share: reference count overflow"); /* Wrapping to 0 would get the page freed while it is still mapped */
+    }
+}
 
-bool is_power_of_two(uint64_t x) {
-    return x && ((x & (x - 1)) == 0);
+/*
+ * Drop one extra reference, returns true if somebody else still maps the page (so it must not be freed) and false if the
+ * caller was the last one
+ */
+bool phys_page_unshare(void *address) {
+    uint32_t *ref_count = &page_frames[(uint64_t) address / PAGE_SIZE].ref_count;
+    uint32_t count = __atomic_load_n(ref_count, __ATOMIC_ACQUIRE);
+
+    while (count != 0) {
+        if (__atomic_compare_exchange_n(ref_count, &count, count - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-uint64_t next_power_of_two(uint64_t x) {
-    if (x == 0) {
-        return 1;
+uint64_t phys_page_shares(void *address) {
+    return __atomic_load_n(&page_frames[(uint64_t) address / PAGE_SIZE].ref_count, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The slab allocator tags the first page of every slab so that a pointer can be checked against the page frame array before
+ * anything trusts the slab header it masks down to. Slabs are never single pages so they never go through the per-CPU caches,
+ * buddy_free would clear the tag along with the rest of the flags anyway, it is cleared here first so there is no window where a
+ * freed slab still looks like one.
+ */
+void phys_mark_slab(void *address, const bool slab) {
+    const uint64_t pfn = (uint64_t) address / PAGE_SIZE;
+
+    if (slab) {
+        page_frames[pfn].flags |= FRAME_SLAB;
+    } else {
+        page_frames[pfn].flags &= ~FRAME_SLAB;
     }
-    x--;
-    x |= x >> 1;
-    x |= x >> 2;
-    x |= x >> 4;
-    x |= x >> 8;
-    x |= x >> 16;
-    x |= x >> 32;
+}
 
-    return x + 1;
+bool phys_is_slab(void *address) {
+    const uint64_t pfn = (uint64_t) address / PAGE_SIZE;
+    return pfn < page_frame_count && (page_frames[pfn].flags & (FRAME_ALLOCATED | FRAME_SLAB)) == (FRAME_ALLOCATED | FRAME_SLAB);
 }
 
 /*
- * My approach for tall orders is as follows :
- *
- * Alloc MAX_ORDER buddy block, and iterate through all of its MAX_ORDER blocks in the chain until there is enough to satisfy the order.
+ * Try to make the allocation at address hold pages pages without moving it, returns whether that worked.
  *
- * The number of max order blocks is stored in the start block's buddy_chain_length field
+ * Shrinking always works. A block gives its upper halves back until it is the smallest order that still fits, a range just
+ * gives back its tail.
  *
- * Freeing will just require an iterative approach to free everything and add it to the binary search tree
+ * Growing only works for blocks and only when the block is the lower half of each buddy pair on the way up to the order we
+ * need and every one of those upper buddies is free. The buddy at order o of a block aligned to 2^(o + 1) can not be part of a
+ * bigger free block (that block would have to contain us), so the order o bitmap alone says whether it is free. Everything
+ * is checked before anything is taken so a failure leaves the allocation exactly as it was. Ranges and anything that would
+ * need to go past MAX_ORDER are never grown, the caller has to allocate and copy.
  */
+bool phys_resize(void *address, uint64_t pages) {
+    const uint64_t pfn = (uint64_t) address / PAGE_SIZE;
 
-static struct buddy_block *buddy_alloc_large_range(uint64_t pages, uint8_t zone) {
-    uint64_t retry_count = 0;
-    uint64_t max_blocks = pages / (1 << MAX_ORDER) + (pages % 1 << MAX_ORDER != 0);
-    struct buddy_block *block = NULL;
-retry:
-
-    /*
-     *  Since this will loop forever if there is not enough contiguous memory, put some arbitrary 'give up' number as we will call it.
-     *  Doesn't matter what the number is.
-     */
-    if(retry_count > 500){
-        panic("Cannot allocate a large enough contiguous span of memory!");
+    if (pfn >= page_frame_count || !(page_frames[pfn].flags & FRAME_ALLOCATED) || pages == 0) {
+        return false;
     }
-    retry_count++;
-    uint64_t current_blocks = 1;
-    block = lookup_tree(&buddy_free_list_zone[zone], MAX_ORDER,REMOVE_FROM_TREE);
-    struct buddy_block *pointer = block;
 
-    if (!block) {
-        goto retry;
-    }
+    struct page_frame *frame = &page_frames[pfn];
+    bool resized = true;
+    acquire_spinlock(&buddy_lock);
 
-    if (block->order != MAX_ORDER) {
-        while (block != NULL && block->order != MAX_ORDER) {
-            block = lookup_tree(&buddy_free_list_zone[zone], MAX_ORDER,REMOVE_FROM_TREE);
+    if (frame->flags & FRAME_RANGE) {
+        if (pages <= frame->next) {
+            buddy_free_range(pfn + pages, frame->next - pages);
+            total_allocated -= frame->next - pages;
+            frame->next = pages;
+        } else {
+            resized = false;
         }
+        goto done;
     }
 
-    if (!block) {
-        goto retry;
-    }
-    while (pointer->next->order == MAX_ORDER && current_blocks < max_blocks && pointer->zone == pointer->next->zone) {
-        pointer = pointer->next;
-        current_blocks++;
-    }
+    uint64_t order = frame->order;
+    const uint64_t target = buddy_order(pages);
 
-    if (current_blocks < max_blocks) {
-        insert_tree_node(&buddy_free_list_zone[zone], block, block->order);
-        /* Since it will be inserted at the tail we can do this and it wont keep grabbing the same block*/
-        goto retry;
-    }
-    block->buddy_chain_length = max_blocks;
-    block->flags &= ~IN_TREE_FLAG;
-    current_blocks = 2;
-    pointer = block->next;
-    while (current_blocks <= max_blocks) {
-        remove_tree_node(&buddy_free_list_zone[zone], pointer->order, pointer,NULL);
-        pointer->is_free = USED;
-        pointer = pointer->next;
-        current_blocks++;
+    if (target <= order) {
+        while (order > target) {
+            order--;
+            buddy_list_push(pfn + (1UL << order), order);
+            total_allocated -= 1UL << order;
+        }
+        frame->order = order;
+        goto done;
     }
 
-    total_allocated += (1 << MAX_ORDER) * block->buddy_chain_length;
+    if (target > MAX_ORDER) {
+        resized = false;
+        goto done;
+    }
 
-    return block;
-}
+    for (uint64_t current = order; current < target; current++) {
+        const uint64_t buddy = pfn + (1UL << current);
 
-static struct buddy_block *buddy_alloc(uint64_t pages,uint8_t zone) {
-    if (pages > (1 << MAX_ORDER)) {
-        return buddy_alloc_large_range(pages,zone);
+        if ((pfn & ((1UL << (current + 1)) - 1)) || buddy >= page_frame_count || !buddy_bitmap_test(current, buddy) ||
+            page_frames[buddy].node != frame->node) {
+            resized = false;
+            goto done;
+        }
     }
 
-    if (!is_power_of_two(pages)) {
-        pages = next_power_of_two(pages);
+    for (uint64_t current = order; current < target; current++) {
+        buddy_list_remove(pfn + (1UL << current), current);
+        total_allocated += 1UL << current;
     }
+    frame->order = target;
 
-    for (uint64_t i = 0; i < MAX_ORDER; i++) {
-        if (pages == (1 << i)) {
-            struct buddy_block *block = lookup_tree(&buddy_free_list_zone[zone], i,REMOVE_FROM_TREE);
+done:
+    release_spinlock(&buddy_lock);
+    return resized;
+}
 
-            if (block == NULL) {
-                uint64_t index = i + 1;
+/*
+ * Ring helpers for the per-CPU page caches, see struct per_cpu_pages. Interrupts need to be off around these.
+ *
+ * A page sitting in a cache is free as far as everyone else is concerned, so its flags are cleared on the way in and
+ * FRAME_ALLOCATED only goes back on when it is handed out again. Otherwise phys_dealloc would take a second free of the same
+ * page and two allocations would end up sharing it. Pages popped off the cold end are going straight to buddy_free which
+ * does not look at FRAME_ALLOCATED.
+ */
+static void pcp_push_hot(struct per_cpu_pages *pcp, uint32_t pfn) {
+    page_frames[pfn].flags = 0;
+    pcp->head = (pcp->head + 1) & (PCP_SIZE - 1);
+    pcp->frames[pcp->head] = pfn;
+    pcp->count++;
+}
 
-                while (index <= MAX_ORDER) {
-                    block = lookup_tree(&buddy_free_list_zone[zone], index,REMOVE_FROM_TREE);
+static uint32_t pcp_pop_hot(struct per_cpu_pages *pcp) {
+    const uint32_t pfn = pcp->frames[pcp->head];
+    pcp->head = (pcp->head - 1) & (PCP_SIZE - 1);
+    pcp->count--;
+    page_frames[pfn].flags = FRAME_ALLOCATED;
+    return pfn;
+}
 
-                    if (block != NULL && block->start_address && block->order >= index) {
-                        block->flags &= ~IN_TREE_FLAG;
-                        while (block->order != i) {
-                            if (block->order > MAX_ORDER) {
-                                serial_printf("block->order = %i block addr = %x.64 block start addr = %x.64\n",
-                                              block->order, block, block->start_address);
-                                panic("order higher than max order in buddy_alloc");
-                            }
-                            block = buddy_split(block);
-                            if (block == NULL) {
-                                panic("buddy_alloc cannot split block");
-                            }
-                        }
+static void pcp_push_cold(struct per_cpu_pages *pcp, uint32_t pfn) {
+    page_frames[pfn].flags = 0;
+    pcp->frames[(pcp->head - pcp->count) & (PCP_SIZE - 1)] = pfn;
+    pcp->count++;
+}
 
-                        static_hash_table_insert(&used_buddy_hash_table, (uint64_t) block->start_address, block);
-                        return block;
-                    }
-                    //find out where pointers are being manipulated so I can take this out
-                    /*
-                     * Note : there is only one
-                     */
+static uint32_t pcp_pop_cold(struct per_cpu_pages *pcp) {
+    const uint32_t pfn = pcp->frames[(pcp->head - pcp->count + 1) & (PCP_SIZE - 1)];
+    pcp->count--;
+    return pfn;
+}
 
-                    if (block != NULL && block->order < index) {
-                        remove_tree_node(&buddy_free_list_zone[zone], index, block,NULL);
-                        continue;
-                    }
-                    index++;
-                }
-            } else {
-                static_hash_table_insert(&used_buddy_hash_table, (uint64_t) block->start_address, block);
-                block->flags &= ~IN_TREE_FLAG;
-                return block;
+/*
+ * Take a page off the hot end of this CPU's cache. If the cache is empty, PCP_BATCH pages are pulled out of the buddy allocator
+ * under buddy_lock in one go so the next PCP_BATCH - 1 allocations on this CPU do not need the lock at all. Refills only come from
+ * this CPU's own node, if it is out of pages phys_alloc_node will go looking on the other nodes itself.
+ */
+static uint32_t pcp_alloc(uint8_t zone) {
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+    struct per_cpu_pages *pcp = &my_cpu()->page_caches[zone];
+
+    if (pcp->count == 0) {
+        pcp->misses++;
+        const uint8_t node = my_cpu()->numa_node;
+        acquire_spinlock(&buddy_lock);
+        for (uint64_t i = 0; i < PCP_BATCH; i++) {
+            const uint32_t pfn = buddy_alloc(0, zone, node);
+            if (pfn == NO_FRAME) {
+                break;
             }
+            pcp_push_cold(pcp, pfn);
         }
+        release_spinlock(&buddy_lock);
+    } else {
+        pcp->hits++;
+    }
+
+    const uint32_t pfn = pcp->count != 0 ? pcp_pop_hot(pcp) : NO_FRAME;
+
+    /*
+     * Counted per page handed out rather than per page pulled in by a refill, the same as buddy_alloc_nodes counts them. This is
+     * outside buddy_lock so it is atomic, every CPU on the node bumps the same counter.
+     */
+    if (pfn != NO_FRAME) {
+        __atomic_fetch_add(&numa_nodes[my_cpu()->numa_node].local_allocations, 1, __ATOMIC_RELAXED);
     }
 
-    return NULL;
+    if (interrupts) {
+        enable_interrupts();
+    }
+    return pfn;
 }
 
 /*
- * The buddy_free function is relatively simple.
- * It looks up the address in the hash table.
- * The hash table returns the bucket rather than the entry. This may change in the future.
- * Because of that, a loop to find the address in the hash bucket is provided in this function.
- * Once it is found, buddy_coalesce is called, the function returns.
+ * Put a page on the hot end of this CPU's cache. Once the cache hits the high watermark the cold end is given back to the
+ * buddy allocator until it is down to the low watermark.
  */
-static void buddy_free(void *address) {
-    struct singly_linked_list *bucket = static_hash_table_retrieve(&used_buddy_hash_table,
-                                                            hash((uint64_t) address, HASH_TABLE_STATIC_POOL_SIZE));
+static void pcp_free(uint32_t pfn, uint8_t zone) {
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+    struct per_cpu_pages *pcp = &my_cpu()->page_caches[zone];
+
+    pcp_push_hot(pcp, pfn);
+
+    if (pcp->count >= PCP_HIGH) {
+        pcp->drains++;
+        acquire_spinlock(&buddy_lock);
+        while (pcp->count > PCP_LOW) {
+            buddy_free(pcp_pop_cold(pcp));
+        }
+        release_spinlock(&buddy_lock);
+    }
 
-    if (bucket == NULL) {
-        panic("Buddy Dealloc: Buddy hash table not found");
-        /* Shouldn't ever happen so panicking for visibility if it does happen */
+    if (interrupts) {
+        enable_interrupts();
     }
+}
 
-    struct singly_linked_list_node *node = bucket->head;
+bool is_power_of_two(uint64_t x) {
+    return x && ((x & (x - 1)) == 0);
+}
 
-    while (1) {
-        if (node == NULL) {
-            /*
-             *
-             * If the node cannot be found in the hash bucket, this means that it is a slab entry that is right on a page line.
-             * Because of this, if we do not find the address in the hash bucket we will invoke the slab free functions on the virtual
-             * equivalent of the passed physical address and we will return
-             *
-             */
-            struct header *slab_header = (struct header *) (
-                (uint64_t) Phys2Virt(address) & ~((DEFAULT_SLAB_SIZE_PAGES * PAGE_SIZE) - 1));
-            heap_free_in_slab(slab_header->slab, Phys2Virt(address));
-            return;
-        }
-        struct buddy_block *block = node->data;
+uint64_t next_power_of_two(uint64_t x) {
+    if (x == 0) {
+        return 1;
+    }
+    x--;
+    x |= x >> 1;
+    x |= x >> 2;
+    x |= x >> 4;
+    x |= x >> 8;
+    x |= x >> 16;
+    x |= x >> 32;
 
-        if ((uint64_t) block->start_address == (uint64_t) address) {
-            uint64_t ret = singly_linked_list_remove_node_by_address(bucket, block);
-            if (ret == NODE_NOT_FOUND) {
-                panic("Buddy Dealloc: Address not found");
-            }
-            block->is_free = FREE;
-            block->flags &= ~IN_TREE_FLAG;
-            total_allocated -= 1 << block->order;
-            buddy_coalesce(block);
-            return;
-        }
+    return x + 1;
+}
 
-        node = node->next;
+/*
+ *  buddy_alloc takes the first block off the free list of the requested order. If that list is empty it moves up an order at a time
+ *  until it finds something, then splits it back down. Every split puts the upper half on the free list one order below so by the time
+ *  we get back down to the order that was asked for, all of the leftovers are already where they belong.
+ *
+ *  At most MAX_ORDER steps each way and no allocations of its own.
+ */
+static uint32_t buddy_alloc(uint64_t order, uint8_t zone, uint8_t node) {
+    struct buddy_pool *pool = &numa_nodes[node].pools[zone];
+    uint64_t current_order = order;
+
+    while (current_order <= MAX_ORDER && pool->free_list[current_order] == NO_FRAME) {
+        current_order++;
+    }
+
+    if (current_order > MAX_ORDER) {
+        return NO_FRAME;
     }
+
+    const uint32_t pfn = pool->free_list[current_order];
+    buddy_list_remove(pfn, current_order);
+
+    while (current_order > order) {
+        current_order--;
+        buddy_list_push(pfn + (1UL << current_order), current_order);
+    }
+
+    page_frames[pfn].order = order;
+    page_frames[pfn].flags = FRAME_ALLOCATED;
+    total_allocated += 1 << order;
+    return pfn;
 }
 
 /*
- *  buddy_split takes a block and splits it in two.
+ * Anything bigger than a MAX_ORDER block is a range: a run of free MAX_ORDER blocks that sit next to each other.
  *
- *  It first ensures that the block is not in the free tree (it should never be there but its just for sanity)
+ * Since the MAX_ORDER bitmap is indexed by address, consecutive set bits are physically contiguous blocks, so this is a
+ * search for a long enough run of set bits. It is done a 64 bit word at a time, words with nothing free are skipped whole and
+ * words that are completely free are added to the run whole, only words with a mix get looked at bit by bit. That puts a hard bound
+ * on how long this can take: one pass over the pool's part of the bitmap, which is (pool pages >> MAX_ORDER) / 64 words,
+ * 256 words for a 64GiB pool, and no more than 64 bit tests for each of those. Nothing is ever moved around to make room, if there is
+ * no run long enough we fail and the caller decides what to do. The longest scan seen is kept in the pool so the bound can be checked.
  *
- *  It ensures the block isnt 0 because of course a page can't be split.
+ * The bitmap is shared by every node so blocks that belong to some other node break the run like allocated ones do. Whole free words
+ * skip that check so it is done over the run once it is found.
  *
- *  It ensured that the block is not USED
- *
- *  It calls buddy_block_get to get a spare buddy_block object
- *
- *  It fills in the new block as the buddy of the first, altering the start address and order
- *
- *  It puts the new block into the free tree, and returns the original, now split in half block
+ * Only as many pages as were asked for are kept, the unused tail of the last block goes straight back to the free lists. The
+ * head frame is marked as a range and holds the page count so phys_dealloc can give back exactly that.
  */
-static struct buddy_block *buddy_split(struct buddy_block *block) {
-    if (block->flags & IN_TREE_FLAG) {
-        remove_tree_node(&buddy_free_list_zone[block->zone], block->order, block,NULL);
-        block->flags &= ~IN_TREE_FLAG;
-    }
-    if (block->order > MAX_ORDER) {
-        panic("Buddy Split : Illegal Block order");
-    }
-    if (block->order == 0) {
-        panic("Buddy Split: Trying to split 0");
-        return NULL; /* Can't split a zero order */
-    }
+static uint32_t buddy_alloc_range(uint64_t pages, uint8_t zone, uint8_t node) {
+    struct buddy_pool *pool = &numa_nodes[node].pools[zone];
+    const uint64_t blocks = (pages + (1 << MAX_ORDER) - 1) >> MAX_ORDER;
+    const uint64_t first = zone == USER_POOL ? 0 : user_boundary_pfn >> MAX_ORDER;
+    const uint64_t last = zone == USER_POOL ? user_boundary_pfn >> MAX_ORDER : page_frame_count >> MAX_ORDER;
+    uint64_t index = first;
+    uint64_t run = 0;
+    uint64_t words = 0;
+    uint32_t head = NO_FRAME;
+
+    while (index < last && head == NO_FRAME) {
+        const uint64_t bit = index % 64;
+        const uint64_t available = (64 - bit) < (last - index) ? (64 - bit) : (last - index);
+        const uint64_t mask = available == 64 ? UINT64_MAX : BIT(available) - 1;
+        const uint64_t bits = (buddy_bitmaps[MAX_ORDER][index / 64] >> bit) & mask;
+        words++;
+
+        if (bits == 0) {
+            run = 0;
+            index += available;
+            continue;
+        }
 
-    if (block->is_free == USED) {
-        return NULL; /* Obviously */
-    }
+        if (bits == mask && run + available < blocks) {
+            run += available;
+            index += available;
+            continue;
+        }
 
-    struct buddy_block *new_block = buddy_block_get();
+        for (uint64_t i = 0; i < available; i++, index++) {
+            if (!(bits & BIT(i)) || page_frames[index << MAX_ORDER].node != node) {
+                run = 0;
+                continue;
+            }
 
-    if (new_block == NULL) {
-        return NULL;
-    }
+            if (++run < blocks) {
+                continue;
+            }
+
+            /* Whole words were taken on trust, make sure every block in the run is really ours */
+            uint64_t start = index + 1 - blocks;
+            for (uint64_t j = index + 1; j > start; j--) {
+                if (page_frames[(j - 1) << MAX_ORDER].node != node) {
+                    run = index - (j - 1);
+                    break;
+                }
+            }
 
-    new_block->next = block->next;
-    block->next = new_block;
-    block->order--;
-    new_block->order = block->order;
-    new_block->start_address = block->start_address + (((1 << block->order) * PAGE_SIZE));
-    new_block->zone = block->zone;
-    new_block->is_free = FREE;
+            if (run == blocks) {
+                head = start << MAX_ORDER;
+                break;
+            }
+        }
+    }
 
+    if (words > pool->range_scan_max_words) {
+        pool->range_scan_max_words = words;
+    }
 
-    new_block->flags |= IN_TREE_FLAG;
-    const uint64_t ret = insert_tree_node(&buddy_free_list_zone[block->zone], new_block, new_block->order);
+    if (head == NO_FRAME) {
+        pool->range_failures++;
+        return NO_FRAME;
+    }
 
-    if (ret == KERN_SUCCESS) {
-        return block;
-    } else {
-        panic("NULL");
+    for (uint64_t i = 0; i < blocks; i++) {
+        buddy_list_remove(head + (i << MAX_ORDER), MAX_ORDER);
     }
 
-    return NULL;
+    buddy_free_range(head + pages, (blocks << MAX_ORDER) - pages);
+
+    page_frames[head].order = MAX_ORDER;
+    page_frames[head].flags = FRAME_ALLOCATED | FRAME_RANGE;
+    page_frames[head].next = pages;
+    pool->range_allocations++;
+    total_allocated += pages;
+    return head;
 }
 
 /*
- * This function just attempts to get a spare block from the static pool list
- * If none is found, kalloc is invoked in instead.
+ * The buddy_free function takes the head of an allocated block (phys_dealloc has already checked that it is one) and gives it back.
  */
-static struct buddy_block *buddy_block_get() {
-    struct buddy_block *block = (struct buddy_block *) singly_linked_list_remove_head(&unused_buddy_blocks_list);
-    if (block == NULL) {
-        struct buddy_block *ret = _kalloc(sizeof(struct buddy_block));
-        return ret;
+static void buddy_free(uint64_t pfn) {
+    struct page_frame *frame = &page_frames[pfn];
+
+    if (frame->flags & FRAME_RANGE) {
+        const uint64_t pages = frame->next;
+        frame->flags = 0;
+        buddy_free_range(pfn, pages);
+        total_allocated -= pages;
+        return;
     }
-    return block;
+
+    const uint64_t order = frame->order;
+    frame->flags = 0;
+    total_allocated -= 1 << order;
+    buddy_free_block(pfn, order);
 }
 
 /*
- * This function first does a sanity check ensuring that the block is not in a tree (this is a remnant of debugging , its not needed anymore but why not)
- *
- *If the block has the static pool flag, all values are set to 0 / NULL / UNUSED accordingly and inserted into the free list of static blocks
- *
- * If not, _kfree( is invoked.
+ * Free a block and merge it with its buddy for as long as its buddy is free, checking the bitmap one order up each time.
+ * Because blocks never cross the pool boundary and MAX_ORDER blocks are never merged, the only other thing to check is that the
+ * buddy is on the same node, node boundaries do not have to be aligned to anything.
  */
-static void buddy_block_free(struct buddy_block *block) {
-    if (block->flags & IN_TREE_FLAG) {
-        remove_tree_node(&buddy_free_list_zone[block->zone], block->order, block,NULL);
-    }
-    if (block->flags & STATIC_POOL_FLAG) {
-        block->is_free = UNUSED;
-        block->order = UNUSED;
-        block->zone = UNUSED;
-        block->start_address = 0;
-        block->next = NULL;
-        block->flags = STATIC_POOL_FLAG;
-        block->buddy_chain_length = 0;
-        singly_linked_list_insert_head(&unused_buddy_blocks_list, block);
-        return;
+static void buddy_free_block(uint64_t pfn, uint64_t order) {
+    const uint8_t node = page_frames[pfn].node;
+
+    while (order < MAX_ORDER) {
+        const uint64_t buddy = pfn ^ (1UL << order);
+
+        if (buddy >= page_frame_count || !buddy_bitmap_test(order, buddy) || page_frames[buddy].node != node) {
+            break;
+        }
+
+        buddy_list_remove(buddy, order);
+        pfn = pfn < buddy ? pfn : buddy;
+        order++;
     }
-    _kfree(block);
+
+    buddy_list_push(pfn, order);
 }
 
 /*
- *  This assumes the block passed to the function is not currently in a free-tree, if it is then it will cause issues commenting this now
- *  in case it becomes an issue later
+ * Free an arbitrary run of pages by chopping it into the biggest aligned blocks that fit, the same way phys_init does, and
+ * freeing each of those
  */
+static void buddy_free_range(uint64_t pfn, uint64_t pages) {
+    const uint64_t end = pfn + pages;
 
+    while (pfn < end) {
+        uint64_t order = MAX_ORDER;
 
-/*
- *This function tries to merge this block with the next block if it is free.
- *
- *Basic sanity checks, if the next block is NULL (miniscule chance but we check anyway) it is put into the free tree.
- *
- *If it is of order MAX_ORDER , it is put back in the tree.
- *
- *If the order of this block and the next, the is_free status of this block and the next, the zone (contiguous area of memory)
- *of this block and the next are ALL the same AND the next block does not have the FIRST_BLOCK_FLAG (it is the beginning of a MAX_ORDER area)
- *then merge the two blocks.
- *
- *AS-IS this is a naive implementation because as mentioned above it is possible to end up with blocks between boundaries merging inappropriately.
- *I will fix this at some point, but in terms of actual problems that will cause in practical terms it is next to zero. You would need to be using essentially all of the available memory and try
- *to make a large allocation for this to cause problems.
- */
+        while (order > 0 && ((pfn & ((1UL << order) - 1)) || pfn + (1UL << order) > end)) {
+            order--;
+        }
 
-static void buddy_coalesce(struct buddy_block *block) {
-    if (block == NULL) {
-        return;
+        buddy_free_block(pfn, order);
+        pfn += 1UL << order;
     }
+}
 
-    if (block->next == NULL) {
-        block->flags |= IN_TREE_FLAG;
-        insert_tree_node(&buddy_free_list_zone[block->zone], block, block->order);
-        /*
-         *  Can't coalesce until the predecessor is free
-         */
-        return;
-    }
+/*
+ * Try the preferred node first then every other node in turn. Fallbacks are counted against the node that ended up serving the
+ * request so that it is easy to see when a node is running dry. Called with buddy_lock held.
+ */
+static uint32_t buddy_alloc_nodes(uint64_t pages, uint8_t zone, uint8_t preferred_node) {
+    for (uint64_t i = 0; i < numa_node_count; i++) {
+        const uint8_t node = (preferred_node + i) % numa_node_count;
+        const uint32_t pfn = pages > (1 << MAX_ORDER)
+                                 ? buddy_alloc_range(pages, zone, node)
+                                 : buddy_alloc(buddy_order(pages), zone, node);
+
+        if (pfn == NO_FRAME) {
+            continue;
+        }
 
-    if (block->order == MAX_ORDER) {
-        block->flags |= IN_TREE_FLAG;
-        insert_tree_node(&buddy_free_list_zone[block->zone], block, block->order);
-        return;
+        if (i == 0) {
+            numa_nodes[node].local_allocations++;
+        } else {
+            numa_nodes[node].fallback_allocations++;
+        }
+        return pfn;
     }
-    /* This may be unneeded with high level locking but will keep it in mind still for the time being */
 
-    /* Putting this here in the case of the expression evaluated true and by the time the lock is held it is no longer true */
-    if ((block->order == block->next->order) && (block->is_free == FREE && block->next->is_free == FREE) && (
-            block->zone == block->next->zone && !(block->next->flags & FIRST_BLOCK_FLAG))) {
-        struct buddy_block *next = block->next;
-        /*
-         * Reflect new order and new next block
-         */
-        block->next = next->next;
-        block->order++;
-        buddy_block_free(next);
-        block->flags |= IN_TREE_FLAG;
-        insert_tree_node(&buddy_free_list_zone[block->zone], block, block->order);
-    }
+    return NO_FRAME;
 }
-
@@ -7,80 +7,511 @@
 
 #include "include/architecture/arch_cpu.h"
 #include "include/architecture/arch_paging.h"
+#include "include/architecture/arch_asm_functions.h"
+#include "include/architecture/arch_atomic_operations.h"
+#include <include/data_structures/spinlock.h>
+#include <include/memory/kmalloc.h>
 #include <include/data_structures/hash_table.h>
 #include <include/drivers/display/framebuffer.h>
 
 #include "include/memory/pmm.h"
+#include "include/memory/numa.h"
 #include "include/memory/mem.h"
 #include "include/drivers/serial/uart.h"
 
 //Kernel heap
-struct slab slabs[10];
+struct slab_cache slab_caches[MAX_SLAB_CACHES];
+uint64_t object_cache_count = 0;
+
+struct hash_table slab_hash;
+
+static void heap_remote_free(struct slab_cache *cache, struct slab *slab, uint32_t owner, void *address);
+
 /*
- * Create a slab of physical memory,
+ * Simple intrusive list helpers for moving slabs between the partial, full, and empty lists of a cache. The counts are kept
+ * in step here so that the statistics are always accurate.
  */
+static struct slab **slab_list_head(struct slab_cache *cache, uint8_t list) {
+    switch (list) {
+        case SLAB_PARTIAL:
+            return &cache->partial;
+        case SLAB_FULL:
+            return &cache->full;
+        default:
+            return &cache->empty;
+    }
+}
 
-struct hash_table slab_hash;
+static uint64_t *slab_list_count(struct slab_cache *cache, uint8_t list) {
+    switch (list) {
+        case SLAB_PARTIAL:
+            return &cache->partial_count;
+        case SLAB_FULL:
+            return &cache->full_count;
+        default:
+            return &cache->empty_count;
+    }
+}
 
-void heap_create_slab(struct slab *slab, uint64_t entry_size, uint64_t pages) {
-    slab->first_free = Phys2Virt(phys_alloc(pages,KERNEL_POOL)); // direct calls to phys_alloc are allowed because this is always called inside a locked context
-    slab->entry_size = entry_size;
-    slab->start_address = slab->first_free;
-    slab->end_address = (slab->first_free + (pages * (PAGE_SIZE)));
-    uint64_t header_offset = (sizeof(struct header) + (entry_size)) / entry_size * entry_size;
-    uint64_t available_size = (pages * PAGE_SIZE) - header_offset;
-    struct header *slab_pointer = (struct header *) slab->first_free;
-    slab_pointer->slab = slab;
-    slab->first_free = (void **) ((void *) slab->first_free + header_offset);
-    serial_printf("Slab created at %x.64\n", slab->start_address);
+static void slab_list_remove(struct slab_cache *cache, struct slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *slab_list_head(cache, slab->list) = slab->next;
+    }
 
-    void **array = slab->first_free;
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+
+    slab->next = NULL;
+    slab->prev = NULL;
+    (*slab_list_count(cache, slab->list))--;
+}
+
+static void slab_list_insert(struct slab_cache *cache, struct slab *slab, uint8_t list) {
+    struct slab **head = slab_list_head(cache, list);
+    slab->list = list;
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+    (*slab_list_count(cache, list))++;
+}
+
+static void slab_list_move(struct slab_cache *cache, struct slab *slab, uint8_t list) {
+    slab_list_remove(cache, slab);
+    slab_list_insert(cache, slab, list);
+}
 
-    uint64_t max = available_size / entry_size - 1;
-    uint64_t factor = entry_size / sizeof(void *);
+void heap_cache_init(struct slab_cache *cache, uint64_t entry_size) {
+    memset(cache, 0, sizeof(struct slab_cache));
+    cache->name = "kmalloc";
+    cache->entry_size = entry_size;
+    cache->align = entry_size;
+    heap_create_slab(cache, DEFAULT_SLAB_SIZE_PAGES);
+}
+
+/*
+ * Create a named cache for one type of object. Objects are exactly size bytes rounded up to align rather than being pushed
+ * up to the next power of two, so something like a 300 byte vnode does not end up eating 512 bytes. Callers hold onto the
+ * returned cache and pass it to slab_cache_alloc / slab_cache_free which means no size class lookup on the hot path.
+ *
+ * The init function is optional, if passed it is run on every allocation after the object is zero'd on its way out. It is
+ * not a constructor in the Bonwick sense that runs once per object when the slab is built and expects objects to come back
+ * in their constructed state, objects here are zero'd and have the free list threaded through their first word while they
+ * sit in the slab so nothing set up ahead of time would survive until the next allocation.
+ *
+ * There is no slab_cache_destroy since everything using these lives as long as the kernel does.
+ */
+struct slab_cache *slab_cache_create(char *name, uint64_t size, uint64_t align, void (*init)(void *object)) {
+    if (align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+
+    if (align & (align - 1)) {
+        panic("slab_cache_create: alignment must be a power of two");
+    }
+
+    acquire_spinlock(&alloc_lock);
+    if (object_cache_count == MAX_OBJECT_CACHES) {
+        panic("slab_cache_create: out of object caches");
+    }
+
+    struct slab_cache *cache = &slab_caches[NUM_SLABS + object_cache_count++];
+    memset(cache, 0, sizeof(struct slab_cache));
+    cache->name = name;
+    cache->align = align;
+    cache->entry_size = (size + align - 1) & ~(align - 1);
+    cache->init = init;
+    release_spinlock(&alloc_lock);
+
+    DEBUG_PRINT("Object cache %s created with object size %i\n", name, cache->entry_size);
+    return cache;
+}
+
+/*
+ * Same split as kmalloc/kfree, per-CPU magazines once we are up and running and straight to the cache under alloc_lock
+ * during bootstrap.
+ */
+void *slab_cache_alloc(struct slab_cache *cache) {
+    void *object;
+
+    if (!bsp) {
+        object = heap_magazine_alloc(cache);
+    } else {
+        acquire_spinlock(&alloc_lock);
+        object = heap_allocate_from_slab(cache);
+        release_spinlock(&alloc_lock);
+    }
+
+    if (cache->init != NULL) {
+        cache->init(object);
+    }
+
+    return object;
+}
+
+void slab_cache_free(struct slab_cache *cache, void *object) {
+    if (object == NULL) {
+        return;
+    }
+
+    if (!bsp) {
+        heap_magazine_free(cache, object);
+        return;
+    }
+
+    acquire_spinlock(&alloc_lock);
+    heap_free_in_slab(cache, object);
+    release_spinlock(&alloc_lock);
+}
+
+/*
+ * Returns the cache that owns this address or NULL if it is not a slab object at all. Masking down to the slab header is only
+ * trusted once the page frame array says there really is a live slab there, otherwise any pointer whose 128KiB aligned
+ * neighbour happens to start with something that looks like a cache pointer would be freed into that cache.
+ */
+struct slab_cache *heap_cache_for(void *address) {
+    struct slab *slab = SLAB_FROM_ADDRESS(address);
+
+    if (!phys_is_slab(Virt2Phys(slab))) {
+        return NULL;
+    }
+
+    return slab->cache;
+}
+
+/*
+ * Create a slab of physical memory and put it on the empty list of the passed cache.
+ *
+ * Slabs need to be aligned to their size so that SLAB_FROM_ADDRESS works. Every buddy block is naturally aligned to its own
+ * size so the block phys_alloc_node hands back already is.
+ *
+ * Whatever space is left over at the end of the slab after fitting as many objects as possible is used for cache coloring,
+ * each new slab starts its objects align bytes further in than the last one did (wrapping back to 0) so that the same object
+ * index in different slabs does not keep landing on the same cache lines.
+ */
+struct slab *heap_create_slab(struct slab_cache *cache, uint64_t pages) {
+    const uint64_t slab_bytes = pages * PAGE_SIZE;
+    /* Slab memory is accounted to whoever allocates objects out of it, so this does not go through the traced phys_alloc */
+    void *base = Phys2Virt(phys_alloc_node(pages,KERNEL_POOL, numa_local_node()));
+
+    struct slab *slab = base;
+    phys_mark_slab(Virt2Phys(base), true);
+    const uint64_t header_size = (sizeof(struct slab) + cache->align - 1) & ~(cache->align - 1);
+    const uint64_t capacity = (slab_bytes - header_size) / cache->entry_size;
+    const uint64_t slack = slab_bytes - header_size - (capacity * cache->entry_size);
+
+    if (cache->color > slack) {
+        cache->color = 0;
+    }
+
+    slab->cache = cache;
+    slab->start_address = base + header_size + cache->color;
+    slab->end_address = base + slab_bytes;
+    slab->capacity = capacity;
+    cache->color += cache->align;
+    slab->in_use = 0;
+    slab->first_free = slab->start_address;
+    slab->owner = SLAB_NO_OWNER;
+    slab->remote_free = 0;
+    slab->remote_next = NULL;
+
+    void **array = slab->first_free;
+    uint64_t max = slab->capacity - 1;
+    uint64_t factor = cache->entry_size / sizeof(void *);
 
     for (uint64_t i = 0; i < max; i++) {
         array[i * factor] = &array[(i + 1) * factor];
     }
     array[max * factor] = NULL;
+
+    cache->objects_total += slab->capacity;
+    cache->slabs_created++;
+    slab_list_insert(cache, slab, SLAB_EMPTY);
+    DEBUG_PRINT("Slab created at %x.64\n", base);
+    return slab;
 }
 
+/*
+ * Hand a completely empty slab back to the buddy allocator
+ */
+static void heap_destroy_slab(struct slab_cache *cache, struct slab *slab) {
+    slab_list_remove(cache, slab);
+    cache->objects_total -= slab->capacity;
+    cache->slabs_reclaimed++;
+    slab->cache = NULL;
+    phys_mark_slab(Virt2Phys(slab), false); /* So stale frees into this memory do not look like slab objects anymore */
+    phys_dealloc(Virt2Phys(slab));
+}
 
-void *heap_allocate_from_slab(struct slab *slab) {
-    if (slab->first_free == NULL) {
-        heap_create_slab(slab, slab->entry_size, DEFAULT_SLAB_SIZE_PAGES);
+/*
+ * Take an object from the first partial slab, if there are no partial slabs an empty one is pulled in, and if there are
+ * no empty ones either a new slab is created.
+ */
+void *heap_allocate_from_slab(struct slab_cache *cache) {
+    struct slab *slab = cache->partial;
 
+    if (slab == NULL) {
+        slab = cache->empty;
+        if (slab == NULL) {
+            slab = heap_create_slab(cache, DEFAULT_SLAB_SIZE_PAGES);
+        }
+        slab_list_move(cache, slab, SLAB_PARTIAL);
     }
+
     void **old_free = slab->first_free;
     slab->first_free = *old_free;
-    memset(old_free, 0, slab->entry_size);
+    slab->in_use++;
+    cache->objects_in_use++;
+
+    if (slab->first_free == NULL) {
+        slab_list_move(cache, slab, SLAB_FULL);
+    }
+
+    memset(old_free, 0, cache->entry_size);
     return old_free;
 }
 
 
 /*
- * Free part of a slab, setting it new head to the first_free field
- * This can be useful
+ * Free part of a slab, setting it new head to the first_free field. The slab is found from the address itself so it does
+ * not matter how many slabs the cache has grown to.
+ *
+ * If this empties the slab it goes on the empty list, and if the cache is now holding too many empty slabs it is reclaimed
+ * on the spot.
  */
 
-void heap_free_in_slab(struct slab *slab, void *address) {
-    if (slab == NULL) {
-        warn_printf("NULL Slab Found Aborting Free. Leaked Memory. Address : %x.64 Slab Address %x.16\n", address,
-                      slab);
-
+void heap_free_in_slab(struct slab_cache *cache, void *address) {
+    if (address == NULL) {
         return;
     }
-    if (address == NULL) {
+
+    struct slab *slab = SLAB_FROM_ADDRESS(address);
+
+    if (cache == NULL || slab->cache != cache) {
+        warn_printf("Bad Slab Found Aborting Free. Leaked Memory. Address : %x.64 Cache Address %x.64\n", address,
+                      cache);
         return;
     }
 
     //ensure address is in fact part of this slab
-    if (address > slab->end_address || address < slab->start_address) {
+    if (address >= slab->end_address || address < slab->start_address) {
         return;
     }
 
     void **new_head = address;
     *new_head = slab->first_free;
     slab->first_free = new_head;
+    slab->in_use--;
+    cache->objects_in_use--;
+
+    if (slab->in_use == 0) {
+        slab_list_move(cache, slab, SLAB_EMPTY);
+        if (cache->empty_count > SLAB_MAX_EMPTY) {
+            heap_destroy_slab(cache, slab);
+        }
+        return;
+    }
+
+    if (slab->list == SLAB_FULL) {
+        slab_list_move(cache, slab, SLAB_PARTIAL);
+    }
+}
+
+/*
+ * Give every empty slab in every cache back to the buddy allocator, returns how many pages were freed up.
+ * phys_alloc calls this when it runs out of kernel memory, possibly from inside alloc_lock which is fine since it is recursive.
+ */
+uint64_t _heap_reclaim() {
+    uint64_t pages = 0;
+
+    /* Remote frees nobody has collected yet may be all that is keeping a slab off of the empty list */
+    for (uint64_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (uint64_t i = 0; i < MAX_SLAB_CACHES; i++) {
+            heap_collect_remote(&slab_caches[i], &cpu_list[cpu].magazines[i]);
+        }
+    }
+
+    for (uint64_t i = 0; i < MAX_SLAB_CACHES; i++) {
+        struct slab_cache *cache = &slab_caches[i];
+        while (cache->empty != NULL) {
+            heap_destroy_slab(cache, cache->empty);
+            pages += DEFAULT_SLAB_SIZE_PAGES;
+        }
+    }
+
+    return pages;
+}
+
+uint64_t heap_reclaim() {
+    acquire_spinlock(&alloc_lock);
+    const uint64_t pages = _heap_reclaim();
+    release_spinlock(&alloc_lock);
+    return pages;
+}
+
+/*
+ * Dump occupancy of each cache, objects in use against how many objects the slabs of that cache can hold
+ */
+void heap_print_stats() {
+    for (uint64_t i = 0; i < MAX_SLAB_CACHES; i++) {
+        struct slab_cache *cache = &slab_caches[i];
+        if (cache->entry_size == 0) {
+            continue;
+        }
+
+        const uint64_t occupancy = cache->objects_total ? (cache->objects_in_use * 100) / cache->objects_total : 0;
+        serial_printf("slab %s %i: partial %i full %i empty %i objects %i/%i (%i percent) created %i reclaimed %i\n",
+                      cache->name, cache->entry_size, cache->partial_count, cache->full_count, cache->empty_count,
+                      cache->objects_in_use, cache->objects_total, occupancy, cache->slabs_created,
+                      cache->slabs_reclaimed);
+    }
+}
+
+/*
+ * Allocate from this CPU's magazine for the passed cache. If the magazine is empty, it is refilled with MAGAZINE_BATCH
+ * objects from the shared cache under alloc_lock and one of them is handed out.
+ *
+ * Interrupts are turned off while touching the magazine so that nothing else on this CPU can get in between us reading
+ * the count and using it. This is what lets the common path skip alloc_lock entirely.
+ */
+void *heap_magazine_alloc(struct slab_cache *cache) {
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+
+    struct slab_magazine *magazine = &my_cpu()->magazines[cache - slab_caches];
+
+    if (magazine->count != 0) {
+        magazine->hits++;
+        void *object = magazine->objects[--magazine->count];
+        if (interrupts) {
+            enable_interrupts();
+        }
+        /* Objects sitting in a magazine are dirty, hand them out zero'd the same as heap_allocate_from_slab does */
+        memset(object, 0, cache->entry_size);
+        return object;
+    }
+
+    magazine->misses++;
+    acquire_spinlock(&alloc_lock);
+    heap_collect_remote(cache, magazine);
+    for (uint64_t i = 0; i < MAGAZINE_BATCH; i++) {
+        void *object = heap_allocate_from_slab(cache);
+        SLAB_FROM_ADDRESS(object)->owner = my_cpu()->cpu_id;
+        magazine->objects[magazine->count++] = object;
+    }
+    void *object = magazine->objects[--magazine->count];
+    release_spinlock(&alloc_lock);
+    if (interrupts) {
+        enable_interrupts();
+    }
+    return object;
 }
 
+/*
+ * Free into this CPU's magazine for the passed cache. If the magazine is full, MAGAZINE_BATCH objects are given back
+ * to the shared cache under alloc_lock first so there is room.
+ *
+ * Objects from a slab some other CPU owns do not go in the magazine at all, they go back to their own slab through
+ * heap_remote_free without any lock. Slabs nobody owns yet (everything handed out during bootstrap) are treated as ours.
+ */
+void heap_magazine_free(struct slab_cache *cache, void *address) {
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+
+    struct slab_magazine *magazine = &my_cpu()->magazines[cache - slab_caches];
+    struct slab *slab = SLAB_FROM_ADDRESS(address);
+    const uint32_t owner = slab->owner;
+
+    if (owner != SLAB_NO_OWNER && owner != my_cpu()->cpu_id) {
+        heap_remote_free(cache, slab, owner, address);
+        magazine->remote_frees++;
+        if (interrupts) {
+            enable_interrupts();
+        }
+        return;
+    }
+
+    if (magazine->count != MAGAZINE_SIZE) {
+        magazine->objects[magazine->count++] = address;
+        if (interrupts) {
+            enable_interrupts();
+        }
+        return;
+    }
+
+    magazine->drains++;
+    acquire_spinlock(&alloc_lock);
+    heap_collect_remote(cache, magazine);
+    for (uint64_t i = 0; i < MAGAZINE_BATCH; i++) {
+        heap_free_in_slab(cache, magazine->objects[--magazine->count]);
+    }
+    magazine->objects[magazine->count++] = address;
+    release_spinlock(&alloc_lock);
+    if (interrupts) {
+        enable_interrupts();
+    }
+}
+
+/*
+ * Push an object onto its slab's remote_free stack. The object's first word becomes the link, which is fine since it is
+ * free now and heap_free_in_slab does the same thing with first_free.
+ *
+ * If the stack was empty the owner does not know about this slab yet, so the slab is pushed onto the owner's remote_slabs
+ * for this cache as well. A slab is only ever pushed there on the empty to non-empty transition and heap_collect_remote
+ * empties remote_free after taking the slab off, so a slab is never on that stack twice. Nothing here can free the slab out from
+ * under us either, the object being freed is still counted in in_use until the owner collects it.
+ */
+static void heap_remote_free(struct slab_cache *cache, struct slab *slab, uint32_t owner, void *address) {
+    uint64_t head;
+
+    do {
+        head = slab->remote_free;
+        *(uint64_t *) address = head;
+    } while (!arch_atomic_cas(&slab->remote_free, head, (uint64_t) address));
+
+    if (head != 0) {
+        return;
+    }
+
+    struct slab_magazine *owner_magazine = &cpu_list[owner].magazines[cache - slab_caches];
+    uint64_t slabs;
+
+    do {
+        slabs = owner_magazine->remote_slabs;
+        slab->remote_next = (struct slab *) slabs;
+    } while (!arch_atomic_cas(&owner_magazine->remote_slabs, slabs, (uint64_t) slab));
+}
+
+/*
+ * Put everything other CPUs have freed into this magazine's slabs back into those slabs. Both stacks are taken whole with
+ * one exchange each so this never fights with heap_remote_free, anything pushed after that just waits for the next
+ * collection. Called with alloc_lock held, usually by the owner when it is already under the lock to refill or drain, but
+ * _heap_reclaim does it for everyone.
+ */
+void heap_collect_remote(struct slab_cache *cache, struct slab_magazine *magazine) {
+    if (magazine->remote_slabs == 0) {
+        return;
+    }
+
+    struct slab *slab = (struct slab *) arch_atomic_exchange(&magazine->remote_slabs, 0);
+
+    while (slab != NULL) {
+        /* Read the link first, the slab may be destroyed by the last of its frees below */
+        struct slab *next = slab->remote_next;
+        void **object = (void **) arch_atomic_exchange(&slab->remote_free, 0);
+
+        while (object != NULL) {
+            void **next_object = *object;
+            heap_free_in_slab(cache, object);
+            magazine->remote_reclaimed++;
+            object = next_object;
+        }
+
+        slab = next;
+    }
+}
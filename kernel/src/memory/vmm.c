@@ -7,7 +7,10 @@
 #include <include/data_structures/doubly_linked_list.h>
 #include <include/drivers/display/framebuffer.h>
 #include "include/architecture/arch_vmm.h"
+#include "include/architecture/arch_tlb.h"
 #include "include/memory/kmalloc.h"
+#include "include/filesystem/vfs.h"
+#include "include/definitions/string.h"
 
 struct virt_map* kernel_pg_map;
 struct spinlock foreign_map_lock;
@@ -19,12 +22,29 @@ void arch_kvm_init(p4d_t *pgdir){
     map_kernel_address_space(pgdir);
 }
 
+/*
+ * Every page that holds page table entries comes and goes through these two so that we can keep count of how much
+ * memory is going to page tables, see meminfo
+ */
+uint64_t page_table_pages = 0;
+
+void *page_table_alloc() {
+    __atomic_fetch_add(&page_table_pages, 1, __ATOMIC_RELAXED);
+    return kzmalloc(PAGE_SIZE);
+}
+
+void page_table_free(void *table) {
+    __atomic_fetch_sub(&page_table_pages, 1, __ATOMIC_RELAXED);
+    kfree(table);
+}
+
 uint64_t *alloc_virtual_map() {
-    return Virt2Phys(kzmalloc(PAGE_SIZE));
+    return Virt2Phys(page_table_alloc());
 }
 
 void free_virtual_map(uint64_t *virtual_map) {
-    kfree(Phys2Virt(virtual_map));
+    tlb_page_map_freed(virtual_map); /* The next owner of this page must not inherit any PCID that was tagged with it */
+    page_table_free(Phys2Virt(virtual_map));
 }
 
 uint64_t get_current_page_map() {
@@ -62,8 +82,15 @@ void arch_map_single_page(p4d_t* pgdir, uint64_t physaddr, uint64_t* va, const u
     map_single_page(pgdir,physaddr,va,perms);
 }
 
+/*
+ * Gives back the physical address of the page the virtual address is in. If it is inside a huge page the leaf only has the
+ * start of the huge page so the offset of our page within it is added back on.
+ */
 void *arch_get_physical_address(void *virtual_address,uint64_t *page_map) {
-    return (void *)(PTE_ADDR(*walk_page_directory(page_map,virtual_address,0)));
+    uint64_t leaf_size;
+    const pte_t *entry = walk_page_directory_level(page_map,virtual_address,0,PAGE_LEVEL_4K,&leaf_size);
+    const uint64_t base = PTE_ADDR(*entry) & ~(leaf_size - 1);
+    return (void *)(base + (((uint64_t) virtual_address & (leaf_size - 1)) & ~(PAGE_SIZE - 1)));
 }
 
 /*
@@ -77,22 +104,8 @@ uint64_t arch_check_page_mapping(uint64_t *pagemap, void *address) {
 
 void arch_map_foreign(p4d_t *user_page_table,uint64_t *va, uint64_t size) {
     acquire_spinlock(&foreign_map_lock);
-    uint64_t pages_mapped = 0;
-    uint64_t page_map = (uint64_t) kernel_pg_map->top_level;
-    uint64_t current_address = (uint64_t) KERNEL_FOREIGN_MAP_BASE;
-    uint64_t virtual_address = (uint64_t) va;
-    DEBUG_PRINT("arch_map_foreign: current page map = %x.64 passed page map %x.64\n",page_map,user_page_table);
-    while (pages_mapped != size) {
-        DEBUG_PRINT("FOREIGN MAP: PHYSICAL ADDR %x.64 VA %x.64 USER PAGE TABLE %x.64\n",arch_get_physical_address((void *)virtual_address,user_page_table),virtual_address,user_page_table);
-        DEBUG_PRINT("PHYS %x.64\n",  arch_get_physical_address((void *)virtual_address,user_page_table));
-        DEBUG_PRINT("ENTER\n");
-        uint64_t physical_address = (uint64_t) arch_get_physical_address((void *)virtual_address,user_page_table);
-        DEBUG_PRINT("EXIT\n");
-        arch_map_single_page((p4d_t *)page_map,physical_address,(uint64_t *) current_address,READWRITE);
-        current_address += PAGE_SIZE;
-        pages_mapped++;
-        virtual_address += PAGE_SIZE;
-    }
+    DEBUG_PRINT("arch_map_foreign: current page map = %x.64 passed page map %x.64\n",kernel_pg_map->top_level,user_page_table);
+    map_foreign_range(kernel_pg_map->top_level,KERNEL_FOREIGN_MAP_BASE,user_page_table,(uint64_t) va,size,READWRITE);
 }
 
 void arch_unmap_foreign(uint64_t size) {
@@ -200,3 +213,127 @@ void detach_user_region(struct virt_map *map,struct virtual_region *region){
         dealloc_user_va(map->top_level,region->va + (i * PAGE_SIZE));
     }
 }
+
+/*
+ * Add a region without mapping anything, its pages are filled in by handle_region_fault as they are touched
+ */
+void attach_lazy_region(struct virt_map *map, struct virtual_region *region) {
+    if (map->vm_regions == NULL) {
+        map->vm_regions = kzmalloc(sizeof(struct doubly_linked_list));
+        doubly_linked_list_init(map->vm_regions);
+    }
+    doubly_linked_list_insert_tail(map->vm_regions, region);
+}
+
+/*
+ * Called from the page fault handler for a page that is not present. If the address is inside one of map's file backed
+ * regions a fresh page is mapped there and the part of the file that lands in it is read straight in, the rest is zeroed.
+ *
+ * ELF segments do not have to start or end on a page boundary so two of them can share a page (the end of .text and the start
+ * of .data for instance), every region that overlaps the page gets its bytes copied in and the page gets the permissions of
+ * all of them (executable if any of them are).
+ *
+ * map has to be what is loaded right now since the page is written through its user address, it is mapped writable while that
+ * happens and then dropped down to what the regions ask for. The region list lock keeps two threads faulting on the same page
+ * from both filling it in.
+ */
+int64_t handle_region_fault(struct virt_map *map, const uint64_t address) {
+    const uint64_t page_address = ALIGN_DOWN(address, PAGE_SIZE);
+    uint64_t perms = 0;
+    bool found = false;
+    bool executable = false;
+
+    if (map == NULL || map->vm_regions == NULL || !IS_USER_ADDRESS(address)) {
+        return KERN_NOT_FOUND;
+    }
+
+    acquire_spinlock(&map->vm_regions->lock);
+
+    for (const struct doubly_linked_list_node *node = map->vm_regions->head; node != NULL; node = node->next) {
+        const struct virtual_region *region = node->data;
+        if (region->file != NULL && page_address >= region->va && page_address < region->end_addr) {
+            perms |= region->perms & ~NO_EXECUTE;
+            executable |= !(region->perms & NO_EXECUTE);
+            found = true;
+        }
+    }
+
+    if (!found) {
+        release_spinlock(&map->vm_regions->lock);
+        return KERN_NOT_FOUND;
+    }
+
+    if (!executable) {
+        perms |= NO_EXECUTE;
+    }
+
+    const pte_t *entry = walk_page_directory(map->top_level, (void *) page_address, 0);
+    if (entry != NULL && (*entry & PTE_P)) {
+        /* Somebody else filled it in while we were waiting on the lock */
+        release_spinlock(&map->vm_regions->lock);
+        return KERN_SUCCESS;
+    }
+
+    void *page = umalloc(1);
+    arch_map_single_page(map->top_level, (uint64_t) page, (uint64_t *) page_address, perms | READWRITE);
+    memset((void *) page_address, 0, PAGE_SIZE);
+
+    for (const struct doubly_linked_list_node *node = map->vm_regions->head; node != NULL; node = node->next) {
+        const struct virtual_region *region = node->data;
+        if (region->file == NULL || page_address < region->va || page_address >= region->end_addr) {
+            continue;
+        }
+
+        const uint64_t start = max(page_address, region->file_va);
+        const uint64_t end = min(page_address + PAGE_SIZE, region->file_va + region->file_size);
+        if (start < end && vnode_read(region->file, region->file_offset + (start - region->file_va), end - start,
+                                      (char *) start) != KERN_SUCCESS) {
+            panic("handle_region_fault: could not read page in from file");
+        }
+    }
+
+    if (!(perms & READWRITE)) {
+        protect_page(map->top_level, page_address, perms);
+    }
+
+    release_spinlock(&map->vm_regions->lock);
+    return KERN_SUCCESS;
+}
+
+/*
+ * Give child a copy on write copy of parent's user address space, see share_user_pages. The regions are copied as well so that
+ * the child can still fault in the parts of its ELF segments that the parent never touched.
+ */
+void copy_address_space(struct virt_map *parent, struct virt_map *child) {
+    if (parent->vm_regions != NULL) {
+        if (child->vm_regions == NULL) {
+            child->vm_regions = kzmalloc(sizeof(struct doubly_linked_list));
+            doubly_linked_list_init(child->vm_regions);
+        }
+
+        acquire_spinlock(&parent->vm_regions->lock);
+        for (const struct doubly_linked_list_node *node = parent->vm_regions->head; node != NULL; node = node->next) {
+            struct virtual_region *region = kmalloc(sizeof(struct virtual_region));
+            memcpy(region, node->data, sizeof(struct virtual_region));
+            doubly_linked_list_insert_tail(child->vm_regions, region);
+        }
+        release_spinlock(&parent->vm_regions->lock);
+    }
+
+    share_user_pages(parent->top_level, child->top_level);
+}
+
+/*
+ * Called from the page fault handler for a write to a page that is present but read only. The region list lock keeps two
+ * threads of the same process from both copying the page.
+ */
+int64_t handle_cow_fault(struct virt_map *map, const uint64_t address) {
+    if (map == NULL || map->vm_regions == NULL || !IS_USER_ADDRESS(address)) {
+        return KERN_NOT_FOUND;
+    }
+
+    acquire_spinlock(&map->vm_regions->lock);
+    const int64_t ret = copy_on_write_page(map->top_level, address);
+    release_spinlock(&map->vm_regions->lock);
+    return ret;
+}
@@ -0,0 +1,107 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#include "include/definitions/types.h"
+#include "include/memory/zero_pool.h"
+#include "include/memory/pmm.h"
+#include "include/memory/mem.h"
+#include "include/architecture/arch_paging.h"
+#include <include/data_structures/spinlock.h>
+#include <include/drivers/display/framebuffer.h>
+#include "include/drivers/serial/uart.h"
+#include "include/scheduling/kthread.h"
+#include "include/scheduling/sched.h"
+
+/*
+ * The pool is guarded by pmm_lock, nothing else uses it anymore since the buddy allocator has its own lock.
+ *
+ * Only kernel pool pages go in here. User pages above 4GB are not mapped in the HHDM through the kernel page tables,
+ * so they could not be zeroed from the worker anyway, umalloc callers keep zeroing on demand.
+ */
+struct zero_pool zero_pool;
+
+static void zero_pool_worker(void *args);
+
+/*
+ * Start the worker on this CPU, it will fill the pool the first time it gets scheduled and then sleep until idle
+ * CPUs notice the pool is running low.
+ */
+void zero_pool_init() {
+    kthread_create(zero_pool_worker, NULL, LOW);
+    kprintf("Zeroed Page Pool Initialized\n");
+}
+
+/*
+ * Hands back the physical address of a zeroed kernel page or NULL if the pool is dry, in which case the caller
+ * has to zero one itself.
+ */
+void *zero_pool_get() {
+    acquire_spinlock(&pmm_lock);
+    if (zero_pool.count == 0) {
+        zero_pool.misses++;
+        release_spinlock(&pmm_lock);
+        return NULL;
+    }
+
+    void *page = (void *) zero_pool.pages[--zero_pool.count];
+    zero_pool.hits++;
+    release_spinlock(&pmm_lock);
+    return page;
+}
+
+/*
+ * Called by sched_run when a CPU has nothing to do. If the pool is getting low and the worker is asleep, wake it up.
+ *
+ * The flag is only cleared by the worker itself, if we race with it on its way to sleep the wakeup is lost but the next idle pass
+ * will just try again, so there is no need for anything cleverer here.
+ */
+void zero_pool_idle() {
+    if (zero_pool.count >= ZERO_POOL_LOW || !zero_pool.worker_sleeping) {
+        return;
+    }
+
+    sched_wakeup(&zero_pool);
+}
+
+/*
+ * Grab pages, zero them with no locks held, and push them into the pool. Yield between batches since we are only
+ * supposed to be using time nobody else wants. Once the pool is full, go to sleep until zero_pool_idle wakes us.
+ */
+static void zero_pool_worker(void *args) {
+    (void) args;
+    void *batch[ZERO_POOL_BATCH];
+
+    for (;;) {
+        zero_pool.worker_sleeping = false;
+
+        while (zero_pool.count < ZERO_POOL_SIZE) {
+            /* Only we ever push so the pool can only shrink under us, never overflow */
+            uint64_t batch_size = ZERO_POOL_SIZE - zero_pool.count;
+            if (batch_size > ZERO_POOL_BATCH) {
+                batch_size = ZERO_POOL_BATCH;
+            }
+
+            for (uint64_t i = 0; i < batch_size; i++) {
+                batch[i] = phys_alloc(1, KERNEL_POOL);
+                clear_pages_nt(Phys2Virt(batch[i]), 1); /* Nobody will look at these for a while so keep them out of the cache */
+            }
+
+            acquire_spinlock(&pmm_lock);
+            for (uint64_t i = 0; i < batch_size; i++) {
+                zero_pool.pages[zero_pool.count++] = (uint64_t) batch[i];
+            }
+            zero_pool.refilled += batch_size;
+            release_spinlock(&pmm_lock);
+
+            sched_yield();
+        }
+
+        zero_pool.worker_sleeping = true;
+        sched_sleep(&zero_pool);
+    }
+}
+
+void zero_pool_print_stats() {
+    serial_printf("zero_pool: holding %i of %i hits %i misses %i refilled %i\n", zero_pool.count, ZERO_POOL_SIZE,
+                  zero_pool.hits, zero_pool.misses, zero_pool.refilled);
+}
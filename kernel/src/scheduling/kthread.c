@@ -13,6 +13,7 @@
 #include <include/scheduling/sched.h>
 #include "include/definitions/definitions.h"
 #include "include/memory/kmalloc.h"
+#include "include/memory/slab.h"
 #include "include/scheduling/process.h"
 
 static uint64_t kthread_pid = 50000;
@@ -28,8 +29,12 @@ static uint64_t get_kthread_pid(){
     }
     return kthread_pid;
 }
-void kthread_init() {
-    struct process *proc = kzmalloc(sizeof(struct process));
+/*
+ * Common setup for every kthread, builds the process, shares the kernel page table and carves out a private stack.
+ * Execution will begin at entry once it is scheduled, the caller is responsible for queueing it.
+ */
+static struct process *kthread_alloc(uint64_t entry) {
+    struct process *proc = slab_cache_alloc(process_cache);
 
 
     proc->current_cpu = my_cpu();
@@ -48,7 +53,13 @@ void kthread_init() {
 
     proc->parent_process_id = 0;
     proc->process_type = KERNEL_THREAD;
-    proc->current_register_state = kzmalloc(sizeof(struct register_state));
+    proc->inside_kernel = false;
+    proc->started = false;
+    proc->on_cpu = false;
+    proc->lock_depth = 0;
+    proc->interrupts_before_lock = 0;
+    proc->ticks_taken = 0;
+    proc->current_register_state = slab_cache_alloc(register_state_cache);
     proc->process_id = get_kthread_pid();
     memset(proc->current_register_state, 0, sizeof(struct register_state));
 
@@ -66,25 +77,57 @@ void kthread_init() {
 
     /*
      * Set the architecture specific registers ahead of time the stack is set up as well as the instruction pointer
-     * The instruction pointer points to kthread main
+     * The instruction pointer points to whatever entry we were handed
      */
 #ifdef __x86_64__
-    proc->current_register_state->rip = (uint64_t) kthread_main; // it's grabbing a junk value if not called from an interrupt so overwriting rip with kthread main
+    proc->current_register_state->rip = entry; // it's grabbing a junk value if not called from an interrupt so overwriting rip with the entry point
     proc->current_register_state->rsp = (uintptr_t)(proc->stack )+ DEFAULT_STACK_SIZE; /* Allocate a private stack */
     proc->current_register_state->rbp = proc->current_register_state->rsp - 8; /* Set base pointer to the new stack pointer, -8 for return address */
     proc->kernel_stack = stack;
 #endif
 
-    proc->current_register_state->interrupts_enabled = are_interrupts_enabled();
+    proc->current_register_state->interrupts_enabled = true; /* Otherwise nothing could ever preempt it, it is only ever started from sched_run */
 
     if (proc->current_cpu->local_run_queue == NULL) {
         proc->current_cpu->local_run_queue = &local_run_queues[proc->current_cpu->cpu_number];
     }
 
+    return proc;
+}
+
+void kthread_init() {
+    struct process *proc = kthread_alloc((uint64_t) kthread_main);
+    proc->priority = MEDIUM;
+    proc->effective_priority = MEDIUM;
     enqueue(proc->current_cpu->local_run_queue, proc, MEDIUM);
     kprintf("Kernel Threads Initialized For CPU #%i\n", my_cpu()->cpu_number);
 }
 
+/*
+ * Spin up a kthread that runs function(args) through kthread_work and exits when it returns. It goes on this CPU's run queue
+ * at the given priority. The function and args are handed over in the first two argument registers since context_switch
+ * restores them on the way into a kernel thread.
+ */
+struct process *kthread_create(worker_function function, void *args, uint8_t priority) {
+    struct process *proc = kthread_alloc((uint64_t) kthread_entry);
+#ifdef __x86_64__
+    proc->current_register_state->rdi = (uint64_t) function;
+    proc->current_register_state->rsi = (uint64_t) args;
+#endif
+    proc->priority = priority;
+    proc->effective_priority = priority;
+    enqueue(proc->current_cpu->local_run_queue, proc, priority);
+    return proc;
+}
+
+/*
+ * Where kthreads made with kthread_create begin, there is nothing to return to so we exit once the work is done
+ */
+void kthread_entry(worker_function function, void *args) {
+    kthread_work(function, args);
+    sched_exit();
+}
+
 /*
  * For the time being, this function can't return
  */
@@ -117,6 +160,9 @@ void kthread_main() {
     close(handle);
 
     kfree(buffer);
+#ifdef _DEBUG_
+    kmalloc_print_stats();
+#endif
     sched_exit();
 }
 
@@ -10,6 +10,9 @@
 #include "include/architecture/x86_64/gdt.h"
 #include "include/data_structures/doubly_linked_list.h"
 #include "include/scheduling/sched.h"
+#include "include/memory/slab.h"
+#include "include/definitions/string.h"
+#include "include/system_call/system_calls.h"
 
 // We will just have a 10mb sensible max for our elf files since I want to read the whole thing into memory on execute
 #define SENSIBLE_FILE_SIZE (10 << 20)
@@ -18,6 +21,16 @@ extern uint64_t get_current_base();
 uint64_t user_proc_ids = 0;
 bool lock_set = false;
 struct spinlock lock;
+struct slab_cache *process_cache;
+struct slab_cache *register_state_cache;
+
+/*
+ * Set up the object caches for process structures, needs to happen after the heap is up and before the first process is allocated
+ */
+void process_init() {
+    process_cache = slab_cache_create("process", sizeof(struct process), sizeof(void *), NULL);
+    register_state_cache = slab_cache_create("register_state", sizeof(struct register_state), sizeof(void *), NULL);
+}
 
 uint64_t get_process_id() {
     if (!lock_set) {
@@ -41,7 +54,7 @@ int32_t exec(char *path_to_executable, char **argv) {
 
 struct process *alloc_process(uint64_t state, bool user, struct process *parent) {
     DEBUG_PRINT("alloc_process: User proc : %i\n",user);
-    struct process *process = kzmalloc(sizeof(struct process));
+    struct process *process = slab_cache_alloc(process_cache);
     bool init = parent == NULL ? true : false;
 
     process->kernel_stack =  (void*) (uint64_t)kzmalloc(DEFAULT_STACK_SIZE);
@@ -56,8 +69,14 @@ struct process *alloc_process(uint64_t state, bool user, struct process *parent)
     process->page_map->vm_regions = kzmalloc(sizeof(struct doubly_linked_list));
 
     process->process_id = get_process_id();
-    process->current_register_state = kzmalloc(sizeof(struct register_state));
+    process->current_register_state = slab_cache_alloc(register_state_cache);
     process->process_type = USER_PROCESS;
+    process->started = false;
+    process->on_cpu = false;
+    process->lock_depth = 0;
+    process->interrupts_before_lock = 0;
+    process->time_quantum = 0;
+    process->ticks_taken = 0;
 
     if (user) {
         process->stack = umalloc(DEFAULT_STACK_SIZE / PAGE_SIZE);
@@ -100,12 +119,14 @@ void free_process(struct process *process) {
         free_virtual_map(process->page_map->top_level);
         DEBUG_PRINT("free_process: freeing page map regions linked list\n");
         doubly_linked_list_destroy(process->page_map->vm_regions,true);
-        DEBUG_PRINT("free_process: freeing user stack\n");
-        ufree(process->stack);
-        DEBUG_PRINT("free_process: freeing page map \n");
-        kfree(process->page_map);
+        /*
+         * The user stack is mapped like any other user page so free_page_tables has already let go of it, and after a fork
+         * it may still be in use by the other process
+         */
         DEBUG_PRINT("free_process: freeing vm regions list\n");
         kfree(process->page_map->vm_regions);
+        DEBUG_PRINT("free_process: freeing page map \n");
+        kfree(process->page_map);
     }
     DEBUG_PRINT("free_process: freeing handle list\n");
     doubly_linked_list_destroy(process->handle_list->handle_list,true);
@@ -114,9 +135,9 @@ void free_process(struct process *process) {
     DEBUG_PRINT("free_process: freeing handle list top top level\n");
     kfree(process->handle_list);
     DEBUG_PRINT("free_process: freeing register state\n");
-    kfree(process->current_register_state);
+    slab_cache_free(register_state_cache, process->current_register_state);
     DEBUG_PRINT("free_process: freeing process struct\n");
-    kfree(process);
+    slab_cache_free(process_cache, process);
     DEBUG_PRINT("free_process: end for process %i\n",process->process_id);
 }
 
@@ -155,23 +176,55 @@ int64_t spawn(char *path_to_executable, uint64_t flags, uint64_t aux_arguments)
     return KERN_SUCCESS;
 }
 
+/*
+ * Fork the current process, only meant to be called from a system call since the child starts out as a copy of the user
+ * state saved on the way in. Returns the child's process id to the parent and the child comes back out of the same system
+ * call with 0.
+ *
+ * The address space is not copied, every user page is shared with the parent copy on write (see copy_address_space) so this
+ * costs the same whether the parent has a few pages mapped or a few thousand, give or take one entry write per page. That
+ * includes the user stack so the child does not get one of its own from alloc_process.
+ *
+ * The first time the child is scheduled context_switch takes the user path, which sysrets to rip on user_rsp with rax as the
+ * return value. Every other register comes back just as syscall_entry will hand them back to the parent, rcx and r11 are
+ * clobbered by sysret on both sides anyway.
+ */
 int64_t fork(uint64_t flags, uint64_t aux_arguments) {
-    uint64_t *top_level_page_table = alloc_virtual_map();
     struct process *current = current_process();
+    struct process *new_process = alloc_process(PROCESS_READY, false, current);
 
-    struct process *new_process = alloc_process(PROCESS_READY,true, current);
-
-    //TODO copy register state so it jmps to the right spot
 #ifdef __x86_64__
-    new_process->current_register_state->rsp = (uint64_t) new_process->stack;
+    const struct syscall_frame *frame = current_syscall_frame();
+    struct register_state *state = new_process->current_register_state;
+
+    memset(state, 0, sizeof(struct register_state));
+    state->rax = 0;
+    state->rbx = frame->rbx;
+    state->rdi = frame->rdi;
+    state->rsi = frame->rsi;
+    state->rdx = frame->rdx;
+    state->rbp = frame->rbp;
+    state->r8 = frame->r8;
+    state->r9 = frame->r9;
+    state->r10 = frame->r10;
+    state->r12 = frame->r12;
+    state->r13 = frame->r13;
+    state->r14 = frame->r14;
+    state->r15 = frame->user_rsp; /* syscall_entry uses r15 to hold the user stack so that is what the parent gets back in it too */
+    state->rip = frame->rip;
+    state->user_rsp = frame->user_rsp;
+    state->rsp = (uint64_t) new_process->kernel_stack + DEFAULT_STACK_SIZE;
+    state->interrupts_enabled = false; /* sysret turns them back on, we do not want an interrupt between it and the stack switch */
 #endif
 
+    copy_address_space(current->page_map, new_process->page_map);
+    new_process->stack = current->stack;
+
     global_enqueue_process(new_process);
 
-    return KERN_SUCCESS;
+    return new_process->process_id;
 }
 
-
 void set_kernel_stack(void *kernel_stack) {
 #ifdef __x86_64__
     my_cpu()->tss->rsp0 = (uint64_t) kernel_stack;
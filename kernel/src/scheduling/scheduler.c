@@ -22,6 +22,9 @@
 #include "include/memory/vmm.h"
 #include <include/memory/kmalloc.h>
 #include <include/memory/mem.h>
+#include <include/memory/zero_pool.h>
+#include "include/architecture/arch_tlb.h"
+#include "include/scheduling/timer_wheel.h"
 
 #ifdef __x86_64__
 #include "include/architecture/x86_64/gdt.h"
@@ -39,6 +42,20 @@ static void purge_dead_processes();
 
 static void look_for_process();
 
+static void sched_idle(struct cpu* cpu);
+
+static void sched_wake_node(struct doubly_linked_list_node* node);
+
+/*
+ * sched_run switches to a process with interrupts off, so a process that went away with them on has to get them back from
+ * context_switch. If it doesn't nothing can preempt it and this CPU stops taking ticks and shootdowns, so catch it here.
+ */
+static void sched_check_interrupts(const uint64_t interrupts, const char* where) {
+    if (interrupts && !are_interrupts_enabled()) {
+        panic(where);
+    }
+}
+
 extern void context_switch(struct register_state* old, struct register_state* new, bool user_process, void* memory_map);
 
 
@@ -103,10 +120,12 @@ void sched_yield() {
     }
 
     struct process* process = my_cpu()->running_process;
+    const uint64_t interrupts = are_interrupts_enabled();
     process->current_state = PROCESS_READY;
     enqueue(my_cpu()->local_run_queue, process, process->priority);
     context_switch(my_cpu()->running_process->current_register_state, my_cpu()->scheduler_state, false,
-                   kernel_pg_map->top_level);
+                   (void*)tlb_switch_page_map(my_cpu(), kernel_pg_map));
+    sched_check_interrupts(interrupts, "sched_yield: resumed with interrupts off");
 }
 
 /*
@@ -121,27 +140,43 @@ void sched_run() {
     DEBUG_PRINT("sched_run: entering\n");
     struct cpu* cpu = my_cpu();
     if (cpu->local_run_queue->head == NULL) {
-        timer_sleep(1500);
-
-#ifdef _DFS_
-        serial_printf("DFS: Local Run Queue is Empty \n");
-#endif
-#ifdef _DPS_
-        serial_printf("DPS: Local Run Queue is Empty \n");
-#endif
         purge_dead_processes(); /* This doesn't allow for an explicit wait maybe I will change that later*/
         look_for_process();
-        current_pos_cursor(framebuffer_device.device_info);
+        if (cpu->local_run_queue->head == NULL) {
+            zero_pool_idle(); /* Nothing to do so let the zeroing thread have a go if the pool is getting low */
+            sched_idle(cpu);
+        }
         return;
     }
 
-    cpu->running_process = cpu->local_run_queue->head->data;
+    /*
+     * No timer ticks between marking the process running and actually switching to it, sched_tick would see it as running
+     * and try to preempt it from the scheduler's stack. context_switch puts back whatever interrupt flag the process had when it
+     * was switched away (or the one kthread_alloc gave it), and ours comes back the same way when it switches back here.
+     */
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+
+    struct process* process = cpu->local_run_queue->head->data;
+
+    /*
+     * A process is put back on a run queue (by sched_wakeup, sched_yield or sched_preempt) before it has actually been switched
+     * away from, so it may still be on its old CPU with its registers half saved. That CPU clears on_cpu once the switch is
+     * done, wait for that before we load them.
+     */
+    while (__atomic_load_n(&process->on_cpu, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    __atomic_store_n(&process->on_cpu, true, __ATOMIC_RELAXED);
+
+    cpu->running_process = process;
     DEBUG_PRINT("sched_run: New pid : %i\nstart_time %i : current time %i\ninside_kernel: %i\nstack %x.64\nkernel_stack %x.64\ncurrent_working_dir %s\npage_map %x.64\n",cpu->running_process->process_id,cpu->running_process->start_time,timer_get_current_count(),cpu->running_process->inside_kernel,cpu->running_process->stack,cpu->running_process->kernel_stack,cpu->running_process->current_working_dir->vnode_name,cpu->running_process->page_map->top_level);
     cpu->running_process->current_cpu = cpu;
     cpu->running_process->current_state = PROCESS_RUNNING;
 
     dequeue(cpu->local_run_queue);
     cpu->running_process->start_time = timer_get_current_count(); // will be used for timekeeping
+    cpu->running_process->time_quantum = SCHED_QUANTUM(cpu->running_process->priority);
 
 #ifdef __x86_64__
     /*
@@ -151,9 +186,42 @@ void sched_run() {
 #endif
     DEBUG_PRINT("sched_run: CONTEXT SWITCH: NEW PAGE TABLE -> %x.64\n", cpu->running_process->page_map->top_level);
 
-    context_switch(cpu->scheduler_state, cpu->running_process->current_register_state,
-                   cpu->running_process->process_type == USER_PROCESS || cpu->running_process->process_type ==
-                   USER_THREAD, cpu->running_process->page_map->top_level);
+    /*
+     * tlb_switch_page_map picks the PCID and whether the TLB can be kept, or hands back 0 if this is a kernel thread and the
+     * kernel top level is already loaded.
+     *
+     * A user process only goes straight out to user mode the first time, once it has run it was switched away from somewhere
+     * in the kernel (the timer interrupt, or a system call that slept) and has to go back there.
+     */
+    const bool user = !cpu->running_process->started && (cpu->running_process->process_type == USER_PROCESS ||
+                                                         cpu->running_process->process_type == USER_THREAD);
+    cpu->running_process->started = true;
+
+    /*
+     * The spinlock bookkeeping (lock_depth, interrupts_before_lock) lives in struct cpu but really belongs to whatever is
+     * running, a process that switched away holding a lock (sched_sleep callers, anything that yields with a lock held) may be
+     * resumed on another CPU and still has to release it there. So like xv6 does with intena in sched(), swap ours out for the
+     * process's on the way in and put ours back once it comes out.
+     */
+    const uint64_t lock_depth = cpu->lock_depth;
+    const uint64_t interrupts_before_lock = cpu->interrupts_before_lock;
+    cpu->lock_depth = process->lock_depth;
+    cpu->interrupts_before_lock = process->interrupts_before_lock;
+
+    context_switch(cpu->scheduler_state, cpu->running_process->current_register_state, user,
+                   (void*)tlb_switch_page_map(cpu, cpu->running_process->page_map));
+
+    process->lock_depth = cpu->lock_depth;
+    process->interrupts_before_lock = cpu->interrupts_before_lock;
+    cpu->lock_depth = lock_depth;
+    cpu->interrupts_before_lock = interrupts_before_lock;
+
+    /* Back on the scheduler's stack, every register of process has been saved so anyone can run it now */
+    __atomic_store_n(&process->on_cpu, false, __ATOMIC_RELEASE);
+
+    if (interrupts) {
+        enable_interrupts();
+    }
 }
 
 /*
@@ -164,12 +232,75 @@ void sched_preempt() {
     DEBUG_PRINT("sched_preempt: entering\n");
     struct cpu* cpu = my_cpu();
     struct process* process = cpu->running_process;
-    process->ticks_taken += process->start_time;
     process->start_time = 0;
     enqueue(my_cpu()->local_run_queue, process, process->priority);
     process->current_state = PROCESS_READY;
     context_switch(my_cpu()->running_process->current_register_state, cpu->scheduler_state,false,
-                   kernel_pg_map->top_level);
+                   (void*)tlb_switch_page_map(cpu, kernel_pg_map));
+}
+
+/*
+ * Nothing on our run queue or the global one, so stop ticking and halt until somebody hands us work (sched_kick) or
+ * SCHED_IDLE_MAX_MS goes by.
+ *
+ * The idle flag goes up before the queues are looked at one last time, and anyone queueing work looks at the flag only after
+ * the work is queued. So either we see their work here and do not sleep, or they see the flag and wake us.
+ */
+static void sched_idle(struct cpu* cpu) {
+#ifdef _DFS_
+    serial_printf("DFS: Local Run Queue is Empty \n");
+#endif
+#ifdef _DPS_
+    serial_printf("DPS: Local Run Queue is Empty \n");
+#endif
+    __atomic_store_n(&cpu->idle, true, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&cpu->local_run_queue->head, __ATOMIC_SEQ_CST) != NULL ||
+        __atomic_load_n(&sched_global_queue.node_count, __ATOMIC_SEQ_CST) != 0) {
+        __atomic_store_n(&cpu->idle, false, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    cpu->idle_entries++;
+    timer_idle(cpu, timer_wheel_idle_ms(SCHED_IDLE_MAX_MS)); /* Sooner if something on our timer wheel is due before then */
+}
+
+/*
+ * Let cpu know it has work, if it is idle it is woken up. Only the CPU that clears the idle flag sends the IPI so a CPU that
+ * is handed a pile of work at once is only woken the one time.
+ */
+void sched_kick(struct cpu* cpu) {
+    if (cpu != my_cpu() && __atomic_exchange_n(&cpu->idle, false, __ATOMIC_SEQ_CST)) {
+        timer_wake_cpu(cpu);
+    }
+}
+
+/*
+ * Called on every CPU from its timer interrupt, after the interrupt has been acknowledged. The running process is charged the
+ * tick and once its quantum is used up it is preempted right here, it carries on from inside the interrupt handler the next
+ * time it is picked.
+ *
+ * Only a process that is actually running is touched, after a yield, sleep or preempt running_process still points at it
+ * while we are back in the scheduler. A process that is inside a system call is not preempted either since the syscall stack
+ * is per CPU, not per process, and whatever ran next could make a system call on top of it. It gets preempted on the first
+ * tick after it comes back out.
+ */
+void sched_tick() {
+    struct process* process = my_cpu()->running_process;
+
+    if (process == NULL || process->current_state != PROCESS_RUNNING) {
+        return;
+    }
+
+    process->ticks_taken++;
+
+    if (process->time_quantum != 0) {
+        process->time_quantum--;
+    }
+
+    if (process->time_quantum == 0 && !process->inside_kernel) {
+        sched_preempt();
+    }
 }
 
 /*
@@ -179,36 +310,96 @@ void sched_preempt() {
  */
 void sched_sleep(void* sleep_channel) {
     struct process* process = current_process();
-    doubly_linked_list_insert_head(&global_sleep_queue, process);
+    const uint64_t interrupts = are_interrupts_enabled();
+    acquire_spinlock(&sched_sleep_lock);
     process->sleep_channel = sleep_channel;
     process->current_state = PROCESS_SLEEPING;
-    process->ticks_taken += process->start_time;
     process->start_time = timer_get_current_count();
+    doubly_linked_list_insert_head(&global_sleep_queue, process);
+    release_spinlock(&sched_sleep_lock);
     context_switch(my_cpu()->running_process->current_register_state, process->current_cpu->scheduler_state,false,
-                   kernel_pg_map->top_level);
+                   (void*)tlb_switch_page_map(process->current_cpu, kernel_pg_map));
+    sched_check_interrupts(interrupts, "sched_sleep: resumed with interrupts off");
 }
 
+/*
+ * Wake everything sleeping on this channel and put it back on the run queue of the CPU it went to sleep on. It may not have
+ * finished switching away from it yet, on_cpu stays set until it has so nobody can run or steal a half saved process.
+ */
 void sched_wakeup(const void* wakeup_channel) {
     acquire_spinlock(&sched_sleep_lock);
     struct doubly_linked_list_node* node = global_sleep_queue.head;
     if (node == NULL) {
+        release_spinlock(&sched_sleep_lock);
         return;
     }
-    struct process* process = node->data;
-    while (node && process) {
-        process = node->data;
+
+    while (node) {
+        struct doubly_linked_list_node* next = node->next; /* node is gone once it is removed so grab this first */
+        struct process* process = node->data;
 
         if (process->sleep_channel == wakeup_channel) {
-            process->sleep_channel = 0;
-            process->ticks_slept += process->start_time;
-            process->start_time = 0;
-            doubly_linked_list_remove_node_by_address(&global_sleep_queue, node);
+            sched_wake_node(node);
         }
-        node = node->next;
+        node = next;
     }
     release_spinlock(&sched_sleep_lock);
 };
 
+/*
+ * Take a sleeping process off the sleep queue and put it back on its run queue, sched_sleep_lock must be held
+ */
+static void sched_wake_node(struct doubly_linked_list_node* node) {
+    struct process* process = node->data;
+    process->sleep_channel = 0;
+    process->ticks_slept += process->start_time;
+    process->start_time = 0;
+    doubly_linked_list_remove_node_by_address(&global_sleep_queue, node);
+    kfree(node);
+    process->current_state = PROCESS_READY;
+    enqueue(process->current_cpu->local_run_queue, process, process->priority);
+    sched_kick(process->current_cpu);
+}
+
+/*
+ * A sched_sleep_timeout deadline went by, runs from the timer interrupt on the CPU the process went to sleep on. If it has
+ * already been woken through its channel it won't be on the sleep queue anymore and there is nothing to do.
+ */
+static void sched_sleep_expired(void* data) {
+    acquire_spinlock(&sched_sleep_lock);
+    for (struct doubly_linked_list_node* node = global_sleep_queue.head; node != NULL; node = node->next) {
+        if (node->data == data) {
+            sched_wake_node(node);
+            break;
+        }
+    }
+    release_spinlock(&sched_sleep_lock);
+}
+
+/*
+ * sched_sleep with a deadline, we wake up on sched_wakeup(sleep_channel) or after millis, whichever comes first. Returns
+ * KERN_TIMEOUT if it was the deadline. With a NULL channel nothing else can wake us so it is just a sleep for millis.
+ *
+ * The timer goes on this CPU's wheel and interrupts stay off until we have switched away, so it can't go off and put us
+ * back on the run queue while we are still running. Cancelling it once we are back tells us which one woke us, and waits
+ * out the callback if it is running on the other CPU right now so sleep_timer is free for the next sleep.
+ */
+int64_t sched_sleep_timeout(void* sleep_channel, const uint64_t millis) {
+    struct process* process = current_process();
+    const uint64_t interrupts = are_interrupts_enabled();
+    disable_interrupts();
+
+    timer_event_init(&process->sleep_timer, sched_sleep_expired, process);
+    timer_event_arm(&process->sleep_timer, millis);
+    sched_sleep(sleep_channel != NULL ? sleep_channel : &process->sleep_timer);
+
+    const bool woken = timer_event_cancel(&process->sleep_timer);
+    if (interrupts) {
+        enable_interrupts();
+    }
+    return woken ? KERN_SUCCESS : KERN_TIMEOUT;
+}
+
 /*
  * Attempts to steal a process from a rival processor, only bother stealing if a run-queue is longer than 2 nodes
  */
@@ -228,7 +419,8 @@ void sched_claim_process() {
             goto done;
         }
 
-        if (queue->node_count > 2) {
+        /* The tail could be a process that went to sleep or yielded and is still being switched away from, see on_cpu */
+        if (queue->node_count > 2 && !__atomic_load_n(&((struct process*)queue->tail->data)->on_cpu, __ATOMIC_ACQUIRE)) {
             enqueue(this_cpu->local_run_queue, queue->tail, queue->tail->priority);
             this_cpu->local_run_queue->tail = this_cpu->local_run_queue->tail->prev;
             this_cpu->local_run_queue->node_count--;
@@ -249,7 +441,8 @@ void sched_exit() {
     struct process* process = cpu->running_process;
     singly_linked_list_insert_head(&dead_processes[cpu->cpu_id], process);
     my_cpu()->running_process = NULL;
-    context_switch(process->current_register_state, cpu->scheduler_state, false, kernel_pg_map->top_level);
+    context_switch(process->current_register_state, cpu->scheduler_state, false,
+                   (void*)tlb_switch_page_map(cpu, kernel_pg_map));
 }
 
 /*
@@ -311,6 +504,17 @@ void global_enqueue_process(struct process* process) {
     acquire_spinlock(&sched_global_lock);
     enqueue(&sched_global_queue, process, process->priority);
     release_spinlock(&sched_global_lock);
+
+    /*
+     * Any CPU can take it from the global queue, wake the first idle one we find. If none are idle they will all get to it
+     * when they next run out of work.
+     */
+    for (uint64_t i = 0; i < cpu_count && i < MAX_CPUS; i++) {
+        if (__atomic_load_n(&cpu_list[i].idle, __ATOMIC_SEQ_CST)) {
+            sched_kick(&cpu_list[i]);
+            break;
+        }
+    }
 }
 
 //#endif
@@ -0,0 +1,298 @@
+//
+// Created by dustyn on 10/17/26.
+//
+#include "include/scheduling/timer_wheel.h"
+#include "include/architecture/arch_cpu.h"
+#include "include/architecture/arch_timer.h"
+#include "include/definitions/definitions.h"
+
+#define TIMER_WHEEL_NS_PER_MS 1000000
+#define TIMER_WHEEL_NONE UINT64_MAX /* Returned by timer_wheel_next_expiry when there is nothing armed */
+
+struct timer_wheel timer_wheels[MAX_CPUS];
+
+static uint64_t timer_wheel_now() {
+    return clock_monotonic_ns() / TIMER_WHEEL_NS_PER_MS;
+}
+
+/*
+ * Called once during bootstrap before any CPU starts its LAPIC timer, each CPU only ever advances its own wheel
+ */
+void timer_wheels_init() {
+    const uint64_t now = timer_wheel_now();
+    for (uint64_t i = 0; i < MAX_CPUS; i++) {
+        timer_wheel_init(&timer_wheels[i], now);
+    }
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, const uint64_t now) {
+    initlock(&wheel->lock, TIMER_WHEEL_LOCK);
+    wheel->clock = now;
+    wheel->pending = 0;
+    wheel->running = NULL;
+    for (uint64_t i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+        wheel->occupied[i] = 0;
+    }
+    for (uint64_t i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++) {
+        wheel->slots[i] = NULL;
+    }
+}
+
+void timer_event_init(struct timer_event *event, void (*callback)(void *data), void *data) {
+    event->next = NULL;
+    event->pprev = NULL;
+    event->expires = 0;
+    event->callback = callback;
+    event->data = data;
+    event->wheel = NULL;
+    event->slot = TIMER_WHEEL_NO_SLOT;
+    event->pending = false;
+}
+
+static void timer_event_link(struct timer_event **head, struct timer_event *event) {
+    event->next = *head;
+    if (event->next != NULL) {
+        event->next->pprev = &event->next;
+    }
+    event->pprev = head;
+    *head = event;
+}
+
+static void timer_event_unlink(struct timer_event *event) {
+    *event->pprev = event->next;
+    if (event->next != NULL) {
+        event->next->pprev = event->pprev;
+    }
+    event->next = NULL;
+    event->pprev = NULL;
+}
+
+/*
+ * Take a pending event off its wheel, the slot's bit is cleared if we were the last thing in it. The event might not be in a
+ * slot at all if a tick has already pulled it out to be fired, in which case it is just unlinked from that list and will not
+ * be fired. Wheel lock must be held.
+ */
+static void timer_wheel_remove(struct timer_wheel *wheel, struct timer_event *event) {
+    timer_event_unlink(event);
+
+    if (event->slot != TIMER_WHEEL_NO_SLOT && wheel->slots[event->slot] == NULL) {
+        wheel->occupied[event->slot / TIMER_WHEEL_SLOTS] &= ~BIT((event->slot % TIMER_WHEEL_SLOTS));
+    }
+
+    event->slot = TIMER_WHEEL_NO_SLOT;
+    event->pending = false;
+    wheel->pending--;
+}
+
+/*
+ * Put the event in the lowest level that can hold it. The expiry is rounded up to that level's granularity, which is where
+ * the 1/8th lateness comes from, and the slot is whatever that rounded expiry lands on. A slot on level n is only looked at
+ * when the clock is a multiple of its granularity so it has to be within TIMER_WHEEL_SLOTS of where the clock is now on that
+ * level, or it would land on a slot that is due before it.
+ */
+void timer_wheel_insert(struct timer_wheel *wheel, struct timer_event *event, uint64_t expires) {
+    acquire_spinlock(&wheel->lock);
+
+    if (expires < wheel->clock) {
+        expires = wheel->clock;
+    }
+
+    if (expires - wheel->clock > TIMER_WHEEL_MAX_MS) {
+        expires = wheel->clock + TIMER_WHEEL_MAX_MS;
+    }
+
+    uint64_t level = 0;
+    uint64_t bucket = expires;
+    for (; level < TIMER_WHEEL_LEVELS; level++) {
+        bucket = (expires + TIMER_WHEEL_GRANULARITY(level) - 1) >> TIMER_WHEEL_SHIFT(level);
+        if (bucket - (wheel->clock >> TIMER_WHEEL_SHIFT(level)) < TIMER_WHEEL_SLOTS) {
+            break;
+        }
+    }
+
+    const uint64_t slot = (level * TIMER_WHEEL_SLOTS) + (bucket & TIMER_WHEEL_SLOT_MASK);
+    event->expires = expires;
+    event->wheel = wheel;
+    event->slot = slot;
+    event->pending = true;
+    timer_event_link(&wheel->slots[slot], event);
+    wheel->occupied[level] |= BIT((bucket & TIMER_WHEEL_SLOT_MASK));
+    wheel->pending++;
+
+    release_spinlock(&wheel->lock);
+}
+
+/*
+ * The first ms anything on the wheel is due. On each level every occupied slot is somewhere in the TIMER_WHEEL_SLOTS slots
+ * starting at the first one the clock has not reached yet, so rotating the occupied bits round to start there and counting
+ * trailing zeros finds the earliest. Wheel lock must be held.
+ */
+static uint64_t timer_wheel_next_expiry_locked(const struct timer_wheel *wheel) {
+    uint64_t next = TIMER_WHEEL_NONE;
+
+    for (uint64_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        const uint64_t occupied = wheel->occupied[level];
+        if (occupied == 0) {
+            continue;
+        }
+
+        const uint64_t start = (wheel->clock + TIMER_WHEEL_GRANULARITY(level) - 1) >> TIMER_WHEEL_SHIFT(level);
+        const uint64_t rotate = start & TIMER_WHEEL_SLOT_MASK;
+        const uint64_t rotated = rotate ? (occupied >> rotate) | (occupied << (TIMER_WHEEL_SLOTS - rotate)) : occupied;
+        const uint64_t expiry = (start + __builtin_ctzll(rotated)) << TIMER_WHEEL_SHIFT(level);
+
+        if (expiry < next) {
+            next = expiry;
+        }
+    }
+
+    return next;
+}
+
+uint64_t timer_wheel_next_expiry(struct timer_wheel *wheel) {
+    acquire_spinlock(&wheel->lock);
+    const uint64_t next = timer_wheel_next_expiry_locked(wheel);
+    release_spinlock(&wheel->lock);
+    return next;
+}
+
+/*
+ * Empty every slot that is due at the wheel's current clock onto expired. Level 0's slot is always due, each level above is
+ * only due when the clock is also a multiple of its granularity, so we stop at the first level where it is not.
+ */
+static void timer_wheel_collect(struct timer_wheel *wheel, struct timer_event **expired) {
+    uint64_t clock = wheel->clock;
+
+    for (uint64_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        const uint64_t index = clock & TIMER_WHEEL_SLOT_MASK;
+
+        if (wheel->occupied[level] & BIT(index)) {
+            struct timer_event **slot = &wheel->slots[(level * TIMER_WHEEL_SLOTS) + index];
+            while (*slot != NULL) {
+                struct timer_event *event = *slot;
+                timer_event_unlink(event);
+                event->slot = TIMER_WHEEL_NO_SLOT;
+                timer_event_link(expired, event);
+            }
+            wheel->occupied[level] &= ~BIT(index);
+        }
+
+        if (clock & (TIMER_WHEEL_LEVEL_DIVISOR - 1)) {
+            break;
+        }
+        clock >>= TIMER_WHEEL_LEVEL_SHIFT;
+    }
+}
+
+/*
+ * Run every callback on expired. The lock is dropped around each one so a callback can arm events (including its own) and
+ * take whatever locks it likes, and running is set so timer_event_cancel can wait for it to finish.
+ */
+static void timer_wheel_fire(struct timer_wheel *wheel, struct timer_event **expired) {
+    while (*expired != NULL) {
+        struct timer_event *event = *expired;
+        timer_wheel_remove(wheel, event);
+        wheel->running = event;
+
+        release_spinlock(&wheel->lock);
+        event->callback(event->data);
+        acquire_spinlock(&wheel->lock);
+
+        wheel->running = NULL;
+    }
+}
+
+/*
+ * Bring the wheel up to now, firing everything that is due on the way. Rather than stepping through every ms we jump straight
+ * to the next thing that is due, so a CPU that has been idle for a while does not have to replay all the ticks it slept
+ * through, and a tick where nothing is due costs the same however many events are pending.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, const uint64_t now) {
+    acquire_spinlock(&wheel->lock);
+
+    while (wheel->clock <= now) {
+        const uint64_t next = wheel->pending ? timer_wheel_next_expiry_locked(wheel) : TIMER_WHEEL_NONE;
+        if (next > now) {
+            wheel->clock = now + 1;
+            break;
+        }
+
+        struct timer_event *expired = NULL;
+        wheel->clock = next;
+        timer_wheel_collect(wheel, &expired);
+        wheel->clock++;
+        timer_wheel_fire(wheel, &expired);
+    }
+
+    release_spinlock(&wheel->lock);
+}
+
+/*
+ * Called from every CPU's timer interrupt, callbacks run right here in interrupt context
+ */
+void timer_wheel_tick() {
+    timer_wheel_advance(&timer_wheels[my_cpu()->cpu_id], timer_wheel_now());
+}
+
+/*
+ * How long this CPU can sleep for before its next event is due, at most max_millis and at least 1 since a one shot of 0 would
+ * never go off
+ */
+uint64_t timer_wheel_idle_ms(const uint64_t max_millis) {
+    const uint64_t next = timer_wheel_next_expiry(&timer_wheels[my_cpu()->cpu_id]);
+    const uint64_t now = timer_wheel_now();
+
+    if (next == TIMER_WHEEL_NONE) {
+        return max_millis;
+    }
+
+    if (next <= now) {
+        return 1;
+    }
+
+    return next - now < max_millis ? next - now : max_millis;
+}
+
+/*
+ * Arm the event to go off millis from now on this CPU's wheel, the callback will run on this CPU. If it was already armed it
+ * is moved, it does not go off twice.
+ */
+void timer_event_arm(struct timer_event *event, const uint64_t millis) {
+    struct timer_wheel *old = event->wheel;
+    if (old != NULL) {
+        acquire_spinlock(&old->lock);
+        if (event->pending) {
+            timer_wheel_remove(old, event);
+        }
+        release_spinlock(&old->lock);
+    }
+
+    timer_wheel_insert(&timer_wheels[my_cpu()->cpu_id], event, timer_wheel_now() + millis);
+}
+
+/*
+ * Disarm the event, returns true if it had not gone off yet. If its callback is running on another CPU right now we wait for
+ * it to finish so that once this returns the event (and whatever it is embedded in) can be reused or freed. Never call this on
+ * an event from inside its own callback, it would wait for itself forever.
+ */
+bool timer_event_cancel(struct timer_event *event) {
+    struct timer_wheel *wheel = event->wheel;
+    if (wheel == NULL) {
+        return false;
+    }
+
+    acquire_spinlock(&wheel->lock);
+    const bool pending = event->pending;
+    if (pending) {
+        timer_wheel_remove(wheel, event);
+    }
+
+    while (wheel->running == event) {
+        release_spinlock(&wheel->lock);
+        asm volatile("pause");
+        acquire_spinlock(&wheel->lock);
+    }
+    release_spinlock(&wheel->lock);
+
+    return pending;
+}
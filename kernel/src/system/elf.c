@@ -76,10 +76,10 @@ int64_t load_elf(struct process *process, char *path, size_t base_address, elf_i
     }
     DEBUG_PRINT("load_elf LOCK %i\n",process->handle_list->handle_list->lock.locked);
     /*
-     *WEE WOO WEE WOO
-     * This is where the corruption is happening
+     * The header used to be read with the size argument mixed up with the return check, so only its first byte ever came in
      */
-    if (read(handle, (char *) header, sizeof(elf64_hdr) != KERN_SUCCESS)) {
+    struct vnode *elf = handle_to_vnode(handle);
+    if (elf == NULL || vnode_read(elf, 0, sizeof(elf64_hdr), (char *) header) != KERN_SUCCESS) {
         if (init) {
             my_cpu()->running_process = NULL;
         }
@@ -115,22 +115,21 @@ DEBUG_PRINT("load_elf: e_type=%x.64 e_machine=0x%x.64 e_version=0x%x.64 e_entry=
         }
         return KERN_WRONG_TYPE;
     }
-    struct vnode *elf = handle_to_vnode(handle);
-    char *elf_file = kzmalloc(elf->vnode_size);
-
-    int64_t ret = vnode_read(elf,0,elf->vnode_size,elf_file);
-
-    if (ret != KERN_SUCCESS) {
+    /*
+     * Only the program headers are read in here. PT_LOAD segments become file backed regions and nothing is allocated or read
+     * for them until the process touches a page, see handle_region_fault. The handle is never closed so the vnode outlives
+     * the process, same as it always has.
+     */
+    elf64_phdr *program_headers = kzmalloc(header->e_phnum * sizeof(elf64_phdr));
+    if (vnode_read(elf, header->e_phoff, header->e_phnum * sizeof(elf64_phdr), (char *) program_headers) != KERN_SUCCESS) {
         kprintf("vnode_read failed!\n");
         panic("COULD NOT READ ELF FILE!\n");
     }
 
     elf64_phdr *program_header;
     for (size_t i = 0; i < header->e_phnum; i++) {
-        size_t program_header_offset = header->e_phoff + (i * sizeof(elf64_phdr));
-        DEBUG_PRINT("load_elf: I %i HEAD OFFSET %i PROGRAM HEADER OFFSET %i\n",i,header->e_phoff,program_header_offset);
-        program_header = (elf64_phdr *) ((size_t) elf_file + program_header_offset);
-        DEBUG_PRINT("load_elf: P TYPE IS %i\n",program_header->p_type);
+        program_header = &program_headers[i];
+        DEBUG_PRINT("load_elf: I %i P TYPE IS %i\n",i,program_header->p_type);
         switch (program_header->p_type) {
             case PT_LOAD:
                 uint64_t memory_protection = 0;
@@ -142,6 +141,7 @@ DEBUG_PRINT("load_elf: e_type=%x.64 e_machine=0x%x.64 e_version=0x%x.64 e_entry=
                     if (init) {
                         my_cpu()->running_process = NULL;
                     }
+                    kfree(program_headers);
                     return KERN_BAD_DESCRIPTOR;
                 }
 
@@ -162,33 +162,21 @@ DEBUG_PRINT("load_elf: e_type=%x.64 e_machine=0x%x.64 e_version=0x%x.64 e_entry=
                 uint64_t page_count = ALIGN_UP(program_header->p_memsz + aligned_diff, PAGE_SIZE) / PAGE_SIZE;
 
                 DEBUG_PRINT("load_elf: PAGE COUNT %i MEM SIZE %x.64 ALIGNED DIFF %x.64 ALIGNED ADDRES %x.64 PVIRT %x.64 BASE %x.64\n",page_count,program_header->p_memsz,aligned_diff,aligned_address,program_header->p_vaddr,base_address);
-                for (size_t j = 0; j < page_count; j++) {
-                    uint64_t *physical_page = umalloc(1);
-                    serial_printf("MAPPING PAGE %x.64 TO VA %x.64\n",physical_page, (uint64_t *) (uint64_t)(aligned_address + (uint64_t) (j * PAGE_SIZE)));
-                    arch_map_single_page(process->page_map->top_level, (uint64_t) physical_page,
-                                  (uint64_t *) (( uint64_t)(aligned_address +  (j * PAGE_SIZE))), memory_protection);
-                    DEBUG_PRINT("load_elf: VA %x.64 PROTECTION %x.64\n",(uint64_t *) (( uint64_t)(aligned_address +  (j * PAGE_SIZE))),memory_protection);
-                    DEBUG_PRINT("load_elf: PHYSICAL %x.64 J %i\n",physical_page,j);
-
-                }
-
-                warn_printf("enter\n");
-                DEBUG_PRINT("load_elf: FOREIGN MAPPING NOW! ALIGNED ADDR %x.64\n",aligned_address);
-                arch_map_foreign(process->page_map->top_level, (uint64_t *) aligned_address, page_count);
-                DEBUG_PRINT("load_elf: FOREIGN %x.64",KERNEL_FOREIGN_MAP_BASE);
-                memcpy(((void *)((uint64_t) KERNEL_FOREIGN_MAP_BASE)),elf_file + program_header->p_offset,program_header->p_filesz);
-                memset((void *) KERNEL_FOREIGN_MAP_BASE + aligned_diff + program_header->p_filesz, 0,
-                       program_header->p_memsz - program_header->p_filesz);
-                DEBUG_PRINT("load_elf: unmap size: %i\n",PAGE_SIZE * page_count);
-                arch_unmap_foreign(PAGE_SIZE * page_count);
-                warn_printf("exit\n");
+                struct virtual_region *region = create_region(aligned_address, page_count,
+                                                              program_header->p_flags & PF_X ? TEXT : FILE,
+                                                              memory_protection, false);
+                region->file = elf;
+                region->file_va = program_header->p_vaddr + base_address;
+                region->file_offset = program_header->p_offset;
+                region->file_size = program_header->p_filesz;
+                attach_lazy_region(process->page_map, region);
                 break;
             case PT_PHDR:
                 info->at_phdr = base_address + program_header->p_vaddr;
                 break;
             case PT_INTERP:
-                info->ld_path = kzmalloc(program_header->p_filesz);
-                info->ld_path = (char *) ((uint64_t) elf_file + program_header->p_filesz);
+                info->ld_path = kzmalloc(program_header->p_filesz + 1);
+                vnode_read(elf, program_header->p_offset, program_header->p_filesz, info->ld_path);
                 break;
             default:
                 DEBUG_PRINT("load_elf: Unknown elf section!\n");
@@ -202,24 +190,14 @@ DEBUG_PRINT("load_elf: e_type=%x.64 e_machine=0x%x.64 e_version=0x%x.64 e_entry=
 #ifdef __x86_64__
     process->current_register_state->rip = header->e_entry;
     DEBUG_PRINT("load_elf: ENTRY ADDRESS : %x.64\n",header->e_entry);
-    process->current_register_state->rsp = (uint64_t) USER_STACK_TOP;
-    process->current_register_state->rbp = USER_STACK_TOP;
+    process->current_register_state->user_rsp = USER_STACK_TOP;
 #endif
     if (init) {
        // my_cpu()->running_process = NULL;
     }
 
-#ifdef  _DEBUG_
-    uint64_t *page = (uint64_t *)(check_page_mapping(process->page_map->top_level,(void *)0x0001000));
-    DEBUG_PRINT("PAGE DIR %x.64\n",process->page_map->top_level);
-    if (page != 0) {
-        DEBUG_PRINT("INSTR PAGE : PTE %x.64 , PTE ADDR : %x.64 PERMS %x.64\n",*page,PTE_ADDR(*page),PTE_FLAGS(*page));
-    }else {
-        panic("Page is not mapped");
-    }
-#endif
-
     DEBUG_PRINT("load_elf: LOAD SUCCESSFUL! ENTRY IS %x.64 PAGE TABLE IS %x.64\n",info->at_entry,process->page_map->top_level);
+    kfree(program_headers);
     kfree(header);
     DEBUG_PRINT("load_elf: Freed\n");
     return KERN_SUCCESS;
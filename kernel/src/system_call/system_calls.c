@@ -5,6 +5,7 @@
 #include "include/system_call/system_calls.h"
 #include "include/definitions/definitions.h"
 #include "include/scheduling/process.h"
+#include "include/architecture/arch_timer.h"
 
 void* syscall_stack[MAX_CPUS];
 
@@ -39,6 +40,12 @@ int64_t system_call_dispatch(int64_t syscall_no, struct syscall_args args) {
     case SYS_OPEN:
         ret = open((char*)args.arg1);
         goto exit;
+    case SYS_FORK:
+        ret = fork(args.arg1, args.arg2);
+        goto exit;
+    case SYS_CLOCK_GETTIME:
+        ret = clock_gettime(args.arg1, (struct kernel_timespec*)args.arg2);
+        goto exit;
     case SYS_MOUNT:
         return mount((char*)args.arg1, (char*)args.arg2);
     case SYS_UNMOUNT:
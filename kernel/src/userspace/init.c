@@ -19,6 +19,8 @@ enum system_calls {
     SYS_CREATE,
     SYS_HEAP_GROW,
     SYS_HEAP_SHRINK,
+    SYS_FORK,
+    SYS_CLOCK_GETTIME,
     MAX_SYS
 };
 
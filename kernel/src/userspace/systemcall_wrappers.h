@@ -25,6 +25,8 @@ enum system_calls {
     SYS_CREATE,
     SYS_HEAP_GROW,
     SYS_HEAP_SHRINK,
+    SYS_FORK,
+    SYS_CLOCK_GETTIME,
     MAX_SYS
 };
 
@@ -118,6 +120,10 @@ static inline int64_t sys_seek(uint64_t handle, uint64_t whence) {
     return syscall_stub((uint64_t)SYS_SEEK, handle, whence, 0, 0, 0, 0);
 }
 
+static inline int64_t sys_clock_gettime(uint64_t clock_id, void *timespec) {
+    return syscall_stub((uint64_t)SYS_CLOCK_GETTIME, clock_id, (uint64_t)timespec, 0, 0, 0, 0);
+}
+
 static inline int64_t sys_exit() {
     return syscall_stub((uint64_t)SYS_EXIT, 0, 0, 0, 0, 0, 0);
 }